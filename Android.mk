@@ -52,7 +52,10 @@ LOCAL_CFLAGS := -std=c11 -Wno-unused-parameter
 
 LOCAL_SRC_FILES := \
 	gralloc_drm.c \
-	gralloc_drm_kms.c
+	gralloc_drm_blit.c \
+	gralloc_drm_dumb.c \
+	gralloc_drm_kms.c \
+	gralloc_drm_layout.c
 
 LOCAL_EXPORT_C_INCLUDE_DIRS := \
 	$(LOCAL_PATH)
@@ -123,4 +126,21 @@ LOCAL_VENDOR_MODULE := true
 LOCAL_CFLAGS := -std=c11 -Wno-unused-parameter
 include $(BUILD_SHARED_LIBRARY)
 
+
+include $(CLEAR_VARS)
+LOCAL_SRC_FILES := \
+	gralloc_drm_bench.c \
+
+LOCAL_SHARED_LIBRARIES := \
+	libgralloc_drm \
+	libdrm \
+	liblog \
+	libcutils \
+
+LOCAL_MODULE := gralloc_drm_bench
+LOCAL_MODULE_TAGS := optional
+LOCAL_VENDOR_MODULE := true
+LOCAL_CFLAGS := -std=c11 -Wno-unused-parameter
+include $(BUILD_EXECUTABLE)
+
 endif # DRM_GPU_DRIVERS
@@ -28,10 +28,12 @@
 #include <stdarg.h>
 #include <pthread.h>
 #include <errno.h>
+#include <unistd.h>
 
 #include "gralloc_drm.h"
 #include "gralloc_drm_priv.h"
 
+/* serializes handle import; bos are locked individually */
 static pthread_mutex_t gralloc_lock = PTHREAD_MUTEX_INITIALIZER;
 
 /*
@@ -97,6 +99,101 @@ static int drm_mod_perform(const struct gralloc_module_t *mod, int op, ...)
 			err = 0;
 		}
 		break;
+	case GRALLOC_MODULE_PERFORM_SET_POST_RELEASE:
+		{
+			gralloc_drm_post_release_t callback =
+				va_arg(args, gralloc_drm_post_release_t);
+			void *data = va_arg(args, void *);
+			gralloc_drm_set_post_release(dmod->drm, callback, data);
+			err = 0;
+		}
+		break;
+	case GRALLOC_MODULE_PERFORM_GET_POST_STATS:
+		{
+			struct gralloc_drm_post_stats *stats =
+				va_arg(args, struct gralloc_drm_post_stats *);
+			err = gralloc_drm_get_post_stats(dmod->drm, stats);
+		}
+		break;
+	case GRALLOC_MODULE_PERFORM_TRIM_BO_CACHE:
+		{
+			/* the number of bytes that may stay cached */
+			size_t budget = va_arg(args, size_t);
+			gralloc_drm_bo_cache_trim(dmod->drm, budget);
+			err = 0;
+		}
+		break;
+	case GRALLOC_MODULE_PERFORM_POST_FENCED:
+		{
+			/* the acquire fence is closed by gralloc */
+			buffer_handle_t handle = va_arg(args, buffer_handle_t);
+			int acquire_fence = va_arg(args, int);
+			int *present_fence = va_arg(args, int *);
+			struct gralloc_drm_bo_t *bo;
+
+			bo = gralloc_drm_bo_from_handle(handle);
+			if (bo) {
+				err = gralloc_drm_bo_queue_post(bo,
+						acquire_fence, present_fence);
+			}
+			else {
+				if (acquire_fence >= 0)
+					close(acquire_fence);
+				err = -EINVAL;
+			}
+		}
+		break;
+	case GRALLOC_MODULE_PERFORM_PRESENT_AT:
+		{
+			/* the acquire fence is closed by gralloc */
+			buffer_handle_t handle = va_arg(args, buffer_handle_t);
+			int acquire_fence = va_arg(args, int);
+			int target_type = va_arg(args, int);
+			uint64_t target = va_arg(args, uint64_t);
+			struct gralloc_drm_bo_t *bo;
+
+			bo = gralloc_drm_bo_from_handle(handle);
+			if (bo) {
+				err = gralloc_drm_bo_present(bo, acquire_fence,
+						target_type, target);
+			}
+			else {
+				if (acquire_fence >= 0)
+					close(acquire_fence);
+				err = -EINVAL;
+			}
+		}
+		break;
+	case GRALLOC_MODULE_PERFORM_SET_PRESENT_CALLBACK:
+		{
+			gralloc_drm_present_t callback =
+				va_arg(args, gralloc_drm_present_t);
+			void *data = va_arg(args, void *);
+			gralloc_drm_set_present_callback(dmod->drm,
+					callback, data);
+			err = 0;
+		}
+		break;
+	case GRALLOC_MODULE_PERFORM_CAPTURE:
+		{
+			int display = va_arg(args, int);
+			int width = va_arg(args, int);
+			int height = va_arg(args, int);
+			gralloc_drm_capture_t callback =
+				va_arg(args, gralloc_drm_capture_t);
+			void *data = va_arg(args, void *);
+			err = gralloc_drm_capture(dmod->drm, display,
+					width, height, callback, data);
+		}
+		break;
+	case GRALLOC_MODULE_PERFORM_SET_DAMAGE:
+		{
+			const struct gralloc_drm_rect *rects =
+				va_arg(args, const struct gralloc_drm_rect *);
+			int count = va_arg(args, int);
+			err = gralloc_drm_set_damage(dmod->drm, rects, count);
+		}
+		break;
 	default:
 		err = -EINVAL;
 		break;
@@ -139,21 +236,12 @@ static int drm_mod_lock(const gralloc_module_t *mod, buffer_handle_t handle,
 		int usage, int x, int y, int w, int h, void **ptr)
 {
 	struct gralloc_drm_bo_t *bo;
-	int err;
-
-	pthread_mutex_lock(&gralloc_lock);
 
 	bo = gralloc_drm_bo_from_handle(handle);
-	if (!bo) {
-		err = -EINVAL;
-		goto unlock;
-	}
-
-	err = gralloc_drm_bo_lock(bo, usage, x, y, w, h, ptr);
+	if (!bo)
+		return -EINVAL;
 
-unlock:
-	pthread_mutex_unlock(&gralloc_lock);
-	return err;
+	return gralloc_drm_bo_lock(bo, usage, x, y, w, h, ptr);
 }
 
 static int drm_mod_lock_ycbcr(const gralloc_module_t *mod, buffer_handle_t bhandle,
@@ -170,6 +258,10 @@ static int drm_mod_lock_ycbcr(const gralloc_module_t *mod, buffer_handle_t bhand
 	handle = bo->handle;
 
 	switch(handle->format) {
+	case HAL_PIXEL_FORMAT_YV12:
+	case HAL_PIXEL_FORMAT_DRM_NV12:
+	case HAL_PIXEL_FORMAT_YCbCr_422_SP:
+	case HAL_PIXEL_FORMAT_YCrCb_420_SP:
 	case HAL_PIXEL_FORMAT_YCbCr_420_888:
 		break;
 	default:
@@ -180,41 +272,96 @@ static int drm_mod_lock_ycbcr(const gralloc_module_t *mod, buffer_handle_t bhand
 	if (err)
 		return err;
 
-	switch(handle->format) {
-	case HAL_PIXEL_FORMAT_YCbCr_420_888:
-		ycbcr->y = ptr;
-		ycbcr->cb = (uint8_t *)ptr + handle->stride * handle->height;
+	/* the planes are laid out by gralloc_drm_handle_init_planes */
+	ycbcr->y = ptr;
+	ycbcr->ystride = handle->pitches[0];
+	ycbcr->cstride = handle->pitches[1];
+
+	if (handle->plane_count == 3) {
+		ycbcr->cb = (uint8_t *)ptr + handle->offsets[1];
+		ycbcr->cr = (uint8_t *)ptr + handle->offsets[2];
+		ycbcr->chroma_step = 1;
+	}
+	else if (handle->format == HAL_PIXEL_FORMAT_YCrCb_420_SP) {
+		ycbcr->cr = (uint8_t *)ptr + handle->offsets[1];
+		ycbcr->cb = (uint8_t *)ycbcr->cr + 1;
+		ycbcr->chroma_step = 2;
+	}
+	else {
+		ycbcr->cb = (uint8_t *)ptr + handle->offsets[1];
 		ycbcr->cr = (uint8_t *)ycbcr->cb + 1;
-		ycbcr->ystride = handle->stride;
-		ycbcr->cstride = handle->stride;
 		ycbcr->chroma_step = 2;
-		break;
-	default:
-		break;
 	}
 
 	return 0;
 }
 
+/*
+ * Wait for and close the fence of an async lock.
+ */
+static int drm_mod_wait_lock_fence(int fence)
+{
+	int err;
+
+	if (fence < 0)
+		return 0;
+
+	err = gralloc_drm_wait_fence(fence, -1);
+	close(fence);
+
+	return err;
+}
+
+static int drm_mod_lock_async(const gralloc_module_t *mod,
+		buffer_handle_t handle, int usage, int x, int y, int w, int h,
+		void **ptr, int fence)
+{
+	int err;
+
+	err = drm_mod_wait_lock_fence(fence);
+	if (err)
+		return err;
+
+	return drm_mod_lock(mod, handle, usage, x, y, w, h, ptr);
+}
+
+static int drm_mod_lock_async_ycbcr(const gralloc_module_t *mod,
+		buffer_handle_t handle, int usage, int x, int y, int w, int h,
+		struct android_ycbcr *ycbcr, int fence)
+{
+	int err;
+
+	err = drm_mod_wait_lock_fence(fence);
+	if (err)
+		return err;
+
+	return drm_mod_lock_ycbcr(mod, handle, usage, x, y, w, h, ycbcr);
+}
+
 static int drm_mod_unlock(const gralloc_module_t *mod, buffer_handle_t handle)
 {
 	struct drm_module_t *dmod = (struct drm_module_t *) mod;
 	struct gralloc_drm_bo_t *bo;
-	int err = 0;
-
-	pthread_mutex_lock(&gralloc_lock);
 
 	bo = gralloc_drm_bo_from_handle(handle);
-	if (!bo) {
-		err = -EINVAL;
-		goto unlock;
-	}
+	if (!bo)
+		return -EINVAL;
 
 	gralloc_drm_bo_unlock(bo);
 
-unlock:
-	pthread_mutex_unlock(&gralloc_lock);
-	return err;
+	return 0;
+}
+
+/*
+ * CPU access is done by the time the bo is unmapped, so there is no release
+ * fence.
+ */
+static int drm_mod_unlock_async(const gralloc_module_t *mod,
+		buffer_handle_t handle, int *fence)
+{
+	*fence = -1;
+
+	return drm_mod_unlock(mod, handle);
 }
 
 static int drm_mod_close_gpu0(struct hw_device_t *dev)
@@ -230,21 +377,14 @@ static int drm_mod_free_gpu0(alloc_device_t *dev, buffer_handle_t handle)
 {
 	struct drm_module_t *dmod = (struct drm_module_t *) dev->common.module;
 	struct gralloc_drm_bo_t *bo;
-	int err = 0;
-
-	pthread_mutex_lock(&gralloc_lock);
 
 	bo = gralloc_drm_bo_from_handle(handle);
-	if (!bo) {
-		err = -EINVAL;
-		goto unlock;
-	}
+	if (!bo)
+		return -EINVAL;
 
 	gralloc_drm_bo_decref(bo);
 
-unlock:
-	pthread_mutex_unlock(&gralloc_lock);
-	return err;
+	return 0;
 }
 
 static int drm_mod_alloc_gpu0(alloc_device_t *dev,
@@ -259,13 +399,9 @@ static int drm_mod_alloc_gpu0(alloc_device_t *dev,
 	if (!bpp)
 		return -EINVAL;
 
-	pthread_mutex_lock(&gralloc_lock);
-
 	bo = gralloc_drm_bo_create(dmod->drm, w, h, format, usage);
-	if (!bo) {
-		err = -ENOMEM;
-		goto unlock;
-	}
+	if (!bo)
+		return -ENOMEM;
 
 	if (gralloc_drm_bo_need_fb(bo)) {
 		err = gralloc_drm_bo_add_fb(bo);
@@ -280,8 +416,6 @@ static int drm_mod_alloc_gpu0(alloc_device_t *dev,
 	/* in pixels */
 	*stride /= bpp;
 
-unlock:
-	pthread_mutex_unlock(&gralloc_lock);
 	return err;
 }
 
@@ -323,9 +457,11 @@ static int drm_mod_close_fb0(struct hw_device_t *dev)
 static int drm_mod_set_swap_interval_fb0(struct framebuffer_device_t *fb,
 		int interval)
 {
+	struct drm_module_t *dmod = (struct drm_module_t *) fb->common.module;
+
 	if (interval < fb->minSwapInterval || interval > fb->maxSwapInterval)
 		return -EINVAL;
-	return 0;
+	return gralloc_drm_set_swap_interval(dmod->drm, interval);
 }
 
 static int drm_mod_post_fb0(struct framebuffer_device_t *fb,
@@ -338,7 +474,21 @@ static int drm_mod_post_fb0(struct framebuffer_device_t *fb,
 	if (!bo)
 		return -EINVAL;
 
-	return gralloc_drm_bo_post(bo);
+	return gralloc_drm_bo_queue_post(bo, -1, NULL);
+}
+
+static int drm_mod_set_update_rect_fb0(struct framebuffer_device_t *fb,
+		int left, int top, int width, int height)
+{
+	struct drm_module_t *dmod = (struct drm_module_t *) fb->common.module;
+	struct gralloc_drm_rect rect;
+
+	rect.left = left;
+	rect.top = top;
+	rect.right = left + width;
+	rect.bottom = top + height;
+
+	return gralloc_drm_set_damage(dmod->drm, &rect, 1);
 }
 
 #include <GLES/gl.h>
@@ -374,6 +524,7 @@ static int drm_mod_open_fb0(struct drm_module_t *dmod, struct hw_device_t **dev)
 
 	fb->setSwapInterval = drm_mod_set_swap_interval_fb0;
 	fb->post = drm_mod_post_fb0;
+	fb->setUpdateRect = drm_mod_set_update_rect_fb0;
 	fb->compositionComplete = drm_mod_composition_complete_fb0;
 
 	gralloc_drm_get_kms_info(dmod->drm, fb);
@@ -432,11 +583,24 @@ struct drm_module_t HAL_MODULE_INFO_SYM = {
 		.unlock = drm_mod_unlock,
 		.perform = drm_mod_perform,
 		.lock_ycbcr = drm_mod_lock_ycbcr,
+		.lockAsync = drm_mod_lock_async,
+		.unlockAsync = drm_mod_unlock_async,
+		.lockAsync_ycbcr = drm_mod_lock_async_ycbcr,
 	},
 	.hwc_reserve_plane = gralloc_drm_reserve_plane,
 	.hwc_disable_planes = gralloc_drm_disable_planes,
 	.hwc_set_plane_handle = gralloc_drm_set_plane_handle,
 
 	.mutex = PTHREAD_MUTEX_INITIALIZER,
-	.drm = NULL
+	.drm = NULL,
+
+	.hwc_reserve_display_plane = gralloc_drm_reserve_display_plane,
+	.hwc_set_display_mode = gralloc_drm_set_display_mode,
+	.hwc_set_display_swap_interval = gralloc_drm_set_display_swap_interval,
+	.hwc_set_display_refresh = gralloc_drm_set_display_refresh,
+	.hwc_post_display = gralloc_drm_post_display,
+	.hwc_get_cursor_size = gralloc_drm_get_cursor_size,
+	.hwc_set_cursor = gralloc_drm_set_cursor,
+	.hwc_move_cursor = gralloc_drm_move_cursor,
+	.hwc_capture = gralloc_drm_capture,
 };
@@ -25,11 +25,17 @@
 
 #include <cutils/log.h>
 #include <cutils/atomic.h>
+#include <cutils/properties.h>
 #include <stdlib.h>
+#include <string.h>
 #include <errno.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/ioctl.h>
 #include <fcntl.h>
+#include <poll.h>
+#include <linux/dma-buf.h>
+#include <drm_fourcc.h>
 
 #include "gralloc_drm.h"
 #include "gralloc_drm_priv.h"
@@ -37,14 +43,31 @@
 #define unlikely(x) __builtin_expect(!!(x), 0)
 
 static int32_t gralloc_drm_pid = 0;
+static pthread_once_t gralloc_drm_pid_once = PTHREAD_ONCE_INIT;
+
+/*
+ * Forget the pid of the parent in a forked child, whose handles are then
+ * imported again.
+ */
+static void gralloc_drm_reset_pid(void)
+{
+	gralloc_drm_pid = 0;
+}
+
+static void gralloc_drm_init_pid(void)
+{
+	pthread_atfork(NULL, NULL, gralloc_drm_reset_pid);
+}
 
 /*
  * Return the pid of the process.
  */
 static int gralloc_drm_get_pid(void)
 {
-	if (unlikely(!gralloc_drm_pid))
+	if (unlikely(!gralloc_drm_pid)) {
+		pthread_once(&gralloc_drm_pid_once, gralloc_drm_init_pid);
 		android_atomic_write((int32_t) getpid(), &gralloc_drm_pid);
+	}
 
 	return gralloc_drm_pid;
 }
@@ -116,15 +139,19 @@ static const char *fbdrv_map[][2] = {
 	{ "virtiodrmfb",  "virtio_gpu" },
 };
 
+/* max number of DRM devices enumerated */
+#define DRM_DEVICES_MAX 16
+
 /*
- * Create a DRM device object.
+ * Open the card of the fbdev driver named by /proc/fb, which drmOpen may
+ * have to load a kernel module for.
  */
-struct gralloc_drm_t *gralloc_drm_create(void)
+static int gralloc_drm_open_fbdev(void)
 {
-	struct gralloc_drm_t *drm;
 	FILE *fb;
 	unsigned card, ret = 0;
 	char buf[64];
+	int fd = -1;
 
 	if ((fb = fopen("/proc/fb", "r"))) {
 		ret = fscanf(fb, "%u %s", &card, buf);
@@ -132,33 +159,206 @@ struct gralloc_drm_t *gralloc_drm_create(void)
 	}
 	if (ret != 2) {
 		ALOGE("failed to open /proc/fb");
-		return NULL;
+		return -1;
 	}
 
-	drm = calloc(1, sizeof(*drm));
-	if (!drm)
-		return NULL;
-
-	drm->fd = -1;
 	for (card = 0; card < sizeof(fbdrv_map) / sizeof(const char *) / 2; ++card) {
 		if (!strcmp(buf, fbdrv_map[card][0])) {
-			drm->fd = drmOpen(fbdrv_map[card][1], NULL);
-			ALOGD("drmOpen %s: %d", fbdrv_map[card][1], drm->fd);
+			fd = drmOpen(fbdrv_map[card][1], NULL);
+			ALOGD("drmOpen %s: %d", fbdrv_map[card][1], fd);
 			break;
 		}
 	}
 
-	if (drm->fd < 0) {
+	if (fd < 0)
 		ALOGE("failed to open driver for %s", buf);
-	} else {
-		drm->drv = init_drv_from_fd(drm->fd);
+
+	return fd;
+}
+
+/*
+ * Open the render node of a card for a process that is not the master of the
+ * card, to allocate and map bos without authentication by the master.  The
+ * card node is kept for KMS, should the process become the master later.
+ * Return -1 to allocate on the card node.
+ */
+static int gralloc_drm_open_render_node(drmDevicePtr device, int card_fd,
+	struct gralloc_drm_drv_t **drv)
+{
+	int fd;
+
+	if (!(device->available_nodes & (1 << DRM_NODE_RENDER)) ||
+	    drmIsMaster(card_fd) ||
+	    !property_get_bool("debug.drm.render_node", 1))
+		return -1;
+
+	fd = open(device->nodes[DRM_NODE_RENDER], O_RDWR | O_CLOEXEC);
+	if (fd < 0)
+		return -1;
+
+	*drv = init_drv_from_fd(fd);
+	if (!*drv) {
+		close(fd);
+		return -1;
+	}
+
+	ALOGD("opened %s", device->nodes[DRM_NODE_RENDER]);
+
+	return fd;
+}
+
+/*
+ * Open the render node of another device than the display device, for the
+ * bos that are not scanned out.  It is used when the display controller
+ * has no supported driver, or when debug.drm.offload is set.
+ */
+static void gralloc_drm_open_render_device(struct gralloc_drm_t *drm,
+	drmDevicePtr *devices, int count, int display)
+{
+	int i;
+
+	for (i = 0; i < count; i++) {
+		struct gralloc_drm_drv_t *drv;
+		int fd;
+
+		if (i == display ||
+		    !(devices[i]->available_nodes & (1 << DRM_NODE_RENDER)))
+			continue;
+
+		fd = open(devices[i]->nodes[DRM_NODE_RENDER],
+				O_RDWR | O_CLOEXEC);
+		if (fd < 0)
+			continue;
+
+		drv = init_drv_from_fd(fd);
+		if (!drv) {
+			close(fd);
+			continue;
+		}
+
+		drv->render_node = 1;
+		drm->render_fd = fd;
+		drm->render_drv = drv;
+		ALOGI("rendering on %s", devices[i]->nodes[DRM_NODE_RENDER]);
+		break;
+	}
+}
+
+/*
+ * Open the first card with KMS, or the first card with a supported driver
+ * when none has KMS.  The cards are enumerated from sysfs without loading
+ * kernel modules.  A display controller without a supported driver gets
+ * dumb bos, and another device renders.  drm->render_node is set when the
+ * render node of the card allocates the bos, with its fd in drm->drv_fd.
+ */
+static int gralloc_drm_open_card(struct gralloc_drm_t *drm)
+{
+	drmDevicePtr devices[DRM_DEVICES_MAX];
+	int count, i, display = -1, fd = -1, dumb = 0;
+
+	count = drmGetDevices2(0, devices, DRM_DEVICES_MAX);
+	if (count <= 0)
+		return -1;
+
+	for (int kms = 1; kms >= 0 && fd < 0; kms--) {
+		for (i = 0; i < count && fd < 0; i++) {
+			struct gralloc_drm_drv_t *render_drv;
+			int render_fd;
+
+			if (!(devices[i]->available_nodes &
+			      (1 << DRM_NODE_PRIMARY)))
+				continue;
+
+			fd = open(devices[i]->nodes[DRM_NODE_PRIMARY],
+					O_RDWR | O_CLOEXEC);
+			if (fd < 0)
+				continue;
+
+			if (drmIsKMS(fd) == kms) {
+				drm->drv = init_drv_from_fd(fd);
+				if (!drm->drv && kms) {
+					drm->drv =
+						gralloc_drm_drv_create_for_dumb(fd);
+					dumb = !!drm->drv;
+				}
+			}
+			if (!drm->drv) {
+				close(fd);
+				fd = -1;
+				continue;
+			}
+
+			display = i;
+			ALOGD("opened %s", devices[i]->nodes[DRM_NODE_PRIMARY]);
+			if (dumb)
+				break;
+
+			render_fd = gralloc_drm_open_render_node(devices[i],
+					fd, &render_drv);
+			if (render_fd >= 0) {
+				drm->drv->destroy(drm->drv);
+				drm->drv = render_drv;
+				drm->drv_fd = render_fd;
+				drm->render_node = 1;
+			}
+		}
+	}
+
+	if (fd >= 0 && (dumb || property_get_bool("debug.drm.offload", 0)))
+		gralloc_drm_open_render_device(drm, devices, count, display);
+
+	drmFreeDevices(devices, count);
+
+	return fd;
+}
+
+/*
+ * Create a DRM device object.
+ */
+struct gralloc_drm_t *gralloc_drm_create(void)
+{
+	struct gralloc_drm_t *drm;
+
+	drm = calloc(1, sizeof(*drm));
+	if (!drm)
+		return NULL;
+
+	drm->render_fd = -1;
+	drm->drv_fd = -1;
+	drm->fd = gralloc_drm_open_card(drm);
+
+	/* kernels without sysfs enumeration */
+	if (drm->fd < 0) {
+		drm->fd = gralloc_drm_open_fbdev();
+		if (drm->fd >= 0)
+			drm->drv = init_drv_from_fd(drm->fd);
 	}
 
 	if (!drm->drv) {
-		close(drm->fd);
+		if (drm->fd >= 0)
+			close(drm->fd);
 		free(drm);
 		return NULL;
 	}
+	if (!drm->render_node)
+		drm->drv_fd = drm->fd;
+	drm->drv->render_node = drm->render_node;
+
+	pthread_mutex_init(&drm->cache_mutex, NULL);
+	pthread_mutex_init(&drm->import_mutex, NULL);
+	drm->cache_budget = (size_t)
+		property_get_int32("debug.drm.bo_cache_kb", 0) * 1024;
+
+	drm->layouts = gralloc_drm_layouts_create(drm->fd, drm->render_fd);
+	if (!drm->layouts)
+		ALOGW("failed to create the layout policy");
+
+	pthread_mutex_init(&drm->blit_mutex, NULL);
+
+	/* for the drivers and the format conversions drv->blit lacks */
+	drm->blitter = gralloc_drm_blitter_create();
+	if (!drm->blitter)
+		ALOGW("failed to create the CPU blitter");
 
 	return drm;
 }
@@ -168,18 +368,34 @@ struct gralloc_drm_t *gralloc_drm_create(void)
  */
 void gralloc_drm_destroy(struct gralloc_drm_t *drm)
 {
+	gralloc_drm_bo_cache_trim(drm, 0);
+	pthread_mutex_destroy(&drm->cache_mutex);
+	pthread_mutex_destroy(&drm->import_mutex);
+
+	if (drm->blitter)
+		gralloc_drm_blitter_destroy(drm->blitter);
+	pthread_mutex_destroy(&drm->blit_mutex);
+	if (drm->layouts)
+		gralloc_drm_layouts_destroy(drm->layouts);
+	if (drm->render_drv) {
+		drm->render_drv->destroy(drm->render_drv);
+		close(drm->render_fd);
+	}
 	if (drm->drv)
 		drm->drv->destroy(drm->drv);
+	if (drm->render_node)
+		close(drm->drv_fd);
 	close(drm->fd);
 	free(drm);
 }
 
 /*
- * Get the file descriptor of a DRM device object.
+ * Get the file descriptor of a DRM device object, that of the render device
+ * when there is one, for the clients to render with.
  */
 int gralloc_drm_get_fd(struct gralloc_drm_t *drm)
 {
-	return drm->fd;
+	return (drm->render_drv) ? drm->render_fd : drm->fd;
 }
 
 /*
@@ -218,6 +434,135 @@ void gralloc_drm_drop_master(struct gralloc_drm_t *drm)
 	drmDropMaster(drm->fd);
 }
 
+/*
+ * Take a reference of a bo unless it is being destroyed.
+ */
+static int bo_tryref(struct gralloc_drm_bo_t *bo)
+{
+	int32_t refcount;
+
+	do {
+		refcount = bo->refcount;
+		if (!refcount)
+			return 0;
+	} while (android_atomic_cmpxchg(refcount, refcount + 1, &bo->refcount));
+
+	return 1;
+}
+
+/*
+ * Create the struct gralloc_drm_bo_t of a handle from another process, on
+ * the device it is allocated on.
+ */
+static struct gralloc_drm_bo_t *import_bo(struct gralloc_drm_t *drm,
+		struct gralloc_drm_handle_t *handle)
+{
+	struct gralloc_drm_drv_t *drv;
+	struct gralloc_drm_bo_t *bo;
+	int render;
+
+	render = (handle->render && drm->render_drv);
+	drv = (render) ? drm->render_drv : drm->drv;
+
+	bo = drv->alloc(drv, handle);
+	if (bo) {
+		bo->drm = drm;
+		bo->imported = 1;
+		bo->render = render;
+		bo->handle = handle;
+		bo->refcount = 1;
+		bo->import_linked = 0;
+		bo->fb = NULL;
+		pthread_mutex_init(&bo->mutex, NULL);
+	}
+
+	return bo;
+}
+
+/*
+ * Import a handle by its PRIME fd.  The same buffer is often registered again
+ * with a new handle and fd, so the bo is looked up in the import cache by the
+ * dma-buf inode first, and is shared together with its fb.  The cached bo owns
+ * a copy of the handle, as the handle it is imported from may be unregistered
+ * and closed before the others.
+ */
+static struct gralloc_drm_bo_t *import_bo_prime(struct gralloc_drm_t *drm,
+		struct gralloc_drm_handle_t *handle)
+{
+	struct gralloc_drm_handle_t *copy;
+	struct gralloc_drm_bo_t *bo;
+	struct stat st;
+	unsigned bucket;
+
+	if (fstat(handle->prime_fd, &st)) {
+		ALOGE("failed to stat prime fd %d", handle->prime_fd);
+		return NULL;
+	}
+
+	bucket = (unsigned) st.st_ino % DRM_IMPORT_BUCKETS;
+
+	/* held while importing so that a buffer is imported only once */
+	pthread_mutex_lock(&drm->import_mutex);
+
+	for (bo = drm->import_table[bucket]; bo; bo = bo->import_next) {
+		if (bo->import_ino == st.st_ino &&
+		    bo->import_dev == st.st_dev && bo_tryref(bo))
+			break;
+	}
+	if (bo)
+		goto out;
+
+	copy = malloc(sizeof(*copy));
+	if (!copy)
+		goto out;
+	memcpy(copy, handle, sizeof(*copy));
+
+	copy->prime_fd = fcntl(handle->prime_fd, F_DUPFD_CLOEXEC, 0);
+	if (copy->prime_fd < 0) {
+		free(copy);
+		goto out;
+	}
+
+	bo = import_bo(drm, copy);
+	if (!bo) {
+		close(copy->prime_fd);
+		free(copy);
+		goto out;
+	}
+
+	copy->data_owner = gralloc_drm_get_pid();
+	copy->data_refs = 0;
+	copy->data = bo;
+
+	bo->import_linked = 1;
+	bo->import_dev = st.st_dev;
+	bo->import_ino = st.st_ino;
+	bo->import_next = drm->import_table[bucket];
+	drm->import_table[bucket] = bo;
+
+out:
+	pthread_mutex_unlock(&drm->import_mutex);
+
+	return bo;
+}
+
+/*
+ * Remove a bo from the import cache.
+ */
+static void import_unlink(struct gralloc_drm_bo_t *bo)
+{
+	struct gralloc_drm_t *drm = bo->drm;
+	struct gralloc_drm_bo_t **p;
+
+	pthread_mutex_lock(&drm->import_mutex);
+	p = &drm->import_table[(unsigned) bo->import_ino % DRM_IMPORT_BUCKETS];
+	while (*p && *p != bo)
+		p = &(*p)->import_next;
+	if (*p)
+		*p = bo->import_next;
+	pthread_mutex_unlock(&drm->import_mutex);
+}
+
 /*
  * Validate a buffer handle and return the associated bo.
  */
@@ -238,18 +583,15 @@ static struct gralloc_drm_bo_t *validate_handle(buffer_handle_t _handle,
 			return NULL;
 
 		/* create the struct gralloc_drm_bo_t locally */
-		if (handle->name)
-			bo = drm->drv->alloc(drm->drv, handle);
+		if (handle->base.numFds && handle->prime_fd >= 0)
+			bo = import_bo_prime(drm, handle);
+		else if (handle->name)
+			bo = import_bo(drm, handle);
 		else /* an invalid handle */
 			bo = NULL;
-		if (bo) {
-			bo->drm = drm;
-			bo->imported = 1;
-			bo->handle = handle;
-			bo->refcount = 1;
-		}
 
 		handle->data_owner = gralloc_drm_get_pid();
+		handle->data_refs = 0;
 		handle->data = bo;
 	}
 
@@ -259,15 +601,17 @@ static struct gralloc_drm_bo_t *validate_handle(buffer_handle_t _handle,
 /*
  * Register a buffer handle.
  */
-int gralloc_drm_handle_register(buffer_handle_t handle, struct gralloc_drm_t *drm)
+int gralloc_drm_handle_register(buffer_handle_t _handle, struct gralloc_drm_t *drm)
 {
+	struct gralloc_drm_handle_t *handle = gralloc_drm_handle(_handle);
 	struct gralloc_drm_bo_t *bo;
 
-	bo = validate_handle(handle, drm);
+	bo = validate_handle(_handle, drm);
 	if (!bo)
 		return -EINVAL;
 
-	bo->refcount++;
+	gralloc_drm_bo_incref(bo);
+	handle->data_refs++;
 
 	return 0;
 }
@@ -275,17 +619,29 @@ int gralloc_drm_handle_register(buffer_handle_t handle, struct gralloc_drm_t *dr
 /*
  * Unregister a buffer handle.  It is no-op for handles created locally.
  */
-int gralloc_drm_handle_unregister(buffer_handle_t handle)
+int gralloc_drm_handle_unregister(buffer_handle_t _handle)
 {
+	struct gralloc_drm_handle_t *handle = gralloc_drm_handle(_handle);
 	struct gralloc_drm_bo_t *bo;
 
-	bo = validate_handle(handle, NULL);
+	bo = validate_handle(_handle, NULL);
 	if (!bo)
 		return -EINVAL;
 
-	gralloc_drm_bo_decref(bo);
-	if (bo->imported)
+	if (handle->data_refs <= 0)
+		return -EINVAL;
+
+	/*
+	 * a cached import outlives the handle, and is freed with its last
+	 * handle; the handle is forgotten with its last registration, and is
+	 * imported again when registered again
+	 */
+	if (!--handle->data_refs && bo->imported) {
+		handle->data_owner = 0;
+		handle->data = NULL;
 		gralloc_drm_bo_decref(bo);
+	}
+	gralloc_drm_bo_decref(bo);
 
 	return 0;
 }
@@ -293,7 +649,7 @@ int gralloc_drm_handle_unregister(buffer_handle_t handle)
 /*
  * Create a buffer handle.
  */
-static struct gralloc_drm_handle_t *create_bo_handle(int width,
+struct gralloc_drm_handle_t *gralloc_drm_handle_create(int width,
 		int height, int format, int usage)
 {
 	struct gralloc_drm_handle_t *handle;
@@ -313,10 +669,280 @@ static struct gralloc_drm_handle_t *create_bo_handle(int width,
 	handle->usage = usage;
 	handle->plane_mask = 0;
 	handle->prime_fd = -1;
+	handle->modifier = DRM_FORMAT_MOD_INVALID;
 
 	return handle;
 }
 
+/*
+ * Return the size of the bo of a handle, as allocated by the drivers.
+ */
+size_t gralloc_drm_handle_size(const struct gralloc_drm_handle_t *handle)
+{
+	int width = handle->width, height = handle->height;
+
+	gralloc_drm_align_geometry(handle->format, &width, &height);
+
+	return (size_t) handle->stride * height;
+}
+
+/*
+ * Lay out the planes of a handle in the rows gralloc_drm_align_geometry adds
+ * for the chroma.  Drivers with other layouts set them in alloc instead.
+ */
+void gralloc_drm_handle_init_planes(struct gralloc_drm_handle_t *handle)
+{
+	uint32_t stride = handle->stride, height = handle->height;
+
+	memset(handle->offsets, 0, sizeof(handle->offsets));
+	memset(handle->pitches, 0, sizeof(handle->pitches));
+	handle->plane_count = 1;
+	handle->pitches[0] = stride;
+
+	switch (handle->format) {
+	case HAL_PIXEL_FORMAT_YV12:
+		/* Y, then Cr and Cb at half the stride */
+		height = ALIGN(height, 2);
+		handle->plane_count = 3;
+		handle->pitches[1] = stride / 2;
+		handle->pitches[2] = stride / 2;
+		handle->offsets[2] = stride * height;
+		handle->offsets[1] = handle->offsets[2] +
+			stride / 2 * (height / 2);
+		break;
+	case HAL_PIXEL_FORMAT_DRM_NV12:
+	case HAL_PIXEL_FORMAT_YCrCb_420_SP:
+	case HAL_PIXEL_FORMAT_YCbCr_420_888:
+		height = ALIGN(height, 2);
+		/* fall through */
+	case HAL_PIXEL_FORMAT_YCbCr_422_SP:
+		/* Y, then the interleaved chroma */
+		handle->plane_count = 2;
+		handle->pitches[1] = stride;
+		handle->offsets[1] = stride * height;
+		break;
+	default:
+		break;
+	}
+}
+
+/*
+ * Get the pitches, offsets and GEM handles of the planes of a bo, on the
+ * device the bo is on.
+ */
+void gralloc_drm_bo_get_planes(const struct gralloc_drm_bo_t *bo,
+		uint32_t *pitches, uint32_t *offsets, uint32_t *handles)
+{
+	const struct gralloc_drm_handle_t *handle = bo->handle;
+	int i;
+
+	memset(pitches, 0, 4 * sizeof(uint32_t));
+	memset(offsets, 0, 4 * sizeof(uint32_t));
+	memset(handles, 0, 4 * sizeof(uint32_t));
+
+	for (i = 0; i < handle->plane_count; i++) {
+		pitches[i] = handle->pitches[i];
+		offsets[i] = handle->offsets[i];
+		handles[i] = bo->fb_handle;
+	}
+}
+
+/*
+ * Return the GEM handle of a bo on the card node, for KMS.  The bos of the
+ * render device or of the render node are imported by PRIME fd on first use.
+ * Return 0 when the bo cannot be imported.
+ */
+uint32_t gralloc_drm_bo_get_kms_handle(struct gralloc_drm_bo_t *bo)
+{
+	struct gralloc_drm_t *drm = bo->drm;
+	uint32_t kms_handle;
+
+	if (!bo->render && !drm->render_node)
+		return bo->fb_handle;
+
+	pthread_mutex_lock(&bo->mutex);
+	if (!bo->kms_handle && (bo->handle->prime_fd < 0 ||
+	    drmPrimeFDToHandle(drm->fd, bo->handle->prime_fd,
+		    &bo->kms_handle)))
+		bo->kms_handle = 0;
+	kms_handle = bo->kms_handle;
+	pthread_mutex_unlock(&bo->mutex);
+
+	if (!kms_handle)
+		ALOGE("failed to import bo %p for KMS", bo);
+
+	return kms_handle;
+}
+
+/*
+ * Remove a bo from the bo cache.  The cache mutex must be held.
+ */
+static void bo_cache_unlink(struct gralloc_drm_t *drm,
+		struct gralloc_drm_bo_t *bo)
+{
+	if (bo->cache_prev)
+		bo->cache_prev->cache_next = bo->cache_next;
+	else
+		drm->cache_head = bo->cache_next;
+
+	if (bo->cache_next)
+		bo->cache_next->cache_prev = bo->cache_prev;
+	else
+		drm->cache_tail = bo->cache_prev;
+
+	bo->cache_prev = bo->cache_next = NULL;
+	drm->cache_size -= bo->size;
+}
+
+/*
+ * Take a cached bo matching the allocation parameters of a new handle,
+ * including the layout the policy picked for it.
+ */
+static struct gralloc_drm_bo_t *bo_cache_get(struct gralloc_drm_t *drm,
+		const struct gralloc_drm_handle_t *want)
+{
+	struct gralloc_drm_bo_t *bo;
+
+	if (!drm->cache_budget)
+		return NULL;
+
+	pthread_mutex_lock(&drm->cache_mutex);
+	for (bo = drm->cache_head; bo; bo = bo->cache_next) {
+		const struct gralloc_drm_handle_t *handle = bo->handle;
+
+		if (handle->width == want->width &&
+		    handle->height == want->height &&
+		    handle->format == want->format &&
+		    handle->usage == want->usage &&
+		    handle->layout == want->layout) {
+			bo_cache_unlink(drm, bo);
+			break;
+		}
+	}
+	pthread_mutex_unlock(&drm->cache_mutex);
+
+	return bo;
+}
+
+/*
+ * Close a GEM handle that no driver bo owns.
+ */
+static void gralloc_drm_close_gem_handle(int fd, uint32_t gem_handle)
+{
+	struct drm_gem_close arg;
+
+	memset(&arg, 0, sizeof(arg));
+	arg.handle = gem_handle;
+	drmIoctl(fd, DRM_IOCTL_GEM_CLOSE, &arg);
+}
+
+/*
+ * Really free a bo.
+ */
+static void gralloc_drm_bo_free(struct gralloc_drm_bo_t *bo)
+{
+	struct gralloc_drm_handle_t *handle = bo->handle;
+	int owned = !bo->imported || bo->import_linked;
+
+	if (bo->import_linked)
+		import_unlink(bo);
+
+	gralloc_drm_bo_rm_fb(bo);
+	pthread_mutex_destroy(&bo->mutex);
+
+	if (bo->kms_handle)
+		gralloc_drm_close_gem_handle(bo->drm->fd, bo->kms_handle);
+	if (bo->render_import)
+		bo->drm->render_drv->free(bo->drm->render_drv,
+				bo->render_import);
+
+	gralloc_drm_bo_drv(bo)->free(gralloc_drm_bo_drv(bo), bo);
+	if (owned) {
+		if (handle->base.numFds)
+			close(handle->prime_fd);
+		free(handle);
+	}
+	else {
+		handle->data_owner = 0;
+		handle->data = 0;
+	}
+}
+
+/*
+ * Evict the least recently freed bos until the cache fits in budget.
+ */
+void gralloc_drm_bo_cache_trim(struct gralloc_drm_t *drm, size_t budget)
+{
+	struct gralloc_drm_bo_t *evicted = NULL, *bo;
+
+	pthread_mutex_lock(&drm->cache_mutex);
+	while (drm->cache_tail && drm->cache_size > budget) {
+		bo = drm->cache_tail;
+		bo_cache_unlink(drm, bo);
+		bo->cache_next = evicted;
+		evicted = bo;
+	}
+	pthread_mutex_unlock(&drm->cache_mutex);
+
+	/* free outside of the lock, drv->free may wait for the GPU */
+	while (evicted) {
+		bo = evicted;
+		evicted = bo->cache_next;
+		gralloc_drm_bo_free(bo);
+	}
+}
+
+/*
+ * Zero a bo with stale contents.  The GPU clears it when the driver can.
+ * Otherwise, a bo for CPU access is zeroed when it is first mapped, and other
+ * bos are zeroed by CPU now.
+ */
+static void gralloc_drm_bo_clear(struct gralloc_drm_bo_t *bo)
+{
+	struct gralloc_drm_drv_t *drv = gralloc_drm_bo_drv(bo);
+	void *addr;
+	int ret;
+
+	/* the clears are batched with the blits */
+	if (drv->clear) {
+		pthread_mutex_lock(&bo->drm->blit_mutex);
+		ret = drv->clear(drv, bo);
+		pthread_mutex_unlock(&bo->drm->blit_mutex);
+		if (!ret) {
+			bo->need_clear = 0;
+			return;
+		}
+	}
+
+	if (bo->handle->usage & (GRALLOC_USAGE_SW_READ_MASK |
+				 GRALLOC_USAGE_SW_WRITE_MASK))
+		return;
+
+	if (!drv->map(drv, bo, 0, 0, bo->handle->width,
+				bo->handle->height, 1, &addr)) {
+		memset(addr, 0, bo->size);
+		drv->unmap(drv, bo);
+	}
+	bo->need_clear = 0;
+}
+
+/*
+ * Keep only DRM_FORMAT_MOD_LINEAR of a list of modifiers, when it is in it.
+ */
+static int filter_linear_modifier(uint64_t *modifiers, int count)
+{
+	int i;
+
+	for (i = 0; i < count; i++) {
+		if (modifiers[i] == DRM_FORMAT_MOD_LINEAR) {
+			modifiers[0] = DRM_FORMAT_MOD_LINEAR;
+			return 1;
+		}
+	}
+
+	return count;
+}
+
 /*
  * Create a bo.
  */
@@ -325,24 +951,95 @@ struct gralloc_drm_bo_t *gralloc_drm_bo_create(struct gralloc_drm_t *drm,
 {
 	struct gralloc_drm_bo_t *bo;
 	struct gralloc_drm_handle_t *handle;
+	struct gralloc_drm_drv_t *drv;
+	uint64_t modifiers[DRM_MODIFIERS_MAX];
+	int count, render;
 
-	handle = create_bo_handle(width, height, format, usage);
+	handle = gralloc_drm_handle_create(width, height, format, usage);
 	if (!handle)
 		return NULL;
 
 	handle->plane_mask = planes_for_format(drm, format);
 
-	bo = drm->drv->alloc(drm->drv, handle);
+	/*
+	 * with a render device, only the bos that are scanned out are on the
+	 * display device, and they are linear for the render device to
+	 * import them
+	 */
+	render = (drm->render_drv && !(usage &
+			(GRALLOC_USAGE_HW_FB | GRALLOC_USAGE_HW_COMPOSER)));
+	drv = (render) ? drm->render_drv : drm->drv;
+	handle->render = render;
+	if (drm->layouts)
+		handle->layout = gralloc_drm_layout_choose(drm->layouts,
+				handle, render);
+
+	/* the cached bo keeps its handle, name, stride and fb */
+	bo = bo_cache_get(drm, handle);
+	if (bo) {
+		bo->handle->plane_mask = handle->plane_mask;
+		free(handle);
+
+		bo->refcount = 1;
+		bo->need_clear = 1;
+		gralloc_drm_bo_clear(bo);
+		return bo;
+	}
+
+	if (render) {
+		count = 0;
+	}
+	else if (drm->render_drv) {
+		modifiers[0] = DRM_FORMAT_MOD_LINEAR;
+		count = 1;
+	}
+	else {
+		/* let the driver pick a layout the scanout planes accept */
+		count = gralloc_drm_get_modifiers(drm, format, usage,
+				modifiers, DRM_MODIFIERS_MAX);
+		if (handle->layout == GRALLOC_DRM_LAYOUT_LINEAR)
+			count = filter_linear_modifier(modifiers, count);
+	}
+
+	if (count && drv->alloc_with_modifiers)
+		bo = drv->alloc_with_modifiers(drv, handle, modifiers, count);
+	else
+		bo = drv->alloc(drv, handle);
 	if (!bo) {
 		free(handle);
 		return NULL;
 	}
 
+	/* unless the driver padded the planes its own way */
+	if (!handle->plane_count)
+		gralloc_drm_handle_init_planes(handle);
+
 	bo->drm = drm;
 	bo->imported = 0;
+	bo->exported = 0;
+	bo->import_linked = 0;
 	bo->handle = handle;
 	bo->fb_id = 0;
+	bo->fb = NULL;
 	bo->refcount = 1;
+	bo->render = render;
+
+	/* share by PRIME fd, or by the flink name of the handle */
+	if (drmPrimeHandleToFD((render) ? drm->render_fd : drm->drv_fd,
+				bo->fb_handle, DRM_CLOEXEC,
+				&handle->prime_fd)) {
+		ALOGW("failed to export bo %dx%d as prime fd",
+				width, height);
+		handle->prime_fd = -1;
+		handle->base.numFds = 0;
+		handle->base.numInts = GRALLOC_DRM_HANDLE_NUM_DATA;
+	}
+	bo->size = gralloc_drm_handle_size(handle);
+	pthread_mutex_init(&bo->mutex, NULL);
+
+	/* set by drivers whose allocations are not zeroed */
+	if (bo->need_clear)
+		gralloc_drm_bo_clear(bo);
 
 	handle->data_owner = gralloc_drm_get_pid();
 	handle->data = bo;
@@ -351,27 +1048,87 @@ struct gralloc_drm_bo_t *gralloc_drm_bo_create(struct gralloc_drm_t *drm,
 }
 
 /*
- * Destroy a bo.
+ * Return the bo of the render device for a bo, which is the bo itself when
+ * it is on the render device.  A display bo is imported by its PRIME fd on
+ * first use.  Return NULL when there is no render device.
+ */
+struct gralloc_drm_bo_t *gralloc_drm_bo_render_import(
+		struct gralloc_drm_bo_t *bo)
+{
+	struct gralloc_drm_t *drm = bo->drm;
+	struct gralloc_drm_bo_t *imp;
+
+	if (bo->render)
+		return bo;
+	if (!drm->render_drv || bo->handle->prime_fd < 0)
+		return NULL;
+
+	pthread_mutex_lock(&bo->mutex);
+	if (!bo->render_import) {
+		imp = drm->render_drv->alloc(drm->render_drv, bo->handle);
+		if (imp) {
+			imp->drm = drm;
+			imp->handle = bo->handle;
+			imp->imported = 1;
+			imp->render = 1;
+			imp->refcount = 1;
+			bo->render_import = imp;
+		}
+		else {
+			ALOGE("failed to import bo %p on the render device",
+					bo);
+		}
+	}
+	imp = bo->render_import;
+	pthread_mutex_unlock(&bo->mutex);
+
+	return imp;
+}
+
+/*
+ * Destroy a bo, or move it to the bo cache when it fits.
  */
 static void gralloc_drm_bo_destroy(struct gralloc_drm_bo_t *bo)
 {
-	struct gralloc_drm_handle_t *handle = bo->handle;
-	int imported = bo->imported;
+	struct gralloc_drm_t *drm = bo->drm;
 
 	/* gralloc still has a reference */
 	if (bo->refcount)
 		return;
 
-	gralloc_drm_bo_rm_fb(bo);
-
-	bo->drm->drv->free(bo->drm->drv, bo);
-	if (imported) {
-		handle->data_owner = 0;
-		handle->data = 0;
-	}
-	else {
-		free(handle);
+	/*
+	 * the cache is for the bos of this process only: other processes may
+	 * still hold the bos whose handles were given out, which include all
+	 * the bos of alloc_device_t, and those are never reused
+	 */
+	if (bo->imported || bo->exported || bo->size > drm->cache_budget) {
+		gralloc_drm_bo_free(bo);
+		return;
 	}
+
+	bo->lock_count = 0;
+	bo->locked_for = 0;
+
+	pthread_mutex_lock(&drm->cache_mutex);
+	bo->cache_prev = NULL;
+	bo->cache_next = drm->cache_head;
+	if (drm->cache_head)
+		drm->cache_head->cache_prev = bo;
+	else
+		drm->cache_tail = bo;
+	drm->cache_head = bo;
+	drm->cache_size += bo->size;
+	pthread_mutex_unlock(&drm->cache_mutex);
+
+	gralloc_drm_bo_cache_trim(drm, drm->cache_budget);
+}
+
+/*
+ * Increase refcount.
+ */
+void gralloc_drm_bo_incref(struct gralloc_drm_bo_t *bo)
+{
+	android_atomic_inc(&bo->refcount);
 }
 
 /*
@@ -379,7 +1136,7 @@ static void gralloc_drm_bo_destroy(struct gralloc_drm_bo_t *bo)
  */
 void gralloc_drm_bo_decref(struct gralloc_drm_bo_t *bo)
 {
-	if (!--bo->refcount)
+	if (android_atomic_dec(&bo->refcount) == 1)
 		gralloc_drm_bo_destroy(bo);
 }
 
@@ -396,6 +1153,7 @@ struct gralloc_drm_bo_t *gralloc_drm_bo_from_handle(buffer_handle_t handle)
  */
 buffer_handle_t gralloc_drm_bo_get_handle(struct gralloc_drm_bo_t *bo, int *stride)
 {
+	bo->exported = 1;
 	if (stride)
 		*stride = bo->handle->stride;
 	return &bo->handle->base;
@@ -414,28 +1172,94 @@ int gralloc_drm_get_prime_fd(buffer_handle_t _handle)
 }
 
 /*
- * Query YUV component offsets for a buffer handle
+ * Query YUV component offsets for a buffer handle, with the GEM handles on
+ * the card node for KMS.
  */
 void gralloc_drm_resolve_format(buffer_handle_t _handle,
 	uint32_t *pitches, uint32_t *offsets, uint32_t *handles)
 {
 	struct gralloc_drm_handle_t *handle = gralloc_drm_handle(_handle);
-	struct gralloc_drm_bo_t *bo = handle->data;
-	struct gralloc_drm_t *drm = bo->drm;
+	uint32_t kms_handle;
+	int i;
+
+	if (!handle || !handle->data)
+		return;
+
+	gralloc_drm_bo_get_planes(handle->data, pitches, offsets, handles);
+
+	kms_handle = gralloc_drm_bo_get_kms_handle(handle->data);
+	for (i = 0; i < 4; i++) {
+		if (handles[i])
+			handles[i] = kms_handle;
+	}
+}
+
+/*
+ * Wait for a sync_file fence to signal, for at most timeout milliseconds or
+ * forever when timeout is negative.  The fence is not closed.
+ */
+int gralloc_drm_wait_fence(int fence, int timeout)
+{
+	struct pollfd fds;
+	int ret;
+
+	if (fence < 0)
+		return 0;
+
+	fds.fd = fence;
+	fds.events = POLLIN;
+
+	do {
+		ret = poll(&fds, 1, timeout);
+		if (ret > 0) {
+			if (fds.revents & (POLLERR | POLLNVAL))
+				return -EINVAL;
+			return 0;
+		}
+		else if (ret == 0) {
+			return -ETIME;
+		}
+	} while (errno == EINTR || errno == EAGAIN);
 
-	/* if handle exists and driver implements resolve_format */
-	if (handle && drm->drv->resolve_format)
-		drm->drv->resolve_format(drm->drv, bo,
-			pitches, offsets, handles);
+	return -errno;
 }
 
 /*
- * Lock a bo.  XXX thread-safety?
+ * Bracket the CPU access to a bo shared as a dma-buf, so that the exporter
+ * can maintain the caches of cached mappings.
+ */
+static void gralloc_drm_bo_sync(struct gralloc_drm_bo_t *bo,
+		int usage, int start)
+{
+	struct dma_buf_sync sync;
+	int ret;
+
+	if (bo->handle->prime_fd < 0)
+		return;
+
+	sync.flags = (start) ? DMA_BUF_SYNC_START : DMA_BUF_SYNC_END;
+	if (usage & GRALLOC_USAGE_SW_READ_MASK)
+		sync.flags |= DMA_BUF_SYNC_READ;
+	if (usage & GRALLOC_USAGE_SW_WRITE_MASK)
+		sync.flags |= DMA_BUF_SYNC_WRITE;
+
+	do {
+		ret = ioctl(bo->handle->prime_fd, DMA_BUF_IOCTL_SYNC, &sync);
+	} while (ret && (errno == EINTR || errno == EAGAIN));
+
+	if (ret)
+		ALOGW("failed to sync dma-buf of bo %p", bo);
+}
+
+/*
+ * Lock a bo.  Different bos may be locked in parallel.
  */
 int gralloc_drm_bo_lock(struct gralloc_drm_bo_t *bo,
 		int usage, int x, int y, int w, int h,
 		void **addr)
 {
+	int err = 0;
+
 	if ((bo->handle->usage & usage) != usage) {
 		/* make FB special for testing software renderer with */
 		if (!(bo->handle->usage & (
@@ -449,20 +1273,47 @@ int gralloc_drm_bo_lock(struct gralloc_drm_bo_t *bo,
 		}
 	}
 
+	pthread_mutex_lock(&bo->mutex);
+
 	/* allow multiple locks with compatible usages */
-	if (bo->lock_count && (bo->locked_for & usage) != usage)
-		return -EINVAL;
+	if (bo->lock_count && (bo->locked_for & usage) != usage) {
+		err = -EINVAL;
+		goto unlock;
+	}
 
 	usage |= bo->locked_for;
 
+	/* an empty rect locks the whole bo, and so does a deferred clear */
+	if (w <= 0 || h <= 0 || bo->need_clear) {
+		x = 0;
+		y = 0;
+		w = bo->handle->width;
+		h = bo->handle->height;
+	}
+	else {
+		x = MIN(MAX(x, 0), bo->handle->width);
+		y = MIN(MAX(y, 0), bo->handle->height);
+		w = MIN(w, bo->handle->width - x);
+		h = MIN(h, bo->handle->height - y);
+	}
+
 	if (usage & (GRALLOC_USAGE_SW_WRITE_MASK |
 		     GRALLOC_USAGE_SW_READ_MASK)) {
 		/* the driver is supposed to wait for the bo */
 		int write = !!(usage & GRALLOC_USAGE_SW_WRITE_MASK);
-		int err = bo->drm->drv->map(bo->drm->drv, bo,
-				x, y, w, h, write, addr);
+		err = gralloc_drm_bo_drv(bo)->map(gralloc_drm_bo_drv(bo), bo,
+				x, y, w, h, write || bo->need_clear, addr);
 		if (err)
-			return err;
+			goto unlock;
+
+		if (!bo->lock_count)
+			gralloc_drm_bo_sync(bo, usage, 1);
+
+		/* deferred by gralloc_drm_bo_clear */
+		if (bo->need_clear) {
+			memset(*addr, 0, bo->size);
+			bo->need_clear = 0;
+		}
 	}
 	else {
 		/* kernel handles the synchronization here */
@@ -471,7 +1322,10 @@ int gralloc_drm_bo_lock(struct gralloc_drm_bo_t *bo,
 	bo->lock_count++;
 	bo->locked_for |= usage;
 
-	return 0;
+unlock:
+	pthread_mutex_unlock(&bo->mutex);
+
+	return err;
 }
 
 /*
@@ -479,16 +1333,24 @@ int gralloc_drm_bo_lock(struct gralloc_drm_bo_t *bo,
  */
 void gralloc_drm_bo_unlock(struct gralloc_drm_bo_t *bo)
 {
-	int mapped = bo->locked_for &
+	int mapped;
+
+	pthread_mutex_lock(&bo->mutex);
+
+	mapped = bo->locked_for &
 		(GRALLOC_USAGE_SW_WRITE_MASK | GRALLOC_USAGE_SW_READ_MASK);
 
-	if (!bo->lock_count)
-		return;
+	if (bo->lock_count) {
+		if (mapped) {
+			if (bo->lock_count == 1)
+				gralloc_drm_bo_sync(bo, bo->locked_for, 0);
+			gralloc_drm_bo_drv(bo)->unmap(gralloc_drm_bo_drv(bo), bo);
+		}
 
-	if (mapped)
-		bo->drm->drv->unmap(bo->drm->drv, bo);
+		bo->lock_count--;
+		if (!bo->lock_count)
+			bo->locked_for = 0;
+	}
 
-	bo->lock_count--;
-	if (!bo->lock_count)
-		bo->locked_for = 0;
+	pthread_mutex_unlock(&bo->mutex);
 }
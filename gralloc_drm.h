@@ -34,6 +34,9 @@ extern "C" {
 #ifndef MAX
 #define MAX(a, b) (((a) > (b)) ? (a) : (b))
 #endif
+#ifndef MIN
+#define MIN(a, b) (((a) < (b)) ? (a) : (b))
+#endif
 #define ALIGN(val, align) (((val) + (align) - 1) & ~((align) - 1))
 
 struct gralloc_drm_t;
@@ -45,11 +48,90 @@ enum {
 	GRALLOC_MODULE_PERFORM_AUTH_DRM_MAGIC            = 0x80000004,
 	GRALLOC_MODULE_PERFORM_ENTER_VT                  = 0x80000005,
 	GRALLOC_MODULE_PERFORM_LEAVE_VT                  = 0x80000006,
+	GRALLOC_MODULE_PERFORM_SET_POST_RELEASE          = 0x80000007,
+	GRALLOC_MODULE_PERFORM_GET_POST_STATS            = 0x80000008,
+	GRALLOC_MODULE_PERFORM_TRIM_BO_CACHE             = 0x80000009,
+	GRALLOC_MODULE_PERFORM_SET_DAMAGE                = 0x8000000A,
+	GRALLOC_MODULE_PERFORM_POST_FENCED               = 0x8000000B,
+	GRALLOC_MODULE_PERFORM_PRESENT_AT                = 0x8000000C,
+	GRALLOC_MODULE_PERFORM_SET_PRESENT_CALLBACK      = 0x8000000D,
+	GRALLOC_MODULE_PERFORM_CAPTURE                   = 0x8000000E,
+};
+
+/* the target of a present */
+enum {
+	GRALLOC_DRM_PRESENT_ASAP,   /* the next vblank the swap interval allows */
+	GRALLOC_DRM_PRESENT_VBLANK, /* a vblank sequence of the primary crtc */
+	GRALLOC_DRM_PRESENT_TIME,   /* the vblank nearest a CLOCK_MONOTONIC time, in us */
+};
+
+/*
+ * A damaged rectangle of the next post, laid out like hwc_rect_t.  right and
+ * bottom are exclusive.
+ */
+struct gralloc_drm_rect {
+	int left, top, right, bottom;
+};
+
+/* called from the post thread once a queued bo is no longer on screen */
+typedef void (*gralloc_drm_post_release_t)(void *data, buffer_handle_t handle);
+
+/*
+ * called from the thread that handles the flip event once a bo is flipped
+ * on the primary, with the CLOCK_MONOTONIC time in us and the sequence of
+ * the vblank it was shown at
+ */
+typedef void (*gralloc_drm_present_t)(void *data, buffer_handle_t handle,
+		uint64_t present_us, unsigned int sequence);
+
+/*
+ * called from the capture thread with a linear handle holding a capture, or
+ * NULL when it failed.  The handle may be locked for reading until the
+ * callback returns.
+ */
+typedef void (*gralloc_drm_capture_t)(void *data, buffer_handle_t handle,
+		int width, int height);
+
+#define GRALLOC_DRM_STATS_BUCKETS 16
+#define GRALLOC_DRM_STATS_SWAP_MODES 5
+
+/*
+ * A latency histogram.  Bucket i counts the samples of [2^i, 2^(i+1))
+ * microseconds, and the last bucket counts everything above.
+ */
+struct gralloc_drm_histogram {
+	uint64_t count;
+	uint64_t total_us;
+	uint64_t max_us;
+	uint64_t buckets[GRALLOC_DRM_STATS_BUCKETS];
+};
+
+/* statistics of the KMS post path, enabled by debug.drm.stats */
+struct gralloc_drm_post_stats {
+	uint64_t posts;
+	uint64_t flips;          /* flips completed */
+	uint64_t flip_ebusy;     /* flips rejected with EBUSY */
+	uint64_t flip_errors;    /* flips failed otherwise */
+	uint64_t missed_vblanks; /* vblanks past the targets of posts */
+
+	/* sequence and time of the last flip event */
+	uint64_t last_flip_sequence;
+	uint64_t last_flip_us;
+
+	struct gralloc_drm_histogram post_to_flip;
+	struct gralloc_drm_histogram wait_for_post;
+	struct gralloc_drm_histogram handle_event;
+	struct gralloc_drm_histogram mirror_blit;
+	struct gralloc_drm_histogram set_crtc;
+	/* time in gralloc_drm_bo_post, by swap mode */
+	struct gralloc_drm_histogram swap_modes[GRALLOC_DRM_STATS_SWAP_MODES];
 };
 
 struct gralloc_drm_t *gralloc_drm_create(void);
 void gralloc_drm_destroy(struct gralloc_drm_t *drm);
 
+int gralloc_drm_wait_fence(int fence, int timeout);
+
 int gralloc_drm_get_fd(struct gralloc_drm_t *drm);
 int gralloc_drm_get_magic(struct gralloc_drm_t *drm, int32_t *magic);
 int gralloc_drm_auth_magic(struct gralloc_drm_t *drm, int32_t magic);
@@ -62,6 +144,19 @@ int gralloc_drm_is_kms_initialized(struct gralloc_drm_t *drm);
 
 void gralloc_drm_get_kms_info(struct gralloc_drm_t *drm, struct framebuffer_device_t *fb);
 int gralloc_drm_is_kms_pipelined(struct gralloc_drm_t *drm);
+int gralloc_drm_get_post_stats(struct gralloc_drm_t *drm,
+	struct gralloc_drm_post_stats *stats);
+
+/*
+ * Return true when CPU reads dominate the accesses to a bo.  Such a bo is
+ * mapped cached with explicit cache maintenance at lock and unlock, while
+ * other bos are mapped write-combined.
+ */
+static inline int gralloc_drm_usage_cpu_cached(int usage)
+{
+	return ((usage & GRALLOC_USAGE_SW_READ_MASK) ==
+			GRALLOC_USAGE_SW_READ_OFTEN);
+}
 
 static inline int gralloc_drm_get_bpp(int format)
 {
@@ -133,7 +228,9 @@ int gralloc_drm_handle_register(buffer_handle_t handle, struct gralloc_drm_t *dr
 int gralloc_drm_handle_unregister(buffer_handle_t handle);
 
 struct gralloc_drm_bo_t *gralloc_drm_bo_create(struct gralloc_drm_t *drm, int width, int height, int format, int usage);
+void gralloc_drm_bo_incref(struct gralloc_drm_bo_t *bo);
 void gralloc_drm_bo_decref(struct gralloc_drm_bo_t *bo);
+void gralloc_drm_bo_cache_trim(struct gralloc_drm_t *drm, size_t budget);
 
 struct gralloc_drm_bo_t *gralloc_drm_bo_from_handle(buffer_handle_t handle);
 buffer_handle_t gralloc_drm_bo_get_handle(struct gralloc_drm_bo_t *bo, int *stride);
@@ -149,15 +246,49 @@ int gralloc_drm_bo_need_fb(const struct gralloc_drm_bo_t *bo);
 int gralloc_drm_bo_add_fb(struct gralloc_drm_bo_t *bo);
 void gralloc_drm_bo_rm_fb(struct gralloc_drm_bo_t *bo);
 int gralloc_drm_bo_post(struct gralloc_drm_bo_t *bo);
+int gralloc_drm_bo_queue_post(struct gralloc_drm_bo_t *bo,
+	int acquire_fence, int *present_fence);
+int gralloc_drm_set_damage(struct gralloc_drm_t *drm,
+	const struct gralloc_drm_rect *rects, int count);
+void gralloc_drm_set_post_release(struct gralloc_drm_t *drm,
+	gralloc_drm_post_release_t callback, void *data);
+int gralloc_drm_bo_present(struct gralloc_drm_bo_t *bo, int acquire_fence,
+	int target_type, uint64_t target);
+void gralloc_drm_set_present_callback(struct gralloc_drm_t *drm,
+	gralloc_drm_present_t callback, void *data);
+int gralloc_drm_set_swap_interval(struct gralloc_drm_t *drm, int interval);
 
 int gralloc_drm_reserve_plane(struct gralloc_drm_t *drm,
 	buffer_handle_t handle, uint32_t id,
 	uint32_t dst_x, uint32_t dst_y, uint32_t dst_w, uint32_t dst_h,
 	uint32_t src_x, uint32_t src_y, uint32_t src_w, uint32_t src_h);
+int gralloc_drm_reserve_display_plane(struct gralloc_drm_t *drm,
+	buffer_handle_t handle, uint32_t id, int display,
+	uint32_t dst_x, uint32_t dst_y, uint32_t dst_w, uint32_t dst_h,
+	uint32_t src_x, uint32_t src_y, uint32_t src_w, uint32_t src_h);
 void gralloc_drm_disable_planes(struct gralloc_drm_t *mod);
 int gralloc_drm_set_plane_handle(struct gralloc_drm_t *drm,
 	uint32_t id, buffer_handle_t handle);
 
+void gralloc_drm_get_cursor_size(struct gralloc_drm_t *drm,
+	uint32_t *width, uint32_t *height);
+int gralloc_drm_set_cursor(struct gralloc_drm_t *drm, int display,
+	buffer_handle_t handle, int hot_x, int hot_y);
+int gralloc_drm_move_cursor(struct gralloc_drm_t *drm, int display,
+	int x, int y);
+
+int gralloc_drm_set_display_mode(struct gralloc_drm_t *drm,
+	int display, int extended);
+int gralloc_drm_set_display_swap_interval(struct gralloc_drm_t *drm,
+	int display, int interval);
+int gralloc_drm_set_display_refresh(struct gralloc_drm_t *drm,
+	int display, int rate);
+int gralloc_drm_post_display(struct gralloc_drm_t *drm,
+	buffer_handle_t handle, int display,
+	int acquire_fence, int *present_fence);
+int gralloc_drm_capture(struct gralloc_drm_t *drm, int display,
+	int width, int height, gralloc_drm_capture_t callback, void *data);
+
 #ifdef __cplusplus
 }
 #endif
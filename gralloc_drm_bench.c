@@ -0,0 +1,609 @@
+/*
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * A benchmark of the hot paths of libgralloc_drm:
+ *
+ *   gralloc_drm_bench [-n iterations] [-t threads] [-s WxH] [test...]
+ *
+ * where the tests are alloc, lock, import and post, all of them by default.
+ * post needs DRM master, and flips in the swap mode picked at KMS init; set
+ * debug.drm.swap_mode to compare the modes.
+ */
+
+#define LOG_TAG "GRALLOC-BENCH"
+
+#include <cutils/native_handle.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#include "gralloc_drm.h"
+#include "gralloc_drm_priv.h"
+
+struct bench_samples {
+	uint64_t *ns;
+	int count, size;
+};
+
+static int bench_iterations = 1000;
+static int bench_threads = 4;
+static int bench_width = 1920, bench_height = 1080;
+
+static const struct {
+	const char *name;
+	int format;
+} bench_formats[] = {
+	{ "RGBA_8888", HAL_PIXEL_FORMAT_RGBA_8888 },
+	{ "RGB_565", HAL_PIXEL_FORMAT_RGB_565 },
+	{ "YV12", HAL_PIXEL_FORMAT_YV12 },
+	{ "NV12", HAL_PIXEL_FORMAT_DRM_NV12 },
+};
+
+static const struct {
+	const char *name;
+	int usage;
+} bench_usages[] = {
+	{ "sw", GRALLOC_USAGE_SW_READ_OFTEN | GRALLOC_USAGE_SW_WRITE_OFTEN },
+	{ "texture", GRALLOC_USAGE_HW_TEXTURE | GRALLOC_USAGE_HW_RENDER },
+	{ "composer", GRALLOC_USAGE_HW_TEXTURE | GRALLOC_USAGE_HW_COMPOSER },
+	{ "fb", GRALLOC_USAGE_HW_FB | GRALLOC_USAGE_HW_RENDER },
+};
+
+static uint64_t bench_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int bench_samples_init(struct bench_samples *samples, int size)
+{
+	samples->ns = malloc(sizeof(*samples->ns) * size);
+	samples->count = 0;
+	samples->size = (samples->ns) ? size : 0;
+
+	return (samples->ns) ? 0 : -ENOMEM;
+}
+
+static void bench_samples_fini(struct bench_samples *samples)
+{
+	free(samples->ns);
+	samples->ns = NULL;
+	samples->count = samples->size = 0;
+}
+
+static void bench_samples_add(struct bench_samples *samples, uint64_t ns)
+{
+	if (samples->count < samples->size)
+		samples->ns[samples->count++] = ns;
+}
+
+static int bench_cmp(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+
+	return (x > y) - (x < y);
+}
+
+/*
+ * Print the percentiles of samples in microseconds.  The samples are
+ * sorted.
+ */
+static void bench_report(const char *name, struct bench_samples *samples)
+{
+	const uint64_t *ns = samples->ns;
+	int n = samples->count;
+
+	if (!n) {
+		printf("%-32s no samples\n", name);
+		return;
+	}
+
+	qsort(samples->ns, n, sizeof(*ns), bench_cmp);
+
+	printf("%-32s n %6d  p50 %9.1f  p90 %9.1f  p99 %9.1f  max %9.1f us\n",
+			name, n,
+			ns[n * 50 / 100] / 1000.0,
+			ns[n * 90 / 100] / 1000.0,
+			ns[n * 99 / 100] / 1000.0,
+			ns[n - 1] / 1000.0);
+}
+
+/*
+ * Print the percentiles of a histogram of the stats, as the upper bounds of
+ * the buckets they fall in.
+ */
+static void bench_report_histogram(const char *name,
+		const struct gralloc_drm_histogram *hist)
+{
+	static const int percents[] = { 50, 90, 99 };
+	uint64_t bounds[3], sum = 0;
+	int i, p = 0;
+
+	if (!hist->count) {
+		printf("%-32s no samples\n", name);
+		return;
+	}
+
+	for (i = 0; i < GRALLOC_DRM_STATS_BUCKETS && p < 3; i++) {
+		sum += hist->buckets[i];
+		while (p < 3 && sum * 100 >= hist->count * percents[p])
+			bounds[p++] = (i < GRALLOC_DRM_STATS_BUCKETS - 1) ?
+				(2ULL << i) : hist->max_us;
+	}
+	while (p < 3)
+		bounds[p++] = hist->max_us;
+
+	printf("%-32s n %6llu  p50 <%8llu  p90 <%8llu  p99 <%8llu  max %9llu us\n",
+			name, (unsigned long long) hist->count,
+			(unsigned long long) bounds[0],
+			(unsigned long long) bounds[1],
+			(unsigned long long) bounds[2],
+			(unsigned long long) hist->max_us);
+}
+
+static void bench_alloc(struct gralloc_drm_t *drm)
+{
+	struct bench_samples create, destroy;
+	unsigned int f, u;
+	char name[64];
+	int i;
+
+	if (bench_samples_init(&create, bench_iterations) ||
+	    bench_samples_init(&destroy, bench_iterations)) {
+		bench_samples_fini(&create);
+		return;
+	}
+
+	for (f = 0; f < sizeof(bench_formats) / sizeof(bench_formats[0]); f++) {
+		for (u = 0; u < sizeof(bench_usages) / sizeof(bench_usages[0]); u++) {
+			create.count = destroy.count = 0;
+
+			for (i = 0; i < bench_iterations; i++) {
+				struct gralloc_drm_bo_t *bo;
+				uint64_t start = bench_now();
+
+				bo = gralloc_drm_bo_create(drm,
+						bench_width, bench_height,
+						bench_formats[f].format,
+						bench_usages[u].usage);
+				if (!bo)
+					break;
+				/* given out as by alloc_device_t, not cached */
+				gralloc_drm_bo_get_handle(bo, NULL);
+				bench_samples_add(&create, bench_now() - start);
+
+				start = bench_now();
+				gralloc_drm_bo_decref(bo);
+				bench_samples_add(&destroy, bench_now() - start);
+			}
+
+			snprintf(name, sizeof(name), "alloc %s %s",
+					bench_formats[f].name,
+					bench_usages[u].name);
+			bench_report(name, &create);
+			snprintf(name, sizeof(name), "free %s %s",
+					bench_formats[f].name,
+					bench_usages[u].name);
+			bench_report(name, &destroy);
+		}
+	}
+
+	bench_samples_fini(&create);
+	bench_samples_fini(&destroy);
+}
+
+struct bench_lock_thread {
+	pthread_t thread;
+	struct gralloc_drm_bo_t *bo;
+	struct bench_samples samples;
+};
+
+static void *bench_lock_loop(void *arg)
+{
+	struct bench_lock_thread *t = arg;
+	int usage = GRALLOC_USAGE_SW_READ_OFTEN | GRALLOC_USAGE_SW_WRITE_OFTEN;
+	void *addr;
+	int i;
+
+	for (i = 0; i < bench_iterations; i++) {
+		uint64_t start = bench_now();
+
+		if (gralloc_drm_bo_lock(t->bo, usage, 0, 0, 0, 0, &addr))
+			break;
+		gralloc_drm_bo_unlock(t->bo);
+		bench_samples_add(&t->samples, bench_now() - start);
+	}
+
+	return NULL;
+}
+
+/*
+ * Lock and unlock a bo per thread, all at once.
+ */
+static void bench_lock(struct gralloc_drm_t *drm)
+{
+	struct bench_lock_thread *threads;
+	struct bench_samples all;
+	uint64_t start, elapsed;
+	char name[64];
+	int i, started = 0;
+
+	threads = calloc(bench_threads, sizeof(*threads));
+	if (!threads)
+		return;
+	if (bench_samples_init(&all, bench_iterations * bench_threads)) {
+		free(threads);
+		return;
+	}
+
+	for (i = 0; i < bench_threads; i++) {
+		threads[i].bo = gralloc_drm_bo_create(drm,
+				bench_width, bench_height,
+				HAL_PIXEL_FORMAT_RGBA_8888,
+				GRALLOC_USAGE_SW_READ_OFTEN |
+				GRALLOC_USAGE_SW_WRITE_OFTEN);
+		if (!threads[i].bo ||
+		    bench_samples_init(&threads[i].samples, bench_iterations))
+			break;
+	}
+
+	start = bench_now();
+	if (i == bench_threads) {
+		for (started = 0; started < bench_threads; started++) {
+			if (pthread_create(&threads[started].thread, NULL,
+					bench_lock_loop, &threads[started]))
+				break;
+		}
+	}
+	for (i = 0; i < started; i++)
+		pthread_join(threads[i].thread, NULL);
+	elapsed = bench_now() - start;
+
+	for (i = 0; i < bench_threads; i++) {
+		int j;
+
+		for (j = 0; j < threads[i].samples.count; j++)
+			bench_samples_add(&all, threads[i].samples.ns[j]);
+		bench_samples_fini(&threads[i].samples);
+		if (threads[i].bo)
+			gralloc_drm_bo_decref(threads[i].bo);
+	}
+
+	snprintf(name, sizeof(name), "lock+unlock %d threads", started);
+	bench_report(name, &all);
+	if (elapsed)
+		printf("%-32s %.0f locks/s\n", "",
+				all.count * 1e9 / elapsed);
+
+	bench_samples_fini(&all);
+	free(threads);
+}
+
+/*
+ * Send a handle, which has one fd at most, over a socket.
+ */
+static int bench_send_handle(int sock, const native_handle_t *handle)
+{
+	char control[CMSG_SPACE(sizeof(int))];
+	struct msghdr msg;
+	int header[2] = { handle->numFds, handle->numInts };
+	struct iovec iovs[2];
+
+	memset(&msg, 0, sizeof(msg));
+	iovs[0].iov_base = header;
+	iovs[0].iov_len = sizeof(header);
+	iovs[1].iov_base = (void *) &handle->data[handle->numFds];
+	iovs[1].iov_len = sizeof(int) * handle->numInts;
+	msg.msg_iov = iovs;
+	msg.msg_iovlen = 2;
+
+	if (handle->numFds) {
+		struct cmsghdr *cmsg;
+
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+		cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+		memcpy(CMSG_DATA(cmsg), &handle->data[0], sizeof(int));
+	}
+
+	return (sendmsg(sock, &msg, 0) < 0) ? -errno : 0;
+}
+
+static native_handle_t *bench_recv_handle(int sock)
+{
+	char control[CMSG_SPACE(sizeof(int))];
+	int data[2 + 64];
+	struct msghdr msg;
+	struct iovec iov;
+	struct cmsghdr *cmsg;
+	native_handle_t *handle;
+	ssize_t size;
+	int fd = -1;
+
+	memset(&msg, 0, sizeof(msg));
+	iov.iov_base = data;
+	iov.iov_len = sizeof(data);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+
+	size = recvmsg(sock, &msg, 0);
+	if (size < (ssize_t) sizeof(int) * 2)
+		return NULL;
+
+	cmsg = CMSG_FIRSTHDR(&msg);
+	if (cmsg && cmsg->cmsg_type == SCM_RIGHTS)
+		memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+
+	if (data[0] != (fd >= 0) || data[1] < 0 ||
+	    size != (ssize_t) sizeof(int) * (2 + data[1])) {
+		if (fd >= 0)
+			close(fd);
+		return NULL;
+	}
+
+	handle = native_handle_create(data[0], data[1]);
+	if (!handle) {
+		if (fd >= 0)
+			close(fd);
+		return NULL;
+	}
+	if (fd >= 0)
+		handle->data[0] = fd;
+	memcpy(&handle->data[handle->numFds], &data[2],
+			sizeof(int) * data[1]);
+
+	return handle;
+}
+
+/*
+ * Register the handles from the parent in a new process, as a client of
+ * the allocator would.
+ */
+static void bench_import_child(int sock)
+{
+	struct gralloc_drm_t *drm;
+	struct bench_samples reg, unreg;
+	native_handle_t *handle;
+	char ack = 0;
+
+	drm = gralloc_drm_create();
+	if (!drm || bench_samples_init(&reg, bench_iterations) ||
+	    bench_samples_init(&unreg, bench_iterations))
+		_exit(1);
+
+	while ((handle = bench_recv_handle(sock))) {
+		uint64_t start = bench_now();
+
+		if (!gralloc_drm_handle_register(handle, drm)) {
+			bench_samples_add(&reg, bench_now() - start);
+
+			start = bench_now();
+			gralloc_drm_handle_unregister(handle);
+			bench_samples_add(&unreg, bench_now() - start);
+		}
+
+		native_handle_close(handle);
+		native_handle_delete(handle);
+
+		if (write(sock, &ack, 1) != 1)
+			break;
+	}
+
+	bench_report("import register", &reg);
+	bench_report("import unregister", &unreg);
+	fflush(stdout);
+
+	gralloc_drm_destroy(drm);
+	_exit(0);
+}
+
+static void bench_import(struct gralloc_drm_t *drm)
+{
+	int socks[2], i;
+	pid_t pid;
+	char ack;
+
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, socks)) {
+		fprintf(stderr, "failed to create sockets: %s\n",
+				strerror(errno));
+		return;
+	}
+
+	fflush(stdout);
+	pid = fork();
+	if (pid < 0) {
+		close(socks[0]);
+		close(socks[1]);
+		return;
+	}
+	if (!pid) {
+		close(socks[0]);
+		bench_import_child(socks[1]);
+	}
+	close(socks[1]);
+
+	for (i = 0; i < bench_iterations; i++) {
+		struct gralloc_drm_bo_t *bo;
+		buffer_handle_t handle;
+
+		bo = gralloc_drm_bo_create(drm, bench_width, bench_height,
+				HAL_PIXEL_FORMAT_RGBA_8888,
+				GRALLOC_USAGE_HW_TEXTURE |
+				GRALLOC_USAGE_HW_RENDER);
+		if (!bo)
+			break;
+
+		handle = gralloc_drm_bo_get_handle(bo, NULL);
+		if (bench_send_handle(socks[0], handle) ||
+		    read(socks[0], &ack, 1) != 1) {
+			gralloc_drm_bo_decref(bo);
+			break;
+		}
+
+		gralloc_drm_bo_decref(bo);
+	}
+
+	close(socks[0]);
+	waitpid(pid, NULL, 0);
+}
+
+/*
+ * Flip through three fbs, with the stats of the post path enabled.
+ */
+static void bench_post(struct gralloc_drm_t *drm)
+{
+	struct gralloc_drm_bo_t *bos[3];
+	struct gralloc_drm_post_stats stats;
+	struct bench_samples post;
+	static const char *modes[] = {
+		"no-op", "flip", "copy", "set-crtc", "atomic",
+	};
+	char name[64];
+	int i, count, err;
+
+	err = gralloc_drm_set_master(drm);
+	if (!err)
+		err = gralloc_drm_init_kms(drm);
+	if (err) {
+		fprintf(stderr, "no KMS for post: %s\n", strerror(-err));
+		return;
+	}
+	drm->stats_enabled = 1;
+
+	for (count = 0; count < 3; count++) {
+		bos[count] = gralloc_drm_bo_create(drm,
+				drm->primary->mode.hdisplay,
+				drm->primary->mode.vdisplay,
+				drm->primary->fb_format,
+				GRALLOC_USAGE_HW_FB | GRALLOC_USAGE_HW_RENDER);
+		if (!bos[count])
+			break;
+	}
+	if (count < 3 || bench_samples_init(&post, bench_iterations))
+		goto out;
+
+	for (i = 0; i < bench_iterations; i++) {
+		uint64_t start = bench_now();
+
+		if (gralloc_drm_bo_post(bos[i % 3]))
+			break;
+		bench_samples_add(&post, bench_now() - start);
+	}
+
+	snprintf(name, sizeof(name), "post %s", modes[drm->swap_mode]);
+	bench_report(name, &post);
+	bench_samples_fini(&post);
+
+	if (!gralloc_drm_get_post_stats(drm, &stats)) {
+		bench_report_histogram("post to flip", &stats.post_to_flip);
+		bench_report_histogram("wait for post", &stats.wait_for_post);
+		printf("%-32s %llu of %llu posts, %.2f%%\n", "missed vblanks",
+				(unsigned long long) stats.missed_vblanks,
+				(unsigned long long) stats.posts,
+				(stats.posts) ? stats.missed_vblanks * 100.0 /
+					stats.posts : 0.0);
+	}
+
+out:
+	while (count--)
+		gralloc_drm_bo_decref(bos[count]);
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "usage: %s [-n iterations] [-t threads] [-s WxH] "
+			"[alloc|lock|import|post]...\n", prog);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	static const struct {
+		const char *name;
+		void (*run)(struct gralloc_drm_t *drm);
+	} tests[] = {
+		{ "alloc", bench_alloc },
+		{ "lock", bench_lock },
+		{ "import", bench_import },
+		{ "post", bench_post },
+	};
+	struct gralloc_drm_t *drm;
+	unsigned int t;
+	int opt, i;
+
+	while ((opt = getopt(argc, argv, "n:t:s:")) != -1) {
+		switch (opt) {
+		case 'n':
+			bench_iterations = atoi(optarg);
+			break;
+		case 't':
+			bench_threads = atoi(optarg);
+			break;
+		case 's':
+			if (sscanf(optarg, "%dx%d", &bench_width,
+						&bench_height) != 2)
+				usage(argv[0]);
+			break;
+		default:
+			usage(argv[0]);
+			break;
+		}
+	}
+	if (bench_iterations <= 0 || bench_threads <= 0 ||
+	    bench_width <= 0 || bench_height <= 0)
+		usage(argv[0]);
+
+	drm = gralloc_drm_create();
+	if (!drm) {
+		fprintf(stderr, "failed to create the DRM device\n");
+		return 1;
+	}
+
+	for (t = 0; t < sizeof(tests) / sizeof(tests[0]); t++) {
+		int run = (optind == argc);
+
+		for (i = optind; i < argc; i++) {
+			if (!strcmp(argv[i], tests[t].name))
+				run = 1;
+		}
+		if (run)
+			tests[t].run(drm);
+	}
+
+	gralloc_drm_destroy(drm);
+
+	return 0;
+}
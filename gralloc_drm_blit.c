@@ -0,0 +1,570 @@
+/*
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#define LOG_TAG "GRALLOC-BLIT"
+
+#include <cutils/log.h>
+#include <cutils/properties.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#endif
+
+#include "gralloc_drm.h"
+#include "gralloc_drm_priv.h"
+
+/* max threads of a blit, including the caller */
+#define BLIT_THREADS_MAX 8
+/* min rows of a stripe, below that a thread costs more than it saves */
+#define BLIT_STRIPE_ROWS 64
+
+enum blit_op {
+	BLIT_COPY,
+	BLIT_SWAP_RB,     /* RGBA <-> BGRA */
+	BLIT_565_TO_8888,
+	BLIT_8888_TO_565,
+};
+
+struct blit_job {
+	enum blit_op op;
+	int bgra; /* the 8888 side is BGRA, for 565 conversions */
+
+	uint8_t *dst;
+	const uint8_t *src;
+	int dst_stride, src_stride;
+	int width, height;
+	int row_size; /* bytes copied per row, for BLIT_COPY */
+};
+
+struct gralloc_drm_blitter {
+	/* serializes the blits */
+	pthread_mutex_t blit_mutex;
+
+	pthread_mutex_t mutex;
+	pthread_cond_t work_cond, done_cond;
+	pthread_t threads[BLIT_THREADS_MAX - 1];
+	int thread_count, started;
+	int exit;
+
+	/* the stripes of the current job */
+	struct blit_job job;
+	int stripe_count, next_stripe, stripes_done;
+};
+
+/*
+ * Copy a row, with non-temporal stores where supported, as the destination
+ * is typically a write-combined fb that is not read back.
+ */
+static void blit_copy_row(uint8_t *dst, const uint8_t *src, size_t size)
+{
+#if defined(__SSE2__)
+	size_t head = (16 - ((uintptr_t) dst & 15)) & 15;
+
+	if (head > size)
+		head = size;
+	memcpy(dst, src, head);
+	dst += head;
+	src += head;
+	size -= head;
+
+	while (size >= 64) {
+		__m128i a = _mm_loadu_si128((const __m128i *) src);
+		__m128i b = _mm_loadu_si128((const __m128i *) (src + 16));
+		__m128i c = _mm_loadu_si128((const __m128i *) (src + 32));
+		__m128i d = _mm_loadu_si128((const __m128i *) (src + 48));
+
+		_mm_stream_si128((__m128i *) dst, a);
+		_mm_stream_si128((__m128i *) (dst + 16), b);
+		_mm_stream_si128((__m128i *) (dst + 32), c);
+		_mm_stream_si128((__m128i *) (dst + 48), d);
+
+		dst += 64;
+		src += 64;
+		size -= 64;
+	}
+#elif defined(__aarch64__)
+	while (size >= 64) {
+		uint8x16_t a = vld1q_u8(src);
+		uint8x16_t b = vld1q_u8(src + 16);
+		uint8x16_t c = vld1q_u8(src + 32);
+		uint8x16_t d = vld1q_u8(src + 48);
+
+		__asm__ volatile("stnp %q0, %q1, [%2]\n\t"
+				 "stnp %q3, %q4, [%2, #32]"
+				 :
+				 : "w" (a), "w" (b), "r" (dst), "w" (c), "w" (d)
+				 : "memory");
+
+		dst += 64;
+		src += 64;
+		size -= 64;
+	}
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+	while (size >= 64) {
+		uint8x16_t a = vld1q_u8(src);
+		uint8x16_t b = vld1q_u8(src + 16);
+		uint8x16_t c = vld1q_u8(src + 32);
+		uint8x16_t d = vld1q_u8(src + 48);
+
+		vst1q_u8(dst, a);
+		vst1q_u8(dst + 16, b);
+		vst1q_u8(dst + 32, c);
+		vst1q_u8(dst + 48, d);
+
+		dst += 64;
+		src += 64;
+		size -= 64;
+	}
+#endif
+
+	memcpy(dst, src, size);
+}
+
+static void blit_swap_rb_row(uint32_t *dst, const uint32_t *src, int width)
+{
+	int i;
+
+	for (i = 0; i < width; i++) {
+		uint32_t p = src[i];
+
+		dst[i] = (p & 0xff00ff00) |
+			((p >> 16) & 0xff) | ((p & 0xff) << 16);
+	}
+}
+
+static void blit_565_to_8888_row(uint32_t *dst, const uint16_t *src,
+		int width, int bgra)
+{
+	int i;
+
+	for (i = 0; i < width; i++) {
+		uint32_t p = src[i];
+		uint32_t r = (p >> 11) & 0x1f;
+		uint32_t g = (p >> 5) & 0x3f;
+		uint32_t b = p & 0x1f;
+
+		r = (r << 3) | (r >> 2);
+		g = (g << 2) | (g >> 4);
+		b = (b << 3) | (b >> 2);
+
+		dst[i] = 0xff000000 | (g << 8) |
+			((bgra) ? (r << 16) | b : (b << 16) | r);
+	}
+}
+
+static void blit_8888_to_565_row(uint16_t *dst, const uint32_t *src,
+		int width, int bgra)
+{
+	int i;
+
+	for (i = 0; i < width; i++) {
+		uint32_t p = src[i];
+		uint32_t r = (bgra) ? (p >> 16) & 0xff : p & 0xff;
+		uint32_t g = (p >> 8) & 0xff;
+		uint32_t b = (bgra) ? p & 0xff : (p >> 16) & 0xff;
+
+		dst[i] = ((r >> 3) << 11) | ((g >> 2) << 5) | (b >> 3);
+	}
+}
+
+/*
+ * Blit rows [y1, y2) of a job.
+ */
+static void blit_run_rows(const struct blit_job *job, int y1, int y2)
+{
+	int y;
+
+	for (y = y1; y < y2; y++) {
+		uint8_t *dst = job->dst + (size_t) job->dst_stride * y;
+		const uint8_t *src = job->src + (size_t) job->src_stride * y;
+
+		switch (job->op) {
+		case BLIT_COPY:
+			blit_copy_row(dst, src, job->row_size);
+			break;
+		case BLIT_SWAP_RB:
+			blit_swap_rb_row((uint32_t *) dst,
+					(const uint32_t *) src, job->width);
+			break;
+		case BLIT_565_TO_8888:
+			blit_565_to_8888_row((uint32_t *) dst,
+					(const uint16_t *) src,
+					job->width, job->bgra);
+			break;
+		case BLIT_8888_TO_565:
+			blit_8888_to_565_row((uint16_t *) dst,
+					(const uint32_t *) src,
+					job->width, job->bgra);
+			break;
+		}
+	}
+
+#if defined(__SSE2__)
+	/* order the streaming stores */
+	_mm_sfence();
+#endif
+}
+
+/*
+ * Run the stripes of the current job until there is none left.  The mutex
+ * must be held.
+ */
+static void blit_run_stripes(struct gralloc_drm_blitter *blitter)
+{
+	while (blitter->next_stripe < blitter->stripe_count) {
+		const struct blit_job *job = &blitter->job;
+		int stripe = blitter->next_stripe++;
+		int y1 = job->height * stripe / blitter->stripe_count;
+		int y2 = job->height * (stripe + 1) / blitter->stripe_count;
+
+		pthread_mutex_unlock(&blitter->mutex);
+		blit_run_rows(job, y1, y2);
+		pthread_mutex_lock(&blitter->mutex);
+
+		if (++blitter->stripes_done == blitter->stripe_count)
+			pthread_cond_signal(&blitter->done_cond);
+	}
+}
+
+static void *blit_worker(void *data)
+{
+	struct gralloc_drm_blitter *blitter =
+		(struct gralloc_drm_blitter *) data;
+
+	pthread_mutex_lock(&blitter->mutex);
+	while (1) {
+		while (!blitter->exit &&
+		       blitter->next_stripe >= blitter->stripe_count)
+			pthread_cond_wait(&blitter->work_cond, &blitter->mutex);
+		if (blitter->exit)
+			break;
+
+		blit_run_stripes(blitter);
+	}
+	pthread_mutex_unlock(&blitter->mutex);
+
+	return NULL;
+}
+
+/*
+ * Start the worker threads on the first blit, so that only the processes
+ * that blit have them.  debug.drm.blit_threads sets the number of threads of
+ * a blit, and defaults to the number of CPUs up to 4.
+ */
+static void blit_start_workers(struct gralloc_drm_blitter *blitter)
+{
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	int threads, i;
+
+	blitter->started = 1;
+
+	threads = property_get_int32("debug.drm.blit_threads",
+			(cpus > 4) ? 4 : (int) cpus);
+	threads = MIN(MAX(threads, 1), BLIT_THREADS_MAX);
+
+	for (i = 0; i < threads - 1; i++) {
+		if (pthread_create(&blitter->threads[i], NULL,
+					blit_worker, blitter))
+			break;
+	}
+	blitter->thread_count = i;
+}
+
+/*
+ * Run a job on the workers and the calling thread.
+ */
+static void blit_run(struct gralloc_drm_blitter *blitter,
+		const struct blit_job *job)
+{
+	int stripes;
+
+	pthread_mutex_lock(&blitter->blit_mutex);
+
+	if (!blitter->started)
+		blit_start_workers(blitter);
+
+	stripes = MIN(blitter->thread_count + 1,
+			MAX(job->height / BLIT_STRIPE_ROWS, 1));
+	if (stripes == 1) {
+		blit_run_rows(job, 0, job->height);
+		pthread_mutex_unlock(&blitter->blit_mutex);
+		return;
+	}
+
+	pthread_mutex_lock(&blitter->mutex);
+	blitter->job = *job;
+	blitter->stripe_count = stripes;
+	blitter->next_stripe = 0;
+	blitter->stripes_done = 0;
+	pthread_cond_broadcast(&blitter->work_cond);
+
+	blit_run_stripes(blitter);
+	while (blitter->stripes_done < blitter->stripe_count)
+		pthread_cond_wait(&blitter->done_cond, &blitter->mutex);
+	pthread_mutex_unlock(&blitter->mutex);
+
+	pthread_mutex_unlock(&blitter->blit_mutex);
+}
+
+/*
+ * Return the byte order of a RGB format: 0 for RGBA, 1 for BGRA, and 2 for
+ * RGB565, or -1 for other formats.
+ */
+static int blit_rgb_order(int format)
+{
+	switch (format) {
+	case HAL_PIXEL_FORMAT_RGBA_8888:
+	case HAL_PIXEL_FORMAT_RGBX_8888:
+		return 0;
+	case HAL_PIXEL_FORMAT_BGRA_8888:
+		return 1;
+	case HAL_PIXEL_FORMAT_RGB_565:
+		return 2;
+	default:
+		return -1;
+	}
+}
+
+static int blit_choose_op(int dst_format, int src_format, struct blit_job *job)
+{
+	int dst_order = blit_rgb_order(dst_format);
+	int src_order = blit_rgb_order(src_format);
+
+	/* packed formats are copied as is; planar ones are not supported */
+	if (dst_format == src_format) {
+		job->op = BLIT_COPY;
+		return (gralloc_drm_get_bpp(dst_format) >= 2) ? 0 : -EINVAL;
+	}
+
+	if (dst_order >= 0 && dst_order == src_order) {
+		job->op = BLIT_COPY;
+		return 0;
+	}
+
+	if (dst_order < 0 || src_order < 0)
+		return -EINVAL;
+
+	if (dst_order == 2) {
+		job->op = BLIT_8888_TO_565;
+		job->bgra = src_order;
+	}
+	else if (src_order == 2) {
+		job->op = BLIT_565_TO_8888;
+		job->bgra = dst_order;
+	}
+	else {
+		job->op = BLIT_SWAP_RB;
+	}
+
+	return 0;
+}
+
+/*
+ * Blit with the CPU, for drivers that cannot.  Both bos are mapped with
+ * gralloc_drm_bo_lock, and the rows are split among the threads of the
+ * blitter, or copied by the calling thread alone without one.
+ */
+static void gralloc_drm_cpu_blit(struct gralloc_drm_blitter *blitter,
+		struct gralloc_drm_bo_t *dst, struct gralloc_drm_bo_t *src,
+		uint16_t dst_x1, uint16_t dst_y1,
+		uint16_t dst_x2, uint16_t dst_y2,
+		uint16_t src_x1, uint16_t src_y1,
+		uint16_t src_x2, uint16_t src_y2)
+{
+	struct blit_job job;
+	int dst_cpp, src_cpp, width, height;
+	void *dst_addr, *src_addr;
+
+	if (blit_choose_op(dst->handle->format, src->handle->format, &job)) {
+		ALOGE("%s, blit from format %d to %d is not supported",
+				__func__, src->handle->format,
+				dst->handle->format);
+		return;
+	}
+
+	dst_x2 = MIN(dst_x2, dst->handle->width);
+	dst_y2 = MIN(dst_y2, dst->handle->height);
+	src_x2 = MIN(src_x2, src->handle->width);
+	src_y2 = MIN(src_y2, src->handle->height);
+	if (dst_x2 <= dst_x1 || dst_y2 <= dst_y1 ||
+	    src_x2 <= src_x1 || src_y2 <= src_y1)
+		return;
+
+	/* no scaling */
+	width = MIN(dst_x2 - dst_x1, src_x2 - src_x1);
+	height = MIN(dst_y2 - dst_y1, src_y2 - src_y1);
+
+	if (gralloc_drm_bo_lock(src, GRALLOC_USAGE_SW_READ_OFTEN,
+				src_x1, src_y1, width, height, &src_addr)) {
+		ALOGE("%s, failed to map the source", __func__);
+		return;
+	}
+	if (gralloc_drm_bo_lock(dst, GRALLOC_USAGE_SW_WRITE_OFTEN,
+				dst_x1, dst_y1, width, height, &dst_addr)) {
+		ALOGE("%s, failed to map the destination", __func__);
+		gralloc_drm_bo_unlock(src);
+		return;
+	}
+
+	dst_cpp = gralloc_drm_get_bpp(dst->handle->format);
+	src_cpp = gralloc_drm_get_bpp(src->handle->format);
+
+	job.dst = (uint8_t *) dst_addr + (size_t) dst->handle->stride * dst_y1 +
+		dst_x1 * dst_cpp;
+	job.src = (const uint8_t *) src_addr +
+		(size_t) src->handle->stride * src_y1 + src_x1 * src_cpp;
+	job.dst_stride = dst->handle->stride;
+	job.src_stride = src->handle->stride;
+	job.width = width;
+	job.height = height;
+	job.row_size = width * dst_cpp;
+
+	if (blitter)
+		blit_run(blitter, &job);
+	else
+		blit_run_rows(&job, 0, job.height);
+
+	gralloc_drm_bo_unlock(dst);
+	gralloc_drm_bo_unlock(src);
+}
+
+static void blit_dispatch(struct gralloc_drm_t *drm,
+		struct gralloc_drm_bo_t *dst, struct gralloc_drm_bo_t *src,
+		uint16_t dst_x1, uint16_t dst_y1,
+		uint16_t dst_x2, uint16_t dst_y2,
+		uint16_t src_x1, uint16_t src_y1,
+		uint16_t src_x2, uint16_t src_y2, int shared)
+{
+	struct gralloc_drm_drv_t *drv = drm->drv;
+	struct gralloc_drm_bo_t *drv_dst = dst, *drv_src = src;
+	int convert = (dst->handle->format != src->handle->format ||
+		       dst_x2 - dst_x1 != src_x2 - src_x1 ||
+		       dst_y2 - dst_y1 != src_y2 - src_y1);
+
+	if (dst->render || src->render) {
+		drv = drm->render_drv;
+		drv_dst = gralloc_drm_bo_render_import(dst);
+		drv_src = gralloc_drm_bo_render_import(src);
+		if (!drv_dst || !drv_src)
+			drv = NULL;
+	}
+
+	/*
+	 * the posts and the captures blit from their own threads, and the
+	 * drivers queue their blits in shared batches
+	 */
+	if (drv && convert && drv->scale_blit) {
+		pthread_mutex_lock(&drm->blit_mutex);
+		drv->scale_blit(drv, drv_dst, drv_src,
+				dst_x1, dst_y1, dst_x2, dst_y2,
+				src_x1, src_y1, src_x2, src_y2);
+		pthread_mutex_unlock(&drm->blit_mutex);
+	}
+	else if (drv && drv->blit && !convert) {
+		pthread_mutex_lock(&drm->blit_mutex);
+		drv->blit(drv, drv_dst, drv_src,
+				dst_x1, dst_y1, dst_x2, dst_y2,
+				src_x1, src_y1, src_x2, src_y2);
+		pthread_mutex_unlock(&drm->blit_mutex);
+	}
+	else if (drm->blitter || !shared) {
+		gralloc_drm_cpu_blit((shared) ? drm->blitter : NULL, dst, src,
+				dst_x1, dst_y1, dst_x2, dst_y2,
+				src_x1, src_y1, src_x2, src_y2);
+	}
+}
+
+/*
+ * Blit between two bos, with the driver or else with the CPU.  The blit may
+ * be queued by the driver until drv->flush is called.  The rects are scaled
+ * only by drv->scale_blit; the CPU clamps them to the smaller one.  The
+ * render device blits when either bo is on it, and imports the other by
+ * PRIME fd.
+ */
+void gralloc_drm_blit(struct gralloc_drm_t *drm,
+		struct gralloc_drm_bo_t *dst, struct gralloc_drm_bo_t *src,
+		uint16_t dst_x1, uint16_t dst_y1,
+		uint16_t dst_x2, uint16_t dst_y2,
+		uint16_t src_x1, uint16_t src_y1,
+		uint16_t src_x2, uint16_t src_y2)
+{
+	blit_dispatch(drm, dst, src, dst_x1, dst_y1, dst_x2, dst_y2,
+			src_x1, src_y1, src_x2, src_y2, 1);
+}
+
+/*
+ * Blit like gralloc_drm_blit, but copy with the CPU on the calling thread
+ * alone, so that a long copy does not hold up the blits of the posts.
+ */
+void gralloc_drm_blit_unshared(struct gralloc_drm_t *drm,
+		struct gralloc_drm_bo_t *dst, struct gralloc_drm_bo_t *src,
+		uint16_t dst_x1, uint16_t dst_y1,
+		uint16_t dst_x2, uint16_t dst_y2,
+		uint16_t src_x1, uint16_t src_y1,
+		uint16_t src_x2, uint16_t src_y2)
+{
+	blit_dispatch(drm, dst, src, dst_x1, dst_y1, dst_x2, dst_y2,
+			src_x1, src_y1, src_x2, src_y2, 0);
+}
+
+/*
+ * Create the CPU blitter.  The threads are started on the first blit.
+ */
+struct gralloc_drm_blitter *gralloc_drm_blitter_create(void)
+{
+	struct gralloc_drm_blitter *blitter;
+
+	blitter = calloc(1, sizeof(*blitter));
+	if (!blitter)
+		return NULL;
+
+	pthread_mutex_init(&blitter->blit_mutex, NULL);
+	pthread_mutex_init(&blitter->mutex, NULL);
+	pthread_cond_init(&blitter->work_cond, NULL);
+	pthread_cond_init(&blitter->done_cond, NULL);
+
+	return blitter;
+}
+
+void gralloc_drm_blitter_destroy(struct gralloc_drm_blitter *blitter)
+{
+	int i;
+
+	pthread_mutex_lock(&blitter->mutex);
+	blitter->exit = 1;
+	pthread_cond_broadcast(&blitter->work_cond);
+	pthread_mutex_unlock(&blitter->mutex);
+
+	for (i = 0; i < blitter->thread_count; i++)
+		pthread_join(blitter->threads[i], NULL);
+
+	pthread_cond_destroy(&blitter->done_cond);
+	pthread_cond_destroy(&blitter->work_cond);
+	pthread_mutex_destroy(&blitter->mutex);
+	pthread_mutex_destroy(&blitter->blit_mutex);
+	free(blitter);
+}
@@ -0,0 +1,210 @@
+/*
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Dumb buffers, for display controllers without a supported render driver.
+ * The bos are linear and the CPU writes them; the render device imports
+ * them by PRIME fd.
+ */
+
+#define LOG_TAG "GRALLOC-DUMB"
+
+#include <cutils/log.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <xf86drm.h>
+#include <drm_fourcc.h>
+
+#include "gralloc_drm.h"
+#include "gralloc_drm_priv.h"
+
+struct dumb_info {
+	struct gralloc_drm_drv_t base;
+
+	int fd;
+};
+
+struct dumb_buffer {
+	struct gralloc_drm_bo_t base;
+
+	uint32_t handle;
+	uint64_t size;
+	void *addr; /* mapped on first use, until the bo is freed */
+};
+
+static struct gralloc_drm_bo_t *dumb_alloc(struct gralloc_drm_drv_t *drv,
+		struct gralloc_drm_handle_t *handle)
+{
+	struct dumb_info *info = (struct dumb_info *) drv;
+	struct dumb_buffer *db;
+	int width, height, cpp;
+
+	cpp = gralloc_drm_get_bpp(handle->format);
+	if (!cpp) {
+		ALOGE("unrecognized format 0x%x", handle->format);
+		return NULL;
+	}
+
+	db = calloc(1, sizeof(*db));
+	if (!db)
+		return NULL;
+
+	width = handle->width;
+	height = handle->height;
+	gralloc_drm_align_geometry(handle->format, &width, &height);
+
+	if (handle->prime_fd >= 0 || handle->name) {
+		if (handle->prime_fd < 0 ||
+		    drmPrimeFDToHandle(info->fd, handle->prime_fd,
+			    &db->handle)) {
+			ALOGE("failed to import dumb bo (fd %d, name %u)",
+					handle->prime_fd, handle->name);
+			free(db);
+			return NULL;
+		}
+		db->size = (uint64_t) handle->stride * height;
+	}
+	else {
+		struct drm_mode_create_dumb create;
+
+		memset(&create, 0, sizeof(create));
+		create.width = width;
+		create.height = height;
+		create.bpp = cpp * 8;
+		if (drmIoctl(info->fd, DRM_IOCTL_MODE_CREATE_DUMB, &create)) {
+			ALOGE("failed to allocate dumb bo %dx%dx%d",
+					handle->width, handle->height, cpp);
+			free(db);
+			return NULL;
+		}
+
+		db->handle = create.handle;
+		db->size = create.size;
+		handle->stride = create.pitch;
+		handle->modifier = DRM_FORMAT_MOD_LINEAR;
+	}
+
+	db->base.fb_handle = db->handle;
+	db->base.handle = handle;
+
+	return &db->base;
+}
+
+static void dumb_free(struct gralloc_drm_drv_t *drv,
+		struct gralloc_drm_bo_t *bo)
+{
+	struct dumb_info *info = (struct dumb_info *) drv;
+	struct dumb_buffer *db = (struct dumb_buffer *) bo;
+	struct drm_gem_close close_arg;
+
+	if (db->addr)
+		munmap(db->addr, db->size);
+
+	memset(&close_arg, 0, sizeof(close_arg));
+	close_arg.handle = db->handle;
+	drmIoctl(info->fd, DRM_IOCTL_GEM_CLOSE, &close_arg);
+
+	free(db);
+}
+
+static int dumb_map(struct gralloc_drm_drv_t *drv,
+		struct gralloc_drm_bo_t *bo, int x, int y, int w, int h,
+		int enable_write, void **addr)
+{
+	struct dumb_info *info = (struct dumb_info *) drv;
+	struct dumb_buffer *db = (struct dumb_buffer *) bo;
+	struct drm_mode_map_dumb map;
+	void *ptr;
+
+	if (!db->addr) {
+		memset(&map, 0, sizeof(map));
+		map.handle = db->handle;
+		if (drmIoctl(info->fd, DRM_IOCTL_MODE_MAP_DUMB, &map))
+			return -errno;
+
+		ptr = mmap(NULL, db->size, PROT_READ | PROT_WRITE, MAP_SHARED,
+				info->fd, map.offset);
+		if (ptr == MAP_FAILED)
+			return -errno;
+		db->addr = ptr;
+	}
+
+	*addr = db->addr;
+
+	return 0;
+}
+
+static void dumb_unmap(struct gralloc_drm_drv_t *drv,
+		struct gralloc_drm_bo_t *bo)
+{
+	/* the mapping is kept for the next lock */
+}
+
+static void dumb_init_kms_features(struct gralloc_drm_drv_t *drv,
+		struct gralloc_drm_t *drm)
+{
+	switch (drm->primary->fb_format) {
+	case HAL_PIXEL_FORMAT_RGBA_8888:
+	case HAL_PIXEL_FORMAT_BGRA_8888:
+	case HAL_PIXEL_FORMAT_RGB_565:
+		break;
+	default:
+		drm->primary->fb_format = HAL_PIXEL_FORMAT_BGRA_8888;
+		break;
+	}
+
+	drm->mode_quirk_vmwgfx = 0;
+	drm->swap_mode = DRM_SWAP_FLIP;
+	drm->mode_sync_flip = 1;
+	drm->swap_interval = 1;
+	drm->vblank_secondary = 0;
+}
+
+static void dumb_destroy(struct gralloc_drm_drv_t *drv)
+{
+	struct dumb_info *info = (struct dumb_info *) drv;
+	free(info);
+}
+
+struct gralloc_drm_drv_t *gralloc_drm_drv_create_for_dumb(int fd)
+{
+	struct dumb_info *info;
+	uint64_t cap;
+
+	if (drmGetCap(fd, DRM_CAP_DUMB_BUFFER, &cap) || !cap)
+		return NULL;
+
+	info = calloc(1, sizeof(*info));
+	if (!info)
+		return NULL;
+
+	info->fd = fd;
+
+	info->base.destroy = dumb_destroy;
+	info->base.init_kms_features = dumb_init_kms_features;
+	info->base.alloc = dumb_alloc;
+	info->base.free = dumb_free;
+	info->base.map = dumb_map;
+	info->base.unmap = dumb_unmap;
+
+	return &info->base;
+}
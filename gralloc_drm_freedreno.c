@@ -58,7 +58,10 @@ static struct fd_bo *alloc_bo(struct fd_info *info,
 	int flags, size;
 
 	/* TODO need a scanout flag if (usage & GRALLOC_USAGE_HW_FB).. */
-	flags = DRM_FREEDRENO_GEM_CACHE_WCOMBINE;
+	if (gralloc_drm_usage_cpu_cached(usage))
+		flags = DRM_FREEDRENO_GEM_CACHE_WBACK;
+	else
+		flags = DRM_FREEDRENO_GEM_CACHE_WCOMBINE;
 
 	*pitch = ALIGN(width, 32) * cpp;
 	size = *pitch * height;
@@ -83,11 +86,15 @@ fd_alloc(struct gralloc_drm_drv_t *drv, struct gralloc_drm_handle_t *handle)
 	if (!fd_buf)
 		return NULL;
 
-	if (handle->name) {
-		fd_buf->bo = fd_bo_from_name(info->dev, handle->name);
+	if (handle->prime_fd >= 0 || handle->name) {
+		if (handle->prime_fd >= 0)
+			fd_buf->bo = fd_bo_from_dmabuf(info->dev,
+					handle->prime_fd);
+		else
+			fd_buf->bo = fd_bo_from_name(info->dev, handle->name);
 		if (!fd_buf->bo) {
-			ALOGE("failed to create fd bo from name %u",
-					handle->name);
+			ALOGE("failed to import fd bo (fd %d, name %u)",
+					handle->prime_fd, handle->name);
 			free(fd_buf);
 			return NULL;
 		}
@@ -108,7 +115,8 @@ fd_alloc(struct gralloc_drm_drv_t *drv, struct gralloc_drm_handle_t *handle)
 			return NULL;
 		}
 
-		if (fd_bo_get_name(fd_buf->bo, (uint32_t *) &handle->name)) {
+		if (!drv->render_node &&
+		    fd_bo_get_name(fd_buf->bo, (uint32_t *) &handle->name)) {
 			ALOGE("failed to flink fd bo");
 			fd_bo_del(fd_buf->bo);
 			free(fd_buf);
@@ -118,8 +126,7 @@ fd_alloc(struct gralloc_drm_drv_t *drv, struct gralloc_drm_handle_t *handle)
 		handle->stride = pitch;
 	}
 
-	if (handle->usage & GRALLOC_USAGE_HW_FB)
-		fd_buf->base.fb_handle = fd_bo_handle(fd_buf->bo);
+	fd_buf->base.fb_handle = fd_bo_handle(fd_buf->bo);
 
 	fd_buf->base.handle = handle;
 
@@ -139,14 +146,28 @@ static int fd_map(struct gralloc_drm_drv_t *drv,
 		int enable_write, void **addr)
 {
 	struct fd_buffer *fd_buf = (struct fd_buffer *) bo;
-	if (fd_bo_map(fd_buf->bo))
-		return 0;
-	return -errno;
+	uint32_t op = DRM_FREEDRENO_PREP_READ;
+
+	/* the bo is mmapped, so only the pages of the rect are faulted in */
+	*addr = fd_bo_map(fd_buf->bo);
+	if (!*addr)
+		return -errno;
+
+	/* wait for the GPU and invalidate the CPU caches */
+	if (enable_write)
+		op |= DRM_FREEDRENO_PREP_WRITE;
+
+	return fd_bo_cpu_prep(fd_buf->bo, NULL, op);
 }
 
 static void fd_unmap(struct gralloc_drm_drv_t *drv,
 		struct gralloc_drm_bo_t *bo)
 {
+	struct fd_buffer *fd_buf = (struct fd_buffer *) bo;
+
+	/* flush the CPU caches */
+	fd_bo_cpu_fini(fd_buf->bo);
+
 	// TODO should add fd_bo_unmap() to libdrm_freedreno someday..
 }
 
@@ -37,7 +37,7 @@ struct gralloc_drm_handle_t {
 	native_handle_t base;
 
 	/* file descriptors */
-	int prime_fd;
+	int prime_fd; /* dma-buf of the bo, -1 and not an fd when numFds is 0 */
 
 	int magic;
 
@@ -50,8 +50,17 @@ struct gralloc_drm_handle_t {
 
 	int name;   /* the name of the bo */
 	int stride; /* the stride in bytes */
+	uint64_t modifier; /* layout of the bo, DRM_FORMAT_MOD_INVALID if implicit */
+	int layout; /* GRALLOC_DRM_LAYOUT_* asked of the driver */
+	int render; /* allocated on the render device, not the display device */
+
+	/* planes of the format in DRM order, e.g. Y, Cb and Cr of YV12 */
+	int plane_count;
+	uint32_t offsets[3];
+	uint32_t pitches[3];
 
 	int data_owner; /* owner of data (for validation) */
+	int data_refs; /* registrations of the handle by the owner */
 	union {
 		struct gralloc_drm_bo_t *data; /* pointer to struct gralloc_drm_bo_t */
 		int64_t __padding;
@@ -59,10 +68,11 @@ struct gralloc_drm_handle_t {
 };
 
 #define GRALLOC_DRM_HANDLE_MAGIC 0x12345678
-#define GRALLOC_DRM_HANDLE_NUM_FDS 0
+#define GRALLOC_DRM_HANDLE_NUM_FDS 1
+#define GRALLOC_DRM_HANDLE_NUM_DATA (						\
+	(sizeof(struct gralloc_drm_handle_t) - sizeof(native_handle_t))/sizeof(int))
 #define GRALLOC_DRM_HANDLE_NUM_INTS (						\
-	((sizeof(struct gralloc_drm_handle_t) - sizeof(native_handle_t))/sizeof(int))	\
-	 - GRALLOC_DRM_HANDLE_NUM_FDS)
+	GRALLOC_DRM_HANDLE_NUM_DATA - GRALLOC_DRM_HANDLE_NUM_FDS)
 
 static inline struct gralloc_drm_handle_t *gralloc_drm_handle(buffer_handle_t _handle)
 {
@@ -70,8 +80,9 @@ static inline struct gralloc_drm_handle_t *gralloc_drm_handle(buffer_handle_t _h
 		(struct gralloc_drm_handle_t *) _handle;
 
 	if (handle && (handle->base.version != sizeof(handle->base) ||
-	               handle->base.numInts != GRALLOC_DRM_HANDLE_NUM_INTS ||
-	               handle->base.numFds != GRALLOC_DRM_HANDLE_NUM_FDS ||
+	               handle->base.numInts + handle->base.numFds !=
+	                       GRALLOC_DRM_HANDLE_NUM_DATA ||
+	               handle->base.numFds > GRALLOC_DRM_HANDLE_NUM_FDS ||
 	               handle->magic != GRALLOC_DRM_HANDLE_MAGIC))
 		handle = NULL;
 
@@ -36,6 +36,7 @@
 #include <drm.h>
 #include <intel_bufmgr.h>
 #include <i915_drm.h>
+#include <drm_fourcc.h>
 
 #include "gralloc_drm.h"
 #include "gralloc_drm_priv.h"
@@ -46,14 +47,25 @@
 #define MI_FLUSH_DW                 (0x26 << 23)
 #define MI_WRITE_DIRTY_STATE        (1 << 4) 
 #define MI_INVALIDATE_MAP_CACHE     (1 << 0)
+#define MI_LOAD_REGISTER_IMM        ((0x22 << 23) | 1)
+#define BCS_SWCTRL                  0x22200
+#define BCS_SWCTRL_SRC_Y            (1 << 0)
+#define BCS_SWCTRL_DST_Y            (1 << 1)
 #define XY_SRC_COPY_BLT_CMD         ((2 << 29) | (0x53 << 22))
 #define XY_SRC_COPY_BLT_WRITE_ALPHA (1 << 21)
 #define XY_SRC_COPY_BLT_WRITE_RGB   (1 << 20)
 #define XY_SRC_COPY_BLT_SRC_TILED   (1 << 15)
 #define XY_SRC_COPY_BLT_DST_TILED   (1 << 11)
+#define XY_COLOR_BLT_CMD            ((2 << 29) | (0x50 << 22))
+#define XY_COLOR_BLT_WRITE_ALPHA    (1 << 21)
+#define XY_COLOR_BLT_WRITE_RGB      (1 << 20)
+#define XY_COLOR_BLT_TILED          (1 << 11)
 
 #define DEBUG_BLT 0
 
+/* number of batch bos to cycle through */
+#define BATCH_RING_SIZE 4
+
 struct intel_info {
 	struct gralloc_drm_drv_t base;
 
@@ -62,6 +74,8 @@ struct intel_info {
 	int gen;
 
 	drm_intel_bo *batch_ibo;
+	drm_intel_bo *batch_ring[BATCH_RING_SIZE];
+	int batch_ring_next;
 	uint32_t *batch, *cur;
 	int capacity, size;
 	int exec_blt;
@@ -73,16 +87,30 @@ struct intel_buffer {
 	uint32_t tiling;
 };
 
+/*
+ * Move to the next batch bo of the ring.  A bo still busy on the GPU is
+ * replaced by a new one rather than waited for.
+ */
 static int
 batch_next(struct intel_info *info)
 {
+	drm_intel_bo **slot;
+
 	info->cur = info->batch;
 
-	if (info->batch_ibo)
-		drm_intel_bo_unreference(info->batch_ibo);
+	slot = &info->batch_ring[info->batch_ring_next];
+	info->batch_ring_next = (info->batch_ring_next + 1) % BATCH_RING_SIZE;
 
-	info->batch_ibo = drm_intel_bo_alloc(info->bufmgr,
-			"gralloc-batchbuffer", info->size, 4096);
+	if (*slot && drm_intel_bo_busy(*slot)) {
+		drm_intel_bo_unreference(*slot);
+		*slot = NULL;
+	}
+
+	if (!*slot)
+		*slot = drm_intel_bo_alloc(info->bufmgr,
+				"gralloc-batchbuffer", info->size, 4096);
+
+	info->batch_ibo = *slot;
 
 	return (info->batch_ibo) ? 0 : -ENOMEM;
 }
@@ -133,11 +161,54 @@ batch_reloc64(struct intel_info *info, struct gralloc_drm_bo_t *bo,
 	return ret;
 }
 
+/*
+ * Flush the blitter caches so that the blits are visible to scanout.  There
+ * is always room for it in the slack after capacity.
+ */
+static void
+batch_emit_flush(struct intel_info *info)
+{
+	if (info->gen >= 60) {
+		batch_dword(info, MI_FLUSH_DW | 2);
+		batch_dword(info, 0);
+		batch_dword(info, 0);
+		batch_dword(info, 0);
+	}
+	else {
+		int flags = (info->gen >= 40) ? 0 :
+			MI_WRITE_DIRTY_STATE | MI_INVALIDATE_MAP_CACHE;
+
+		batch_dword(info, MI_FLUSH | flags);
+	}
+}
+
+/*
+ * Have the tiled bits of the following blits select Y instead of X tiling.
+ * Takes BATCH_BLT_TILING_SIZE dwords.
+ */
+#define BATCH_BLT_TILING_SIZE 7
+static void
+batch_set_blt_tiling(struct intel_info *info, int dst_y, int src_y)
+{
+	batch_dword(info, MI_FLUSH_DW | 2);
+	batch_dword(info, 0);
+	batch_dword(info, 0);
+	batch_dword(info, 0);
+
+	batch_dword(info, MI_LOAD_REGISTER_IMM);
+	batch_dword(info, BCS_SWCTRL);
+	batch_dword(info, ((BCS_SWCTRL_DST_Y | BCS_SWCTRL_SRC_Y) << 16) |
+			(dst_y ? BCS_SWCTRL_DST_Y : 0) |
+			(src_y ? BCS_SWCTRL_SRC_Y : 0));
+}
+
 static int
 batch_flush(struct intel_info *info)
 {
 	int size, ret;
 
+	if (batch_count(info))
+		batch_emit_flush(info);
 	batch_dword(info, MI_BATCH_BUFFER_END);
 	size = batch_count(info);
 	if (size & 1) {
@@ -158,9 +229,13 @@ batch_flush(struct intel_info *info)
 		goto fail;
 	}
 
+	/* the bo is reused, and the relocs would pile up otherwise */
+	drm_intel_gem_bo_clear_relocs(info->batch_ibo, 0);
+
 	return batch_next(info);
 
 fail:
+	drm_intel_gem_bo_clear_relocs(info->batch_ibo, 0);
 	info->cur = info->batch;
 
 	return ret;
@@ -180,10 +255,15 @@ batch_reserve(struct intel_info *info, int count)
 static void
 batch_destroy(struct intel_info *info)
 {
-	if (info->batch_ibo) {
-		drm_intel_bo_unreference(info->batch_ibo);
-		info->batch_ibo = NULL;
+	int i;
+
+	for (i = 0; i < BATCH_RING_SIZE; i++) {
+		if (info->batch_ring[i]) {
+			drm_intel_bo_unreference(info->batch_ring[i]);
+			info->batch_ring[i] = NULL;
+		}
 	}
+	info->batch_ibo = NULL;
 
 	if (info->batch) {
 		free(info->batch);
@@ -212,53 +292,6 @@ batch_init(struct intel_info *info)
 	return ret;
 }
 
-static void intel_resolve_format(struct gralloc_drm_drv_t *drv,
-		struct gralloc_drm_bo_t *bo,
-		uint32_t *pitches, uint32_t *offsets, uint32_t *handles)
-{
-	/*
-	 * TODO - should take account hw specific padding, alignment
-	 * for camera, video decoder etc.
-	 */
-
-	struct intel_buffer *ib = (struct intel_buffer *) bo;
-
-	memset(pitches, 0, 4 * sizeof(uint32_t));
-	memset(offsets, 0, 4 * sizeof(uint32_t));
-	memset(handles, 0, 4 * sizeof(uint32_t));
-
-	pitches[0] = ib->base.handle->stride;
-	handles[0] = ib->base.fb_handle;
-
-	switch(ib->base.handle->format) {
-		case HAL_PIXEL_FORMAT_YV12:
-
-			// U and V stride are half of Y plane
-			pitches[2] = pitches[0]/2;
-			pitches[1] = pitches[0]/2;
-
-			// like I420 but U and V are in reverse order
-			offsets[2] = offsets[0] +
-				pitches[0] * ib->base.handle->height;
-			offsets[1] = offsets[2] +
-				pitches[2] * ib->base.handle->height/2;
-
-			handles[1] = handles[2] = handles[0];
-			break;
-
-		case HAL_PIXEL_FORMAT_DRM_NV12:
-
-			// U and V are interleaved in 2nd plane
-			pitches[1] = pitches[0];
-			offsets[1] = offsets[0] +
-				pitches[0] * ib->base.handle->height;
-
-			handles[1] = handles[0];
-			break;
-	}
-}
-
-
 static void intel_blit(struct gralloc_drm_drv_t *drv,
 		struct gralloc_drm_bo_t *dst,
 		struct gralloc_drm_bo_t *src,
@@ -342,21 +375,36 @@ static void intel_blit(struct gralloc_drm_drv_t *drv,
 
 	if (info->gen >= 40) {
 		if (dst_ib->tiling != I915_TILING_NONE) {
-			assert(dst_pitch % 512 == 0);
+			assert(dst_pitch % ((dst_ib->tiling == I915_TILING_Y) ?
+						128 : 512) == 0);
 			dst_pitch >>= 2;
 			cmd |= XY_SRC_COPY_BLT_DST_TILED;
 		}
 		if (src_ib->tiling != I915_TILING_NONE) {
-			assert(src_pitch % 512 == 0);
+			assert(src_pitch % ((src_ib->tiling == I915_TILING_Y) ?
+						128 : 512) == 0);
 			src_pitch >>= 2;
 			cmd |= XY_SRC_COPY_BLT_SRC_TILED;
 		}
 	}
 
+	/* Y tiling is selected by BCS_SWCTRL, restored after the blit */
+	int tiling_y = (dst_ib->tiling == I915_TILING_Y ||
+			src_ib->tiling == I915_TILING_Y);
+	if (tiling_y && info->gen < 60) {
+		ALOGE("%s, Y tiling is not supported", __func__);
+		return;
+	}
+
 	unsigned length = (info->gen >= 80) ? 10 : 8;
-	if (batch_reserve(info, length))
+	if (batch_reserve(info, length +
+				(tiling_y ? 2 * BATCH_BLT_TILING_SIZE : 0)))
 		return;
 
+	if (tiling_y)
+		batch_set_blt_tiling(info, dst_ib->tiling == I915_TILING_Y,
+				src_ib->tiling == I915_TILING_Y);
+
 	ALOGD_IF(DEBUG_BLT, "running batch commands, gen=%d tiling: [%d, %d]. dst=[%d, %d, %d, %d], "
 			"src=[%d, %d, %d, %d], pitch=[%d, %d]",
 			info->gen, dst_ib->tiling, src_ib->tiling,
@@ -381,26 +429,111 @@ static void intel_blit(struct gralloc_drm_drv_t *drv,
 		batch_reloc(info, src, I915_GEM_DOMAIN_RENDER, 0);
 	}
 
-	if (info->gen >= 60) {
-		batch_reserve(info, 4);
-		batch_dword(info, MI_FLUSH_DW | 2);
-		batch_dword(info, 0);
-		batch_dword(info, 0);
-		batch_dword(info, 0);
+	if (tiling_y)
+		batch_set_blt_tiling(info, 0, 0);
+}
+
+/*
+ * Zero a bo with XY_COLOR_BLT, including the padding of its rows.
+ */
+static int intel_clear(struct gralloc_drm_drv_t *drv,
+		struct gralloc_drm_bo_t *bo)
+{
+	struct intel_info *info = (struct intel_info *) drv;
+	struct intel_buffer *ib = (struct intel_buffer *) bo;
+	drm_intel_bo *bo_table[2];
+	uint32_t cmd, br13, pitch;
+	int width, height, cpp;
+	unsigned length;
+
+	if (!info->batch)
+		return -ENODEV;
+
+	cpp = gralloc_drm_get_bpp(bo->handle->format);
+	pitch = bo->handle->stride;
+	if (!cpp || pitch % 4 != 0)
+		return -EINVAL;
+
+	width = pitch / cpp;
+	height = bo->handle->height;
+	gralloc_drm_align_geometry(bo->handle->format, &width, &height);
+	if (width > 0x7fff || height > 0x7fff)
+		return -EINVAL;
+
+	cmd = XY_COLOR_BLT_CMD;
+	br13 = 0xf0 << 16; /* ROP_P/GXcopy */
+
+	switch (cpp) {
+	case 1:
+		break;
+	case 2:
+		br13 |= (1 << 24);
+		break;
+	case 4:
+		br13 |= (1 << 24) | (1 << 25);
+		cmd |= XY_COLOR_BLT_WRITE_ALPHA | XY_COLOR_BLT_WRITE_RGB;
+		break;
+	default:
+		return -EINVAL;
 	}
-	else {
-		int flags = (info->gen >= 40) ? 0 :
-			MI_WRITE_DIRTY_STATE | MI_INVALIDATE_MAP_CACHE;
 
-		batch_reserve(info, 1);
-		batch_dword(info, MI_FLUSH | flags);
+	if (info->gen >= 40 && ib->tiling != I915_TILING_NONE) {
+		pitch >>= 2;
+		cmd |= XY_COLOR_BLT_TILED;
 	}
 
-	batch_flush(info);
+	if (ib->tiling == I915_TILING_Y && info->gen < 60)
+		return -EINVAL;
+
+	bo_table[0] = info->batch_ibo;
+	bo_table[1] = ib->ibo;
+	if (drm_intel_bufmgr_check_aperture_space(bo_table, 2)) {
+		if (batch_flush(info))
+			return -ENOMEM;
+	}
+
+	length = (info->gen >= 80) ? 7 : 6;
+	if (batch_reserve(info, length + ((ib->tiling == I915_TILING_Y) ?
+					2 * BATCH_BLT_TILING_SIZE : 0)))
+		return -ENOMEM;
+
+	if (ib->tiling == I915_TILING_Y)
+		batch_set_blt_tiling(info, 1, 0);
+
+	batch_dword(info, cmd | (length - 2));
+	batch_dword(info, br13 | (uint16_t) pitch);
+	batch_dword(info, 0);
+	batch_dword(info, (height << 16) | width);
+	if (info->gen >= 80)
+		batch_reloc64(info, bo, I915_GEM_DOMAIN_RENDER, I915_GEM_DOMAIN_RENDER);
+	else
+		batch_reloc(info, bo, I915_GEM_DOMAIN_RENDER, I915_GEM_DOMAIN_RENDER);
+	batch_dword(info, 0);
+
+	if (ib->tiling == I915_TILING_Y)
+		batch_set_blt_tiling(info, 0, 0);
+
+	/* the bo may be shared right away */
+	return batch_flush(info);
+}
+
+/*
+ * Submit the queued blits with a single execbuffer.
+ */
+static void intel_flush(struct gralloc_drm_drv_t *drv)
+{
+	struct intel_info *info = (struct intel_info *) drv;
+
+	if (info->batch && batch_count(info))
+		batch_flush(info);
 }
 
+/*
+ * Allocate an ibo.  The tiling is chosen from the layout policy, or from the
+ * usage, when want_tiling is negative.
+ */
 static drm_intel_bo *alloc_ibo(struct intel_info *info,
-		const struct gralloc_drm_handle_t *handle,
+		const struct gralloc_drm_handle_t *handle, int want_tiling,
 		uint32_t *tiling, unsigned long *stride)
 {
 	drm_intel_bo *ibo;
@@ -420,6 +553,11 @@ static drm_intel_bo *alloc_ibo(struct intel_info *info,
 	gralloc_drm_align_geometry(handle->format,
 			&aligned_width, &aligned_height);
 
+	if (want_tiling < 0 && handle->layout == GRALLOC_DRM_LAYOUT_LINEAR)
+		want_tiling = I915_TILING_NONE;
+	else if (want_tiling < 0 && handle->layout == GRALLOC_DRM_LAYOUT_TILED)
+		want_tiling = I915_TILING_X;
+
 	if (handle->usage & GRALLOC_USAGE_HW_FB) {
 		unsigned long max_stride;
 
@@ -433,7 +571,7 @@ static drm_intel_bo *alloc_ibo(struct intel_info *info,
 		aligned_width = ALIGN(aligned_width, 64);
 		flags = BO_ALLOC_FOR_RENDER;
 
-		*tiling = I915_TILING_X;
+		*tiling = (want_tiling >= 0) ? want_tiling : I915_TILING_X;
 		*stride = aligned_width * bpp;
 		if (*stride > max_stride) {
 			*tiling = I915_TILING_NONE;
@@ -465,7 +603,9 @@ static drm_intel_bo *alloc_ibo(struct intel_info *info,
 		}
 	}
 	else {
-		if (handle->usage & (GRALLOC_USAGE_SW_READ_OFTEN |
+		if (want_tiling >= 0)
+			*tiling = want_tiling;
+		else if (handle->usage & (GRALLOC_USAGE_SW_READ_OFTEN |
 				     GRALLOC_USAGE_SW_WRITE_OFTEN))
 			*tiling = I915_TILING_NONE;
 		else if ((handle->usage & GRALLOC_USAGE_HW_RENDER) ||
@@ -496,8 +636,20 @@ static drm_intel_bo *alloc_ibo(struct intel_info *info,
 	return ibo;
 }
 
-static struct gralloc_drm_bo_t *intel_alloc(struct gralloc_drm_drv_t *drv,
-		struct gralloc_drm_handle_t *handle)
+static uint64_t intel_tiling_modifier(uint32_t tiling)
+{
+	switch (tiling) {
+	case I915_TILING_X:
+		return I915_FORMAT_MOD_X_TILED;
+	case I915_TILING_Y:
+		return I915_FORMAT_MOD_Y_TILED;
+	default:
+		return DRM_FORMAT_MOD_LINEAR;
+	}
+}
+
+static struct gralloc_drm_bo_t *intel_alloc_tiled(struct gralloc_drm_drv_t *drv,
+		struct gralloc_drm_handle_t *handle, int want_tiling)
 {
 	struct intel_info *info = (struct intel_info *) drv;
 	struct intel_buffer *ib;
@@ -506,14 +658,19 @@ static struct gralloc_drm_bo_t *intel_alloc(struct gralloc_drm_drv_t *drv,
 	if (!ib)
 		return NULL;
 
-	if (handle->name) {
+	if (handle->prime_fd >= 0 || handle->name) {
 		uint32_t dummy;
 
-		ib->ibo = drm_intel_bo_gem_create_from_name(info->bufmgr,
-				"gralloc-r", handle->name);
+		if (handle->prime_fd >= 0)
+			ib->ibo = drm_intel_bo_gem_create_from_prime(info->bufmgr,
+					handle->prime_fd,
+					gralloc_drm_handle_size(handle));
+		else
+			ib->ibo = drm_intel_bo_gem_create_from_name(info->bufmgr,
+					"gralloc-r", handle->name);
 		if (!ib->ibo) {
-			ALOGE("failed to create ibo from name %u",
-					handle->name);
+			ALOGE("failed to import ibo (fd %d, name %u)",
+					handle->prime_fd, handle->name);
 			free(ib);
 			return NULL;
 		}
@@ -528,7 +685,8 @@ static struct gralloc_drm_bo_t *intel_alloc(struct gralloc_drm_drv_t *drv,
 	else {
 		unsigned long stride;
 
-		ib->ibo = alloc_ibo(info, handle, &ib->tiling, &stride);
+		ib->ibo = alloc_ibo(info, handle, want_tiling,
+				&ib->tiling, &stride);
 		if (!ib->ibo) {
 			ALOGE("failed to allocate ibo %dx%d (format %d)",
 					handle->width,
@@ -539,8 +697,10 @@ static struct gralloc_drm_bo_t *intel_alloc(struct gralloc_drm_drv_t *drv,
 		}
 
 		handle->stride = stride;
+		handle->modifier = intel_tiling_modifier(ib->tiling);
 
-		if (drm_intel_bo_flink(ib->ibo, (uint32_t *) &handle->name)) {
+		if (!drv->render_node &&
+		    drm_intel_bo_flink(ib->ibo, (uint32_t *) &handle->name)) {
 			ALOGE("failed to flink ibo");
 			drm_intel_bo_unreference(ib->ibo);
 			free(ib);
@@ -555,6 +715,44 @@ static struct gralloc_drm_bo_t *intel_alloc(struct gralloc_drm_drv_t *drv,
 	return &ib->base;
 }
 
+static struct gralloc_drm_bo_t *intel_alloc(struct gralloc_drm_drv_t *drv,
+		struct gralloc_drm_handle_t *handle)
+{
+	return intel_alloc_tiled(drv, handle, -1);
+}
+
+/*
+ * Take Y tiling where the display engine scans it out (gen9+), then X tiling,
+ * then linear.  The render compressed layouts are not used, as their aux
+ * surfaces are maintained by the GL driver rather than by us.
+ */
+static struct gralloc_drm_bo_t *intel_alloc_with_modifiers(
+		struct gralloc_drm_drv_t *drv,
+		struct gralloc_drm_handle_t *handle,
+		const uint64_t *modifiers, int count)
+{
+	struct intel_info *info = (struct intel_info *) drv;
+	int has_y = 0, has_x = 0, has_linear = 0, want_tiling = -1, i;
+
+	for (i = 0; i < count; i++) {
+		if (modifiers[i] == I915_FORMAT_MOD_Y_TILED)
+			has_y = 1;
+		else if (modifiers[i] == I915_FORMAT_MOD_X_TILED)
+			has_x = 1;
+		else if (modifiers[i] == DRM_FORMAT_MOD_LINEAR)
+			has_linear = 1;
+	}
+
+	if (has_y && info->gen >= 90)
+		want_tiling = I915_TILING_Y;
+	else if (has_x)
+		want_tiling = I915_TILING_X;
+	else if (has_linear)
+		want_tiling = I915_TILING_NONE;
+
+	return intel_alloc_tiled(drv, handle, want_tiling);
+}
+
 static void intel_free(struct gralloc_drm_drv_t *drv,
 		struct gralloc_drm_bo_t *bo)
 {
@@ -564,6 +762,19 @@ static void intel_free(struct gralloc_drm_drv_t *drv,
 	free(ib);
 }
 
+/*
+ * Tiled bos are mapped through the GTT for detiling, and so are fbs unless
+ * they are mostly read by CPU.  Others are mapped cached, where the SET_DOMAIN
+ * of drm_intel_bo_map invalidates and the SW_FINISH of drm_intel_bo_unmap
+ * flushes the CPU caches.
+ */
+static int intel_map_gtt(const struct intel_buffer *ib)
+{
+	return (ib->tiling != I915_TILING_NONE ||
+		((ib->base.handle->usage & GRALLOC_USAGE_HW_FB) &&
+		 !gralloc_drm_usage_cpu_cached(ib->base.handle->usage)));
+}
+
 static int intel_map(struct gralloc_drm_drv_t *drv,
 		struct gralloc_drm_bo_t *bo,
 		int x, int y, int w, int h,
@@ -572,8 +783,7 @@ static int intel_map(struct gralloc_drm_drv_t *drv,
 	struct intel_buffer *ib = (struct intel_buffer *) bo;
 	int err;
 
-	if (ib->tiling != I915_TILING_NONE ||
-	    (ib->base.handle->usage & GRALLOC_USAGE_HW_FB))
+	if (intel_map_gtt(ib))
 		err = drm_intel_gem_bo_map_gtt(ib->ibo);
 	else
 		err = drm_intel_bo_map(ib->ibo, enable_write);
@@ -588,8 +798,7 @@ static void intel_unmap(struct gralloc_drm_drv_t *drv,
 {
 	struct intel_buffer *ib = (struct intel_buffer *) bo;
 
-	if (ib->tiling != I915_TILING_NONE ||
-	    (ib->base.handle->usage & GRALLOC_USAGE_HW_FB))
+	if (intel_map_gtt(ib))
 		drm_intel_gem_bo_unmap_gtt(ib->ibo);
 	else
 		drm_intel_bo_unmap(ib->ibo);
@@ -710,11 +919,13 @@ struct gralloc_drm_drv_t *gralloc_drm_drv_create_for_intel(int fd)
 	info->base.destroy = intel_destroy;
 	info->base.init_kms_features = intel_init_kms_features;
 	info->base.alloc = intel_alloc;
+	info->base.alloc_with_modifiers = intel_alloc_with_modifiers;
 	info->base.free = intel_free;
 	info->base.map = intel_map;
 	info->base.unmap = intel_unmap;
 	info->base.blit = intel_blit;
-	info->base.resolve_format = intel_resolve_format;
+	info->base.flush = intel_flush;
+	info->base.clear = intel_clear;
 
 	return &info->base;
 }
@@ -32,12 +32,17 @@
 #include <stdio.h>
 #include <poll.h>
 #include <math.h>
+#include <time.h>
+#include <sys/mman.h>
 #include "gralloc_drm.h"
 #include "gralloc_drm_priv.h"
 #include <hardware_legacy/uevent.h>
 
 #include <drm_fourcc.h>
 
+/* milliseconds to wait for an acquire fence before posting anyway */
+#define DRM_FENCE_TIMEOUT 3000
+
 struct uevent {
 	const char *action;
 	const char *path;
@@ -47,6 +52,7 @@ struct uevent {
 	int minor;
 	int hotplug;
 	int switchstate;
+	uint32_t connector_id; /* 0 when the event does not name one */
 };
 
 static void parse_event(const char *msg, struct uevent *uevent)
@@ -59,6 +65,7 @@ static void parse_event(const char *msg, struct uevent *uevent)
 	uevent->device_name = "";
 	uevent->hotplug = 0;
 	uevent->switchstate = -1;
+	uevent->connector_id = 0;
 
 	while (*msg) {
 		if (!strncmp(msg, "ACTION=", 7)) {
@@ -85,6 +92,9 @@ static void parse_event(const char *msg, struct uevent *uevent)
 		} else if (!strncmp(msg, "SWITCH_STATE=", 13)) {
 			msg += 13;
 			uevent->switchstate = atoi(msg);
+		} else if (!strncmp(msg, "CONNECTOR=", 10)) {
+			msg += 10;
+			uevent->connector_id = strtoul(msg, NULL, 10);
 		}
 
 		/* advance to after the next \0 */
@@ -93,6 +103,102 @@ static void parse_event(const char *msg, struct uevent *uevent)
 	}
 }
 
+/*
+ * Return the CLOCK_MONOTONIC time in microseconds.
+ */
+static uint64_t drm_kms_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/*
+ * Return the CLOCK_MONOTONIC time in microseconds, or 0 when statistics
+ * are disabled so that the post path does not pay for clock_gettime.
+ */
+static uint64_t drm_kms_stats_now(const struct gralloc_drm_t *drm)
+{
+	if (!drm->stats_enabled)
+		return 0;
+
+	return drm_kms_now();
+}
+
+/*
+ * Add a counter.  The post path is the only writer, and readers may run
+ * concurrently.
+ */
+static void drm_kms_stats_add(const struct gralloc_drm_t *drm,
+		uint64_t *counter, uint64_t val)
+{
+	if (drm->stats_enabled)
+		__atomic_fetch_add(counter, val, __ATOMIC_RELAXED);
+}
+
+/*
+ * Add a sample to a histogram.
+ */
+static void drm_kms_stats_sample(const struct gralloc_drm_t *drm,
+		struct gralloc_drm_histogram *hist, uint64_t us)
+{
+	int bucket = 0;
+
+	if (!drm->stats_enabled)
+		return;
+
+	while (bucket < GRALLOC_DRM_STATS_BUCKETS - 1 && (us >> (bucket + 1)))
+		bucket++;
+
+	__atomic_fetch_add(&hist->buckets[bucket], 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&hist->total_us, us, __ATOMIC_RELAXED);
+	if (us > __atomic_load_n(&hist->max_us, __ATOMIC_RELAXED))
+		__atomic_store_n(&hist->max_us, us, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&hist->count, 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Record the time elapsed since start in a histogram.
+ */
+static void drm_kms_stats_record(const struct gralloc_drm_t *drm,
+		struct gralloc_drm_histogram *hist, uint64_t start)
+{
+	uint64_t now;
+
+	if (!drm->stats_enabled || !start)
+		return;
+
+	now = drm_kms_stats_now(drm);
+	drm_kms_stats_sample(drm, hist, (now > start) ? now - start : 0);
+}
+
+static void drm_kms_stats_copy(uint64_t *dst, const uint64_t *src,
+		size_t count)
+{
+	size_t i;
+
+	for (i = 0; i < count; i++)
+		dst[i] = __atomic_load_n(&src[i], __ATOMIC_ACQUIRE);
+}
+
+/*
+ * Take a snapshot of the post path statistics.
+ */
+int gralloc_drm_get_post_stats(struct gralloc_drm_t *drm,
+		struct gralloc_drm_post_stats *stats)
+{
+	if (!drm->stats_enabled)
+		return -EINVAL;
+
+	/* the stats block is made of uint64_t only */
+	drm_kms_stats_copy((uint64_t *) stats, (const uint64_t *) &drm->stats,
+			sizeof(*stats) / sizeof(uint64_t));
+
+	return 0;
+}
+
 /*
  * Return true if a bo needs fb.
  */
@@ -118,34 +224,178 @@ static unsigned int drm_format_from_hal(int hal_format)
 		case HAL_PIXEL_FORMAT_YV12:
 			return DRM_FORMAT_YUV420;
 		case HAL_PIXEL_FORMAT_DRM_NV12:
+		case HAL_PIXEL_FORMAT_YCbCr_420_888:
 			return DRM_FORMAT_NV12;
+		case HAL_PIXEL_FORMAT_YCrCb_420_SP:
+			return DRM_FORMAT_NV21;
+		case HAL_PIXEL_FORMAT_YCbCr_422_SP:
+			return DRM_FORMAT_NV16;
+		case HAL_PIXEL_FORMAT_YCbCr_422_I:
+			return DRM_FORMAT_YUYV;
 		default:
 			return 0;
 	}
 }
 
 /*
- * Modify pitches, offsets and handles according to
- * the format and return corresponding drm format value
+ * Get the pitches, offsets and KMS handles of the planes of a bo, and return
+ * its drm format.
  */
 static int resolve_drm_format(struct gralloc_drm_bo_t *bo,
 	uint32_t *pitches, uint32_t *offsets, uint32_t *handles)
 {
-	struct gralloc_drm_t *drm = bo->drm;
+	uint32_t kms_handle;
+	int i;
 
-	pitches[0] = bo->handle->stride;
-	handles[0] = bo->fb_handle;
+	gralloc_drm_bo_get_planes(bo, pitches, offsets, handles);
 
-	/* driver takes care of HW specific padding, alignment etc. */
-	if (drm->drv->resolve_format)
-		drm->drv->resolve_format(drm->drv, bo,
-			pitches, offsets, handles);
+	/* the handles of a bo off the card node are imported */
+	kms_handle = gralloc_drm_bo_get_kms_handle(bo);
+	for (i = 0; i < 4; i++) {
+		if (handles[i])
+			handles[i] = kms_handle;
+	}
 
 	return drm_format_from_hal(bo->handle->format);
 }
 
 /*
- * Returns planes that are supported for a particular format
+ * Return true if a plane can scan out a format.
+ */
+static int drm_kms_plane_has_format(const struct gralloc_drm_plane_t *plane,
+	uint32_t format)
+{
+	uint32_t i;
+
+	for (i = 0; i < plane->drm_plane->count_formats; i++)
+		if (plane->drm_plane->formats[i] == format)
+			return 1;
+
+	return 0;
+}
+
+/*
+ * Return true if a plane can scan out a format with a modifier.  Any modifier
+ * is fine when it is implicit, and anything when the plane does not tell.
+ */
+static int drm_kms_plane_has_modifier(const struct gralloc_drm_plane_t *plane,
+	uint32_t format, uint64_t modifier)
+{
+	const struct drm_format_modifier_blob *blob;
+	const struct drm_format_modifier *mods;
+	const uint32_t *formats;
+	uint32_t i, j;
+
+	if (!plane->in_formats)
+		return 1;
+
+	blob = plane->in_formats->data;
+	formats = (const uint32_t *)
+		((const char *) blob + blob->formats_offset);
+	mods = (const struct drm_format_modifier *)
+		((const char *) blob + blob->modifiers_offset);
+
+	for (i = 0; i < blob->count_formats; i++)
+		if (formats[i] == format)
+			break;
+	if (i == blob->count_formats)
+		return 0;
+
+	if (modifier == DRM_FORMAT_MOD_INVALID)
+		return 1;
+
+	for (j = 0; j < blob->count_modifiers; j++) {
+		if (mods[j].modifier == modifier &&
+		    i >= mods[j].offset && i < mods[j].offset + 64 &&
+		    (mods[j].formats & (1ULL << (i - mods[j].offset))))
+			return 1;
+	}
+
+	return 0;
+}
+
+/*
+ * Get the modifiers of a format a plane can scan out.
+ */
+static int drm_kms_plane_get_modifiers(const struct gralloc_drm_plane_t *plane,
+	uint32_t format, uint64_t *modifiers, int max)
+{
+	const struct drm_format_modifier_blob *blob = plane->in_formats->data;
+	const struct drm_format_modifier *mods;
+	uint32_t j;
+	int count = 0;
+
+	mods = (const struct drm_format_modifier *)
+		((const char *) blob + blob->modifiers_offset);
+
+	for (j = 0; j < blob->count_modifiers && count < max; j++) {
+		if (drm_kms_plane_has_modifier(plane, format, mods[j].modifier))
+			modifiers[count++] = mods[j].modifier;
+	}
+
+	return count;
+}
+
+/*
+ * Get the modifiers a new bo may have for the planes that are to scan it
+ * out, that is, the primary plane for a framebuffer and the overlays for
+ * layers of the HWC.  The CPU gets linear bos.  Return 0 when the layout is
+ * up to the driver.
+ */
+int gralloc_drm_get_modifiers(struct gralloc_drm_t *drm, int format, int usage,
+	uint64_t *modifiers, int max)
+{
+	uint32_t drm_format = drm_format_from_hal(format);
+	struct gralloc_drm_plane_t *plane = drm->planes;
+	unsigned int i;
+	int count = -1, j, k;
+
+	if (usage & (GRALLOC_USAGE_SW_READ_MASK | GRALLOC_USAGE_SW_WRITE_MASK)) {
+		modifiers[0] = DRM_FORMAT_MOD_LINEAR;
+		return 1;
+	}
+
+	if (!plane || !drm_format || !drm->primary ||
+	    !(usage & (GRALLOC_USAGE_HW_FB | GRALLOC_USAGE_HW_COMPOSER)))
+		return 0;
+
+	/* the modifiers all the planes accept */
+	for (i = 0; i < drm->plane_resources->count_planes; i++, plane++) {
+		if (usage & GRALLOC_USAGE_HW_FB) {
+			if (plane->type != DRM_PLANE_TYPE_PRIMARY ||
+			    !(plane->drm_plane->possible_crtcs &
+			      (1 << drm->primary->pipe)))
+				continue;
+		}
+		else if (plane->type != DRM_PLANE_TYPE_OVERLAY) {
+			continue;
+		}
+
+		if (!plane->in_formats || !drm_kms_plane_has_modifier(plane,
+					drm_format, DRM_FORMAT_MOD_INVALID))
+			continue;
+
+		if (count < 0) {
+			count = drm_kms_plane_get_modifiers(plane, drm_format,
+					modifiers, max);
+			continue;
+		}
+
+		for (j = 0, k = 0; j < count; j++) {
+			if (drm_kms_plane_has_modifier(plane, drm_format,
+						modifiers[j]))
+				modifiers[k++] = modifiers[j];
+		}
+		count = k;
+	}
+
+	return (count > 0) ? count : 0;
+}
+
+/*
+ * Returns planes that are supported for a particular format, as a mask of
+ * 1 << plane_id.  The planes with ids of 32 and above are left out; the
+ * planes are matched against the formats on reservation instead.
  */
 unsigned int planes_for_format(struct gralloc_drm_t *drm,
 	int hal_format)
@@ -159,26 +409,130 @@ unsigned int planes_for_format(struct gralloc_drm_t *drm,
 		return 0;
 
 	/* iterate through planes, mark those that match format */
-	for (i=0; i<drm->plane_resources->count_planes; i++, plane++)
+	for (i=0; i<drm->plane_resources->count_planes; i++, plane++) {
+		if (plane->drm_plane->plane_id >= 32)
+			continue;
 		for (j=0; j<plane->drm_plane->count_formats; j++)
 			if (plane->drm_plane->formats[j] == drm_format)
 				mask |= (1U << plane->drm_plane->plane_id);
+	}
 
 	return mask;
 }
 
 /*
- * Add a fb object for a bo.
+ * Return true if the fb of a freed bo is no longer scanned out.  The planes
+ * release their bos when the next flip is scheduled, after the pending flip
+ * has completed, so the fb is off the screen once a flip has completed since.
+ */
+static int drm_kms_fb_idle(const struct gralloc_drm_t *drm,
+		const struct gralloc_drm_fb *fb)
+{
+	if (drm->swap_mode != DRM_SWAP_FLIP &&
+	    drm->swap_mode != DRM_SWAP_ATOMIC)
+		return 1;
+
+	return (fb->orphan_flip != drm->flip_count);
+}
+
+/*
+ * Track the fb of an imported bo, to be removed once off the screen after
+ * the bo is freed.
+ */
+static void drm_kms_fb_track(struct gralloc_drm_bo_t *bo)
+{
+	struct gralloc_drm_t *drm = bo->drm;
+	struct gralloc_drm_fb *fb;
+
+	fb = calloc(1, sizeof(*fb));
+	if (!fb)
+		return;
+
+	fb->fb_id = bo->fb_id;
+	fb->bo = bo;
+	bo->fb = fb;
+
+	pthread_mutex_lock(&drm->fb_mutex);
+	fb->next = drm->fb_head;
+	drm->fb_head = fb;
+	pthread_mutex_unlock(&drm->fb_mutex);
+}
+
+/*
+ * Remove the idle fbs of freed bos.  A freed bo is given as bo, whose fb is
+ * detached first.
+ */
+static void drm_kms_fb_reap(struct gralloc_drm_t *drm,
+		struct gralloc_drm_bo_t *bo)
+{
+	struct gralloc_drm_fb *evicted = NULL, *fb, **p;
+
+	pthread_mutex_lock(&drm->fb_mutex);
+	if (bo) {
+		bo->fb->bo = NULL;
+		bo->fb->orphan_flip = drm->flip_count;
+	}
+
+	for (p = &drm->fb_head; (fb = *p); ) {
+		if (fb->bo || !drm_kms_fb_idle(drm, fb)) {
+			p = &fb->next;
+			continue;
+		}
+
+		*p = fb->next;
+		fb->next = evicted;
+		evicted = fb;
+	}
+	pthread_mutex_unlock(&drm->fb_mutex);
+
+	/* RmFB may wait for a flip, do it unlocked */
+	while (evicted) {
+		fb = evicted;
+		evicted = fb->next;
+		drmModeRmFB(drm->fd, fb->fb_id);
+		free(fb);
+	}
+}
+
+/*
+ * Remove all fbs without a bo.  The fbs of the bos alive are no longer
+ * tracked and are removed with the bos.
+ */
+static void drm_kms_fb_fini(struct gralloc_drm_t *drm)
+{
+	struct gralloc_drm_fb *fb;
+
+	while ((fb = drm->fb_head)) {
+		drm->fb_head = fb->next;
+		if (fb->bo)
+			fb->bo->fb = NULL;
+		else
+			drmModeRmFB(drm->fd, fb->fb_id);
+		free(fb);
+	}
+
+	pthread_mutex_destroy(&drm->fb_mutex);
+}
+
+/*
+ * Add a fb object for a bo.  The fbs of bos imported by PRIME are shared
+ * with the bos in the import cache, and outlive them until off the screen.
  */
 int gralloc_drm_bo_add_fb(struct gralloc_drm_bo_t *bo)
 {
+	struct gralloc_drm_t *drm = bo->drm;
 	uint32_t pitches[4] = { 0, 0, 0, 0 };
 	uint32_t offsets[4] = { 0, 0, 0, 0 };
 	uint32_t handles[4] = { 0, 0, 0, 0 };
+	int ret, i;
 
 	if (bo->fb_id)
 		return 0;
 
+	/* a bo off the card node is scanned out in place when the display can */
+	if (!gralloc_drm_bo_get_kms_handle(bo))
+		return -EINVAL;
+
 	int drm_format = resolve_drm_format(bo, pitches, offsets, handles);
 
 	if (drm_format == 0) {
@@ -186,10 +540,29 @@ int gralloc_drm_bo_add_fb(struct gralloc_drm_bo_t *bo)
 		return -EINVAL;
 	}
 
-	return drmModeAddFB2(bo->drm->fd,
-		bo->handle->width, bo->handle->height,
-		drm_format, handles, pitches, offsets,
-		(uint32_t *) &bo->fb_id, 0);
+	if (bo->handle->modifier != DRM_FORMAT_MOD_INVALID && drm->fb_modifiers) {
+		uint64_t modifiers[4] = { 0, 0, 0, 0 };
+
+		for (i = 0; i < 4; i++) {
+			if (handles[i])
+				modifiers[i] = bo->handle->modifier;
+		}
+
+		ret = drmModeAddFB2WithModifiers(drm->fd,
+			bo->handle->width, bo->handle->height,
+			drm_format, handles, pitches, offsets, modifiers,
+			(uint32_t *) &bo->fb_id, DRM_MODE_FB_MODIFIERS);
+	}
+	else {
+		ret = drmModeAddFB2(drm->fd,
+			bo->handle->width, bo->handle->height,
+			drm_format, handles, pitches, offsets,
+			(uint32_t *) &bo->fb_id, 0);
+	}
+	if (!ret && bo->import_linked)
+		drm_kms_fb_track(bo);
+
+	return ret;
 }
 
 /*
@@ -197,7 +570,12 @@ int gralloc_drm_bo_add_fb(struct gralloc_drm_bo_t *bo)
  */
 void gralloc_drm_bo_rm_fb(struct gralloc_drm_bo_t *bo)
 {
-	if (bo->fb_id) {
+	if (bo->fb) {
+		drm_kms_fb_reap(bo->drm, bo);
+		bo->fb = NULL;
+		bo->fb_id = 0;
+	}
+	else if (bo->fb_id) {
 		drmModeRmFB(bo->drm->fd, bo->fb_id);
 		bo->fb_id = 0;
 	}
@@ -209,10 +587,12 @@ void gralloc_drm_bo_rm_fb(struct gralloc_drm_bo_t *bo)
 static int drm_kms_set_crtc(struct gralloc_drm_t *drm,
 	struct gralloc_drm_output *output, int fb_id)
 {
+	uint64_t start = drm_kms_stats_now(drm);
 	int ret;
 
 	ret = drmModeSetCrtc(drm->fd, output->crtc_id, fb_id,
 			0, 0, &output->connector_id, 1, &output->mode);
+	drm_kms_stats_record(drm, &drm->stats.set_crtc, start);
 	if (ret) {
 		ALOGE("failed to set crtc (%s) (crtc_id %d, fb_id %d, conn %d, mode %dx%d)",
 			strerror(errno), output->crtc_id, fb_id, output->connector_id,
@@ -227,450 +607,2909 @@ static int drm_kms_set_crtc(struct gralloc_drm_t *drm,
 }
 
 /*
- * Callback for a page flip event.
+ * Ack the flip of an extended output.  event_mutex must be held.  Return
+ * the bo that left the screen, to be unreferenced without the mutex.
  */
-static void page_flip_handler(int fd, unsigned int sequence,
-		unsigned int tv_sec, unsigned int tv_usec,
-		void *user_data)
+static struct gralloc_drm_bo_t *drm_kms_ack_output_flip(
+		struct gralloc_drm_output *output, unsigned int sequence)
 {
-	struct gralloc_drm_t *drm = (struct gralloc_drm_t *) user_data;
+	struct gralloc_drm_bo_t *prev = output->current_front;
 
-	/* ack the last scheduled flip */
-	drm->current_front = drm->next_front;
-	drm->next_front = NULL;
+	output->current_front = output->next_front;
+	output->next_front = NULL;
+	output->last_swap = sequence;
+
+	return prev;
 }
 
 /*
- * Set a plane.
+ * Make a bo the current front of the primary.  event_mutex must be held.
+ * The front is referenced, so that the capture thread may reference it in
+ * turn under the mutex.  Return the reference of the previous front, to be
+ * dropped without the mutex.
  */
-static int gralloc_drm_bo_setplane(struct gralloc_drm_t *drm,
-	struct gralloc_drm_plane_t *plane)
+static struct gralloc_drm_bo_t *drm_kms_set_front(struct gralloc_drm_t *drm,
+		struct gralloc_drm_bo_t *bo)
 {
-	struct gralloc_drm_bo_t *bo = NULL;
-	int err;
+	struct gralloc_drm_bo_t *prev = drm->front_ref;
 
-	if (plane->handle)
-		bo = gralloc_drm_bo_from_handle(plane->handle);
+	if (bo)
+		gralloc_drm_bo_incref(bo);
+	drm->current_front = bo;
+	drm->front_ref = bo;
 
-	// create a framebuffer if does not exist
-	if (bo && bo->fb_id == 0) {
-		err = gralloc_drm_bo_add_fb(bo);
-		if (err) {
-			ALOGE("%s: could not create drm fb, (%s)",
-				__func__, strerror(-err));
-			return err;
-		}
+	return prev;
+}
+
+/*
+ * Callback for a page flip event.  The flips are committed with their
+ * output as the user data, which tells the events of the extended outputs
+ * from those of the primary commits.  The kernels without
+ * DRM_CAP_CRTC_IN_VBLANK_EVENT send crtc_id 0, and the events of an atomic
+ * commit are then counted instead.
+ */
+static void page_flip_handler(int fd, unsigned int sequence,
+		unsigned int tv_sec, unsigned int tv_usec,
+		unsigned int crtc_id, void *user_data)
+{
+	struct gralloc_drm_output *output =
+		(struct gralloc_drm_output *) user_data;
+	struct gralloc_drm_t *drm = output->drm;
+	struct gralloc_drm_bo_t *front, *prev;
+	unsigned int pipe;
+	uint64_t flip;
+
+	pthread_mutex_lock(&drm->event_mutex);
+	if (output != drm->primary && output->next_front) {
+		prev = drm_kms_ack_output_flip(output, sequence);
+		pthread_mutex_unlock(&drm->event_mutex);
+		if (prev)
+			gralloc_drm_bo_decref(prev);
+		return;
 	}
 
-	err = drmModeSetPlane(drm->fd,
-		plane->drm_plane->plane_id,
-		drm->primary->crtc_id,
-		bo ? bo->fb_id : 0,
-		0, // flags
-		plane->dst_x,
-		plane->dst_y,
-		plane->dst_w,
-		plane->dst_h,
-		plane->src_x << 16,
-		plane->src_y << 16,
-		plane->src_w << 16,
-		plane->src_h << 16);
+	if (drm->crtc_in_event && crtc_id) {
+		for (pipe = 0; pipe < (unsigned int) drm->resources->count_crtcs; pipe++)
+			if (drm->resources->crtcs[pipe] == crtc_id)
+				break;
 
-	if (err) {
-		/* clear plane_mask so that this buffer won't be tried again */
-		struct gralloc_drm_handle_t *drm_handle =
-			(struct gralloc_drm_handle_t *) plane->handle;
-		drm_handle->plane_mask = 0;
+		/* a late event of an output that has since been released */
+		if (pipe >= 32 || !(drm->flip_pipes & (1U << pipe))) {
+			pthread_mutex_unlock(&drm->event_mutex);
+			return;
+		}
+		drm->flip_pipes &= ~(1U << pipe);
+	}
+	else {
+		/* any pipe of the commit */
+		drm->flip_pipes &= drm->flip_pipes - 1;
+	}
 
-		ALOGE("drmModeSetPlane : error (%s) (plane %d crtc %d fb %d)",
-			strerror(-err),
-			plane->drm_plane->plane_id,
-			drm->primary->crtc_id,
-			bo ? bo->fb_id : 0);
+	/* an atomic commit sends one event for each crtc in it */
+	if (drm->flip_pipes || !drm->next_front) {
+		pthread_mutex_unlock(&drm->event_mutex);
+		return;
 	}
 
-	if (plane->prev)
-		gralloc_drm_bo_decref(plane->prev);
+	/* the timestamp of the event is in CLOCK_MONOTONIC */
+	flip = (uint64_t) tv_sec * 1000000 + tv_usec;
+	if (!flip)
+		flip = drm_kms_now();
+
+	/* the phase of the vblanks, to schedule the presents with */
+	drm->vblank_us = flip;
+	drm->vblank_seq = sequence;
+	drm->last_swap = sequence;
+
+	front = drm->next_front;
+
+	if (drm->stats_enabled) {
+		if (drm->stats_flip_us && flip > drm->stats_flip_us)
+			drm_kms_stats_sample(drm, &drm->stats.post_to_flip,
+					flip - drm->stats_flip_us);
+		drm_kms_stats_add(drm, &drm->stats.flips, 1);
+		__atomic_store_n(&drm->stats.last_flip_sequence, sequence,
+				__ATOMIC_RELAXED);
+		__atomic_store_n(&drm->stats.last_flip_us, flip,
+				__ATOMIC_RELAXED);
+	}
 
-	if (bo)
-		bo->refcount++;
+	/* ack the last scheduled flip */
+	prev = drm_kms_set_front(drm, drm->next_front);
+	drm->next_front = NULL;
+	drm->flip_count++;
+	pthread_mutex_unlock(&drm->event_mutex);
 
-	plane->prev = bo;
+	if (prev)
+		gralloc_drm_bo_decref(prev);
 
-	return err;
+	/* without the mutex, as the callback may post */
+	if (drm->present)
+		drm->present(drm->present_data,
+				gralloc_drm_bo_get_handle(front, NULL),
+				flip, sequence);
 }
 
 /*
- * Returns if a particular plane is supported with the implementation
+ * Set the primary as waiting for the flip events of the pipes before a
+ * commit, so that an event read by another thread is not taken for a late
+ * one, or unset it when the commit failed.
  */
-static unsigned is_plane_supported(const struct gralloc_drm_t *drm,
-	const struct gralloc_drm_plane_t *plane)
+static void drm_kms_arm_flip(struct gralloc_drm_t *drm,
+		struct gralloc_drm_bo_t *bo, unsigned int pipes)
 {
-	/* Planes are only supported on primary pipe for now */
-	return plane->drm_plane->possible_crtcs & (1 << drm->primary->pipe);
+	pthread_mutex_lock(&drm->event_mutex);
+	drm->flip_pipes = pipes;
+	drm->next_front = bo;
+	pthread_mutex_unlock(&drm->event_mutex);
 }
 
 /*
- * Sets all the active planes to be displayed.
+ * The properties of a KMS object, fetched once so that looking several of
+ * them up by name does not query the kernel again.
  */
-static void gralloc_drm_set_planes(struct gralloc_drm_t *drm)
+struct drm_kms_obj_props {
+	drmModeObjectPropertiesPtr props;
+	drmModePropertyPtr *info;
+};
+
+static int drm_kms_get_obj_props(struct gralloc_drm_t *drm,
+	uint32_t obj_id, uint32_t obj_type, struct drm_kms_obj_props *obj)
 {
-	struct gralloc_drm_plane_t *plane = drm->planes;
-	unsigned int i;
-	for (i = 0; i < drm->plane_resources->count_planes;
-		i++, plane++) {
-		/* plane is not in use at all */
-		if (!plane->active && !plane->handle)
-			continue;
+	uint32_t i;
 
-		/* plane is active, safety check if it is supported */
-		if (!is_plane_supported(drm, plane))
-			ALOGE("%s: plane %d is not supported",
-				 __func__, plane->drm_plane->plane_id);
+	obj->props = drmModeObjectGetProperties(drm->fd, obj_id, obj_type);
+	if (!obj->props)
+		return -EINVAL;
 
-		/*
-		 * Disable overlay if it is not active
-		 * or if there is error during setplane
-		 */
-		if (!plane->active)
-			plane->handle = 0;
+	obj->info = calloc(obj->props->count_props, sizeof(*obj->info));
+	if (!obj->info) {
+		drmModeFreeObjectProperties(obj->props);
+		obj->props = NULL;
+		return -ENOMEM;
+	}
 
-		if (gralloc_drm_bo_setplane(drm, plane))
-			plane->active = 0;
+	for (i = 0; i < obj->props->count_props; i++)
+		obj->info[i] = drmModeGetProperty(drm->fd,
+				obj->props->props[i]);
+
+	return 0;
+}
+
+static void drm_kms_free_obj_props(struct drm_kms_obj_props *obj)
+{
+	uint32_t i;
+
+	for (i = 0; i < obj->props->count_props; i++) {
+		if (obj->info[i])
+			drmModeFreeProperty(obj->info[i]);
 	}
+	free(obj->info);
+	drmModeFreeObjectProperties(obj->props);
 }
 
 /*
- * Interface for HWC, used to reserve a plane for a layer.
+ * Find a property of a KMS object by name.  Return the property, and the
+ * current value in value when it is not NULL.
  */
-int gralloc_drm_reserve_plane(struct gralloc_drm_t *drm,
-	buffer_handle_t handle,
-	uint32_t id,
-	uint32_t dst_x,
-	uint32_t dst_y,
-	uint32_t dst_w,
-	uint32_t dst_h,
-	uint32_t src_x,
-	uint32_t src_y,
-	uint32_t src_w,
-	uint32_t src_h)
+static drmModePropertyPtr drm_kms_find_obj_prop(
+	const struct drm_kms_obj_props *obj, const char *name, uint64_t *value)
 {
-	int j;
-	struct gralloc_drm_handle_t *drm_handle =
-		gralloc_drm_handle(handle);
-	int plane_count = drm->plane_resources->count_planes;
-	struct gralloc_drm_plane_t *plane = drm->planes;
+	uint32_t i;
 
-	/* no supported planes for this handle */
-	if (!drm_handle->plane_mask) {
-		ALOGE("%s: buffer %p cannot be shown on a plane\n",
-			__func__, drm_handle);
-		return -EINVAL;
+	for (i = 0; i < obj->props->count_props; i++) {
+		if (obj->info[i] && !strcmp(obj->info[i]->name, name)) {
+			if (value)
+				*value = obj->props->prop_values[i];
+			return obj->info[i];
+		}
 	}
 
-	for (j = 0; j < plane_count; j++, plane++) {
-
+	return NULL;
+}
+
+static uint32_t drm_kms_find_obj_prop_id(const struct drm_kms_obj_props *obj,
+	const char *name, uint64_t *value)
+{
+	drmModePropertyPtr prop = drm_kms_find_obj_prop(obj, name, value);
+
+	return (prop) ? prop->prop_id : 0;
+}
+
+/*
+ * Look up a property of a KMS object by name.  Return the property id, and
+ * the current value in value when it is not NULL.
+ */
+static uint32_t drm_kms_get_prop(struct gralloc_drm_t *drm,
+	uint32_t obj_id, uint32_t obj_type, const char *name, uint64_t *value)
+{
+	struct drm_kms_obj_props obj;
+	uint32_t prop_id;
+
+	if (drm_kms_get_obj_props(drm, obj_id, obj_type, &obj))
+		return 0;
+
+	prop_id = drm_kms_find_obj_prop_id(&obj, name, value);
+	drm_kms_free_obj_props(&obj);
+
+	return prop_id;
+}
+
+/*
+ * Query the type and the property ids of a plane for atomic commits.
+ */
+static int drm_kms_init_plane_props(struct gralloc_drm_t *drm,
+	struct gralloc_drm_plane_t *plane, const struct drm_kms_obj_props *obj)
+{
+	uint32_t id = plane->drm_plane->plane_id;
+	struct gralloc_drm_plane_props *props = &plane->props;
+	uint64_t type = DRM_PLANE_TYPE_OVERLAY;
+	drmModePropertyPtr prop;
+
+	drm_kms_find_obj_prop(obj, "type", &type);
+	plane->type = (uint32_t) type;
+
+	props->fb_id = drm_kms_find_obj_prop_id(obj, "FB_ID", NULL);
+	props->crtc_id = drm_kms_find_obj_prop_id(obj, "CRTC_ID", NULL);
+	props->src_x = drm_kms_find_obj_prop_id(obj, "SRC_X", NULL);
+	props->src_y = drm_kms_find_obj_prop_id(obj, "SRC_Y", NULL);
+	props->src_w = drm_kms_find_obj_prop_id(obj, "SRC_W", NULL);
+	props->src_h = drm_kms_find_obj_prop_id(obj, "SRC_H", NULL);
+	props->crtc_x = drm_kms_find_obj_prop_id(obj, "CRTC_X", NULL);
+	props->crtc_y = drm_kms_find_obj_prop_id(obj, "CRTC_Y", NULL);
+	props->crtc_w = drm_kms_find_obj_prop_id(obj, "CRTC_W", NULL);
+	props->crtc_h = drm_kms_find_obj_prop_id(obj, "CRTC_H", NULL);
+	/* optional */
+	props->in_fence_fd = drm_kms_find_obj_prop_id(obj, "IN_FENCE_FD",
+			NULL);
+	prop = drm_kms_find_obj_prop(obj, "zpos", &plane->zpos);
+	if (prop) {
+		props->zpos = prop->prop_id;
+		plane->zpos_min = plane->zpos_max = plane->zpos;
+		if (!(prop->flags & DRM_MODE_PROP_IMMUTABLE) &&
+		    (prop->flags & DRM_MODE_PROP_RANGE) &&
+		    prop->count_values == 2) {
+			plane->zpos_mutable = 1;
+			plane->zpos_min = prop->values[0];
+			plane->zpos_max = prop->values[1];
+		}
+	}
+
+	if (!props->fb_id || !props->crtc_id ||
+	    !props->src_x || !props->src_y || !props->src_w || !props->src_h ||
+	    !props->crtc_x || !props->crtc_y || !props->crtc_w || !props->crtc_h) {
+		ALOGE("plane %d is missing atomic properties", id);
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
+/*
+ * Get the formats and the modifiers a plane can scan out, when it tells.
+ */
+static void drm_kms_init_plane_formats(struct gralloc_drm_t *drm,
+	struct gralloc_drm_plane_t *plane, const struct drm_kms_obj_props *obj)
+{
+	uint64_t blob_id = 0;
+
+	if (!drm_kms_find_obj_prop(obj, "IN_FORMATS", &blob_id) || !blob_id)
+		return;
+
+	plane->in_formats = drmModeGetPropertyBlob(drm->fd, (uint32_t) blob_id);
+}
+
+/*
+ * Add the state of a plane to an atomic request.  The plane is disabled when
+ * fb_id is 0.
+ */
+static int drm_kms_atomic_set_plane(drmModeAtomicReqPtr req,
+	const struct gralloc_drm_plane_t *plane,
+	uint32_t crtc_id, uint32_t fb_id,
+	uint32_t dst_x, uint32_t dst_y, uint32_t dst_w, uint32_t dst_h,
+	uint32_t src_x, uint32_t src_y, uint32_t src_w, uint32_t src_h)
+{
+	uint32_t id = plane->drm_plane->plane_id;
+	const struct gralloc_drm_plane_props *props = &plane->props;
+	int ret = 0;
+
+	if (!fb_id) {
+		ret |= drmModeAtomicAddProperty(req, id, props->fb_id, 0);
+		ret |= drmModeAtomicAddProperty(req, id, props->crtc_id, 0);
+		return (ret < 0) ? -ENOMEM : 0;
+	}
+
+	ret |= drmModeAtomicAddProperty(req, id, props->fb_id, fb_id);
+	ret |= drmModeAtomicAddProperty(req, id, props->crtc_id, crtc_id);
+	ret |= drmModeAtomicAddProperty(req, id, props->crtc_x, dst_x);
+	ret |= drmModeAtomicAddProperty(req, id, props->crtc_y, dst_y);
+	ret |= drmModeAtomicAddProperty(req, id, props->crtc_w, dst_w);
+	ret |= drmModeAtomicAddProperty(req, id, props->crtc_h, dst_h);
+	ret |= drmModeAtomicAddProperty(req, id, props->src_x, src_x << 16);
+	ret |= drmModeAtomicAddProperty(req, id, props->src_y, src_y << 16);
+	ret |= drmModeAtomicAddProperty(req, id, props->src_w, src_w << 16);
+	ret |= drmModeAtomicAddProperty(req, id, props->src_h, src_h << 16);
+
+	return (ret < 0) ? -ENOMEM : 0;
+}
+
+/*
+ * Return the primary plane of the crtc of an output.
+ */
+static struct gralloc_drm_plane_t *drm_kms_get_primary_plane(
+	struct gralloc_drm_t *drm, struct gralloc_drm_output *output)
+{
+	struct gralloc_drm_plane_t *plane, *found = NULL;
+	unsigned int i;
+
+	if (output->plane)
+		return output->plane;
+
+	if (!drm->planes)
+		return NULL;
+
+	plane = drm->planes;
+	for (i = 0; i < drm->plane_resources->count_planes; i++, plane++) {
+		if (plane->type != DRM_PLANE_TYPE_PRIMARY ||
+		    !(plane->drm_plane->possible_crtcs & (1 << output->pipe)))
+			continue;
+
+		/* prefer the plane that is already bound to the crtc */
+		if (!found || plane->drm_plane->crtc_id == output->crtc_id)
+			found = plane;
+	}
+
+	output->plane = found;
+
+	return found;
+}
+
+/*
+ * Add the state of an overlay to an atomic request.  The overlay is disabled
+ * when bo is NULL.
+ */
+static int drm_kms_atomic_set_overlay(drmModeAtomicReqPtr req,
+	const struct gralloc_drm_plane_t *plane, struct gralloc_drm_bo_t *bo)
+{
+	int ret;
+
+	if (!bo)
+		return drm_kms_atomic_set_plane(req, plane, 0, 0,
+				0, 0, 0, 0, 0, 0, 0, 0);
+
+	ret = drm_kms_atomic_set_plane(req, plane,
+			plane->output->crtc_id,
+			bo->fb_id,
+			plane->dst_x,
+			plane->dst_y,
+			plane->dst_w,
+			plane->dst_h,
+			plane->src_x,
+			plane->src_y,
+			plane->src_w,
+			plane->src_h);
+	if (!ret && plane->zpos_mutable &&
+	    drmModeAtomicAddProperty(req, plane->drm_plane->plane_id,
+			plane->props.zpos, plane->zpos) < 0)
+		ret = -ENOMEM;
+
+	return ret;
+}
+
+/*
+ * Set a plane, or disable it when hide is set.  With atomic, the pipes of the
+ * crtcs the request changes are added to pipes.
+ */
+static int gralloc_drm_bo_setplane(struct gralloc_drm_t *drm,
+	struct gralloc_drm_plane_t *plane, drmModeAtomicReqPtr req,
+	unsigned int *pipes, int hide)
+{
+	struct gralloc_drm_output *output = plane->output;
+	struct gralloc_drm_bo_t *bo = NULL;
+	int err;
+
+	if (!output)
+		output = drm->primary;
+
+	/* the output may have been disconnected since */
+	if (plane->handle && output->active && !hide)
+		bo = gralloc_drm_bo_from_handle(plane->handle);
+
+	// create a framebuffer if does not exist
+	if (bo && bo->fb_id == 0) {
+		err = gralloc_drm_bo_add_fb(bo);
+		if (err) {
+			ALOGE("%s: could not create drm fb, (%s)",
+				__func__, strerror(-err));
+			return err;
+		}
+	}
+
+	/* latch the plane with the rest of the atomic commit */
+	if (req) {
+		err = drm_kms_atomic_set_overlay(req, plane, bo);
+		if (!err && plane->prev_output)
+			*pipes |= 1U << plane->prev_output->pipe;
+		if (!err && bo)
+			*pipes |= 1U << output->pipe;
+	}
+	else
+		err = drmModeSetPlane(drm->fd,
+			plane->drm_plane->plane_id,
+			output->crtc_id,
+			bo ? bo->fb_id : 0,
+			0, // flags
+			plane->dst_x,
+			plane->dst_y,
+			plane->dst_w,
+			plane->dst_h,
+			plane->src_x << 16,
+			plane->src_y << 16,
+			plane->src_w << 16,
+			plane->src_h << 16);
+
+	/* the layer is composited instead, and may be tried again later */
+	if (err)
+		ALOGE("%s : error (%s) (plane %d crtc %d fb %d)",
+			req ? "drmModeAtomicAddProperty" : "drmModeSetPlane",
+			strerror(-err),
+			plane->drm_plane->plane_id,
+			output->crtc_id,
+			bo ? bo->fb_id : 0);
+
+	if (plane->prev)
+		gralloc_drm_bo_decref(plane->prev);
+
+	if (bo)
+		gralloc_drm_bo_incref(bo);
+
+	plane->prev = bo;
+	plane->prev_output = (bo) ? output : NULL;
+
+	return err;
+}
+
+/*
+ * Returns if a particular plane can show layers on an output
+ */
+static unsigned is_plane_supported(const struct gralloc_drm_plane_t *plane,
+	const struct gralloc_drm_output *output)
+{
+	/* primary and cursor planes are exposed with atomic */
+	if (plane->type != DRM_PLANE_TYPE_OVERLAY)
+		return 0;
+
+	return plane->drm_plane->possible_crtcs & (1 << output->pipe);
+}
+
+/*
+ * Return the output whose posts latch the planes of an output: an extended
+ * output posts its own, and the primary those of the others.
+ */
+static struct gralloc_drm_output *drm_kms_get_post_output(
+	struct gralloc_drm_t *drm, struct gralloc_drm_output *output)
+{
+	if (output && output->output_mode == DRM_OUTPUT_EXTENDED)
+		return output;
+
+	return drm->primary;
+}
+
+/*
+ * Sets the active planes latched by the posts of post_output to be
+ * displayed, or adds them to an atomic request when req is not NULL.  Return
+ * the mask of the pipes of the crtcs the request changes.
+ *
+ * A plane that moves to an output posted separately is disabled by a post of
+ * the output it is shown on, and then set by a post of the new one, so that
+ * a commit never changes the crtcs of another swapchain.
+ */
+static unsigned int gralloc_drm_set_planes(struct gralloc_drm_t *drm,
+	drmModeAtomicReqPtr req, struct gralloc_drm_output *post_output)
+{
+	struct gralloc_drm_plane_t *plane = drm->planes;
+	unsigned int i, pipes = 0;
+	for (i = 0; i < drm->plane_resources->count_planes;
+		i++, plane++) {
+		struct gralloc_drm_output *shown, *target;
+		int hide = 0;
+
+		/* plane is not in use at all */
+		if (!plane->active && !plane->handle)
+			continue;
+
+		target = drm_kms_get_post_output(drm, plane->output);
+		shown = (plane->prev) ?
+			drm_kms_get_post_output(drm, plane->prev_output) :
+			target;
+		if (shown != post_output)
+			continue;
+		if (target != shown)
+			hide = 1;
+
+		/* plane is active, safety check if it is supported */
+		if (plane->active && plane->output &&
+		    !is_plane_supported(plane, plane->output))
+			ALOGE("%s: plane %d is not supported",
+				 __func__, plane->drm_plane->plane_id);
+
+		/*
+		 * Disable overlay if it is not active
+		 * or if there is error during setplane
+		 */
+		if (!plane->active)
+			plane->handle = 0;
+
+		if (gralloc_drm_bo_setplane(drm, plane, req, &pipes, hide))
+			plane->active = 0;
+	}
+
+	return pipes;
+}
+
+/*
+ * Check with a TEST_ONLY commit that the active planes can be shown together,
+ * with the planes that are no longer active disabled.  The other planes and
+ * the crtcs are tested in their current state.
+ */
+static int drm_kms_test_planes(struct gralloc_drm_t *drm)
+{
+	struct gralloc_drm_plane_t *plane = drm->planes;
+	drmModeAtomicReqPtr req;
+	unsigned int i;
+	int ret = 0;
+
+	req = drmModeAtomicAlloc();
+	if (!req)
+		return -ENOMEM;
+
+	for (i = 0; i < drm->plane_resources->count_planes && !ret;
+			i++, plane++) {
+		struct gralloc_drm_bo_t *bo = NULL;
+
+		if (plane->active) {
+			bo = gralloc_drm_bo_from_handle(plane->handle);
+			if (!bo || gralloc_drm_bo_add_fb(bo)) {
+				ret = -EINVAL;
+				break;
+			}
+		}
+		else if (!plane->prev) {
+			continue;
+		}
+
+		ret = drm_kms_atomic_set_overlay(req, plane, bo);
+	}
+
+	if (!ret && drmModeAtomicCommit(drm->fd, req,
+				DRM_MODE_ATOMIC_TEST_ONLY, NULL))
+		ret = -errno;
+
+	drmModeAtomicFree(req);
+
+	return ret;
+}
+
+/*
+ * Return the output of a display.  Display 0 is the primary output, and the
+ * others are the other active outputs in order.
+ */
+static struct gralloc_drm_output *drm_kms_get_display_output(
+	struct gralloc_drm_t *drm, int display)
+{
+	int i;
+
+	if (!display)
+		return drm->primary;
+
+	for (i = 0; i < drm->output_capacity; i++) {
+		struct gralloc_drm_output *output = &drm->outputs[i];
+
+		if (!output->active || output == drm->primary)
+			continue;
+		if (!--display)
+			return output;
+	}
+
+	return NULL;
+}
+
+/*
+ * Interface for HWC, used to reserve a plane for a layer of the primary
+ * output.
+ */
+int gralloc_drm_reserve_plane(struct gralloc_drm_t *drm,
+	buffer_handle_t handle,
+	uint32_t id,
+	uint32_t dst_x,
+	uint32_t dst_y,
+	uint32_t dst_w,
+	uint32_t dst_h,
+	uint32_t src_x,
+	uint32_t src_y,
+	uint32_t src_w,
+	uint32_t src_h)
+{
+	return gralloc_drm_reserve_display_plane(drm, handle, id, 0,
+			dst_x, dst_y, dst_w, dst_h,
+			src_x, src_y, src_w, src_h);
+}
+
+/*
+ * Interface for HWC, used to reserve a plane for a layer of a display.  The
+ * layers of a display are reserved from bottom to top after the planes are
+ * disabled for a frame.  A plane is reserved only when it can show the format
+ * on the crtc of the display above the layers reserved before, and, with
+ * atomic, when a TEST_ONLY commit of the reserved planes succeeds.  A layer
+ * that gets no plane is to be composited, and may be reserved again for the
+ * next frames.
+ */
+int gralloc_drm_reserve_display_plane(struct gralloc_drm_t *drm,
+	buffer_handle_t handle,
+	uint32_t id,
+	int display,
+	uint32_t dst_x,
+	uint32_t dst_y,
+	uint32_t dst_w,
+	uint32_t dst_h,
+	uint32_t src_x,
+	uint32_t src_y,
+	uint32_t src_w,
+	uint32_t src_h)
+{
+	int j;
+	struct gralloc_drm_handle_t *drm_handle =
+		gralloc_drm_handle(handle);
+	int plane_count;
+	struct gralloc_drm_plane_t *plane = drm->planes;
+	struct gralloc_drm_output *output;
+	uint32_t drm_format;
+	uint64_t top = 0;
+
+	if (!drm_handle || !plane)
+		return -EINVAL;
+
+	output = drm_kms_get_display_output(drm, display);
+	if (!output || !output->active)
+		return -EINVAL;
+
+	/* no supported planes for this handle */
+	drm_format = drm_format_from_hal(drm_handle->format);
+	if (!drm_format) {
+		ALOGE("%s: buffer %p cannot be shown on a plane\n",
+			__func__, drm_handle);
+		return -EINVAL;
+	}
+
+	/* the layers reserved so far are below */
+	plane_count = drm->plane_resources->count_planes;
+	for (j = 0; j < plane_count; j++, plane++) {
+		if (plane->active && plane->output == output &&
+		    plane->zpos > top)
+			top = plane->zpos;
+	}
+
+	plane = drm->planes;
+	for (j = 0; j < plane_count; j++, plane++) {
+		struct gralloc_drm_output *prev_output;
+		buffer_handle_t prev_handle;
+
 		/*
 		 * handle may be suitable to be shown on a plane, in
 		 * addition we need to check that this particular plane
 		 * is supported by the current implementation
 		 */
-		if (!is_plane_supported(drm, plane))
+		if (plane->active ||
+		    !drm_kms_plane_has_format(plane, drm_format) ||
+		    !is_plane_supported(plane, output) ||
+		    !drm_kms_plane_has_modifier(plane, drm_format,
+			    drm_handle->modifier))
+			continue;
+
+		/* keep the order of the layers */
+		if (plane->zpos_mutable) {
+			uint64_t zpos = MAX(top + 1, plane->zpos_min);
+
+			if (zpos > plane->zpos_max)
+				continue;
+			plane->zpos = zpos;
+		}
+		else if (plane->props.zpos && top && plane->zpos <= top) {
 			continue;
+		}
+
+		prev_handle = plane->handle;
+		prev_output = plane->output;
+
+		plane->dst_x = dst_x;
+		plane->dst_y = dst_y;
+		plane->dst_w = dst_w;
+		plane->dst_h = dst_h;
+		plane->src_x = src_x;
+		plane->src_y = src_y;
+		plane->src_w = src_w;
+		plane->src_h = src_h;
+		plane->handle = handle;
+		plane->output = output;
+		plane->id = id;
+		plane->active = 1;
+
+		/* let KMS check scaling, bandwidth and the like */
+		if (drm->swap_mode == DRM_SWAP_ATOMIC &&
+		    drm_kms_test_planes(drm)) {
+			plane->active = 0;
+			plane->id = 0;
+			plane->handle = prev_handle;
+			plane->output = prev_output;
+			continue;
+		}
+
+		return 0;
+	}
+
+	/* no free planes available */
+	return -EBUSY;
+}
+
+/*
+ * Interface for HWC, used to disable all the overlays. Plane id
+ * is also set to 0 as it should be mappable to a particular layer only
+ * if it has been reserved with 'reserve_plane'.
+ */
+void gralloc_drm_disable_planes(struct gralloc_drm_t *drm)
+{
+	struct gralloc_drm_plane_t *plane = drm->planes;
+	unsigned int i;
+
+	for (i = 0; i < drm->plane_resources->count_planes; i++, plane++) {
+		plane->active = 0;
+		plane->id = 0;
+	}
+}
+
+/*
+ * Interface for HWC, used to change handle of a reserved plane.
+ */
+int gralloc_drm_set_plane_handle(struct gralloc_drm_t *drm,
+	uint32_t id, buffer_handle_t handle)
+{
+	struct gralloc_drm_plane_t *plane = drm->planes;
+	unsigned i;
+
+	for (i = 0; i < drm->plane_resources->count_planes; i++, plane++)
+		if (plane->active && plane->id == id) {
+			plane->handle = handle;
+			return 0;
+		}
+
+	return -EINVAL;
+}
+
+/*
+ * The cursors are dumb bos of the size KMS asks for, written by the CPU and
+ * set with the legacy cursor ioctls.  These update the cursor plane on their
+ * own, without waiting for the flips of the crtc.
+ */
+static int drm_kms_create_cursor(struct gralloc_drm_t *drm,
+	struct gralloc_drm_output *output)
+{
+	struct drm_mode_create_dumb create;
+	struct drm_mode_map_dumb map;
+	struct drm_gem_close close_arg;
+	void *ptr;
+	int ret;
+
+	if (output->cursor_handle)
+		return 0;
+
+	memset(&create, 0, sizeof(create));
+	create.width = drm->cursor_width;
+	create.height = drm->cursor_height;
+	create.bpp = 32;
+	if (drmIoctl(drm->fd, DRM_IOCTL_MODE_CREATE_DUMB, &create))
+		return -errno;
+
+	memset(&map, 0, sizeof(map));
+	map.handle = create.handle;
+	ptr = MAP_FAILED;
+	if (!drmIoctl(drm->fd, DRM_IOCTL_MODE_MAP_DUMB, &map))
+		ptr = mmap(NULL, create.size, PROT_READ | PROT_WRITE,
+				MAP_SHARED, drm->fd, map.offset);
+	if (ptr == MAP_FAILED) {
+		ret = -errno;
+		memset(&close_arg, 0, sizeof(close_arg));
+		close_arg.handle = create.handle;
+		drmIoctl(drm->fd, DRM_IOCTL_GEM_CLOSE, &close_arg);
+		return ret;
+	}
+
+	output->cursor_handle = create.handle;
+	output->cursor_map = ptr;
+	output->cursor_size = create.size;
+	output->cursor_pitch = create.pitch;
+
+	return 0;
+}
+
+static void drm_kms_destroy_cursor(struct gralloc_drm_t *drm,
+	struct gralloc_drm_output *output)
+{
+	struct drm_gem_close close_arg;
+
+	if (!output->cursor_handle)
+		return;
+
+	drmModeSetCursor(drm->fd, output->crtc_id, 0, 0, 0);
+	munmap(output->cursor_map, output->cursor_size);
+
+	memset(&close_arg, 0, sizeof(close_arg));
+	close_arg.handle = output->cursor_handle;
+	drmIoctl(drm->fd, DRM_IOCTL_GEM_CLOSE, &close_arg);
+
+	output->cursor_handle = 0;
+	output->cursor_map = NULL;
+}
+
+/*
+ * Copy a bo to the cursor of an output as ARGB8888, clipped to the cursor
+ * size.
+ */
+static int drm_kms_copy_cursor(struct gralloc_drm_t *drm,
+	struct gralloc_drm_output *output, struct gralloc_drm_bo_t *bo)
+{
+	const struct gralloc_drm_handle_t *handle = bo->handle;
+	int w, h, x, y, swap, err;
+	void *addr;
+
+	switch (handle->format) {
+	case HAL_PIXEL_FORMAT_RGBA_8888:
+	case HAL_PIXEL_FORMAT_RGBX_8888:
+		swap = 1;
+		break;
+	case HAL_PIXEL_FORMAT_BGRA_8888:
+		swap = 0;
+		break;
+	default:
+		ALOGE("unsupported cursor format 0x%x", handle->format);
+		return -EINVAL;
+	}
+
+	w = MIN(handle->width, drm->cursor_width);
+	h = MIN(handle->height, drm->cursor_height);
+
+	err = gralloc_drm_bo_lock(bo, GRALLOC_USAGE_SW_READ_OFTEN,
+			0, 0, w, h, &addr);
+	if (err)
+		return err;
+
+	memset(output->cursor_map, 0, output->cursor_size);
+	for (y = 0; y < h; y++) {
+		const uint8_t *src = (const uint8_t *) addr + handle->stride * y;
+		uint32_t *dst = (uint32_t *) ((uint8_t *) output->cursor_map +
+				output->cursor_pitch * y);
+
+		for (x = 0; x < w; x++, src += 4) {
+			uint32_t a = (handle->format ==
+					HAL_PIXEL_FORMAT_RGBX_8888) ?
+				0xff : src[3];
+
+			dst[x] = (swap) ?
+				(a << 24 | src[0] << 16 | src[1] << 8 | src[2]) :
+				(a << 24 | src[2] << 16 | src[1] << 8 | src[0]);
+		}
+	}
+
+	gralloc_drm_bo_unlock(bo);
+
+	return 0;
+}
+
+/*
+ * Interface for HWC, used to get the size of the cursors.  Larger handles
+ * are clipped.
+ */
+void gralloc_drm_get_cursor_size(struct gralloc_drm_t *drm,
+	uint32_t *width, uint32_t *height)
+{
+	*width = drm->cursor_width;
+	*height = drm->cursor_height;
+}
+
+/*
+ * Interface for HWC, used to show a handle as the cursor of a display, with
+ * its hotspot at (hot_x, hot_y), or to hide the cursor when handle is NULL.
+ * The handle is copied, and may be reused once this returns.
+ */
+int gralloc_drm_set_cursor(struct gralloc_drm_t *drm, int display,
+	buffer_handle_t handle, int hot_x, int hot_y)
+{
+	struct gralloc_drm_output *output;
+	struct gralloc_drm_bo_t *bo = NULL;
+	int ret = 0;
+
+	if (handle) {
+		bo = gralloc_drm_bo_from_handle(handle);
+		if (!bo)
+			return -EINVAL;
+	}
+
+	pthread_mutex_lock(&drm->outputs_mutex);
+
+	output = drm_kms_get_display_output(drm, display);
+	if (!output || !output->active) {
+		ret = -EINVAL;
+		goto out;
+	}
+
+	if (!bo) {
+		if (output->cursor_handle &&
+		    drmModeSetCursor(drm->fd, output->crtc_id, 0, 0, 0))
+			ret = -errno;
+		goto out;
+	}
+
+	ret = drm_kms_create_cursor(drm, output);
+	if (!ret)
+		ret = drm_kms_copy_cursor(drm, output, bo);
+	if (ret)
+		goto out;
+
+	/* the hotspot is only a hint, for virtual hardware */
+	if (drmModeSetCursor2(drm->fd, output->crtc_id, output->cursor_handle,
+				drm->cursor_width, drm->cursor_height,
+				hot_x, hot_y) &&
+	    drmModeSetCursor(drm->fd, output->crtc_id, output->cursor_handle,
+				drm->cursor_width, drm->cursor_height)) {
+		ret = -errno;
+		ALOGE("failed to set the cursor of crtc %d (%s)",
+				output->crtc_id, strerror(errno));
+		goto out;
+	}
+
+	if (hot_x != output->cursor_hot_x || hot_y != output->cursor_hot_y) {
+		output->cursor_hot_x = hot_x;
+		output->cursor_hot_y = hot_y;
+		drmModeMoveCursor(drm->fd, output->crtc_id,
+				output->cursor_x - hot_x,
+				output->cursor_y - hot_y);
+	}
+
+out:
+	pthread_mutex_unlock(&drm->outputs_mutex);
+
+	return ret;
+}
+
+/*
+ * Interface for HWC, used to move the hotspot of the cursor of a display to
+ * (x, y).  The cursor moves at once, without a post.
+ */
+int gralloc_drm_move_cursor(struct gralloc_drm_t *drm, int display,
+	int x, int y)
+{
+	struct gralloc_drm_output *output;
+	int ret = 0;
+
+	pthread_mutex_lock(&drm->outputs_mutex);
+
+	output = drm_kms_get_display_output(drm, display);
+	if (output && output->active) {
+		output->cursor_x = x;
+		output->cursor_y = y;
+		if (output->cursor_handle &&
+		    drmModeMoveCursor(drm->fd, output->crtc_id,
+				x - output->cursor_hot_x,
+				y - output->cursor_hot_y))
+			ret = -errno;
+	}
+	else {
+		ret = -EINVAL;
+	}
+
+	pthread_mutex_unlock(&drm->outputs_mutex);
+
+	return ret;
+}
+
+/*
+ * Close the acquire fence of the post in progress.
+ */
+static void drm_kms_put_in_fence(struct gralloc_drm_t *drm)
+{
+	if (drm->in_fence >= 0) {
+		close(drm->in_fence);
+		drm->in_fence = -1;
+	}
+}
+
+/*
+ * Wait for the acquire fence of the post in progress, for when KMS cannot
+ * wait for it or the bo is read before the commit.
+ */
+static void drm_kms_wait_in_fence(struct gralloc_drm_t *drm)
+{
+	if (drm->in_fence < 0)
+		return;
+
+	if (gralloc_drm_wait_fence(drm->in_fence, DRM_FENCE_TIMEOUT))
+		ALOGW("failed to wait for acquire fence %d", drm->in_fence);
+	drm_kms_put_in_fence(drm);
+}
+
+/*
+ * Fit a width x height surface in the centre of an output, keeping its
+ * aspect ratio.
+ */
+static void drm_kms_fit_to_output(const struct gralloc_drm_output *output,
+		int width, int height,
+		uint32_t *x, uint32_t *y, uint32_t *w, uint32_t *h)
+{
+	uint32_t hdisplay = output->mode.hdisplay;
+	uint32_t vdisplay = output->mode.vdisplay;
+
+	if ((uint64_t) width * vdisplay > (uint64_t) height * hdisplay) {
+		*w = hdisplay;
+		*h = (uint32_t) ((uint64_t) height * hdisplay / width) & ~1;
+	}
+	else {
+		*w = (uint32_t) ((uint64_t) width * vdisplay / height) & ~1;
+		*h = vdisplay;
+	}
+
+	*x = (hdisplay - *w) / 2;
+	*y = (vdisplay - *h) / 2;
+}
+
+/*
+ * Copy a bo into the private fb of a cloned output.  It is scaled to fit
+ * when the driver can scale, and centered otherwise.
+ */
+static void drm_kms_blit_to_output(struct gralloc_drm_t *drm,
+		struct gralloc_drm_output *output, struct gralloc_drm_bo_t *bo)
+{
+	uint64_t start = drm_kms_stats_now(drm);
+	uint32_t dst_x1 = 0, dst_y1 = 0;
+	uint32_t dst_w = bo->handle->width, dst_h = bo->handle->height;
+
+	if (drm->drv->scale_blit) {
+		drm_kms_fit_to_output(output,
+				bo->handle->width, bo->handle->height,
+				&dst_x1, &dst_y1, &dst_w, &dst_h);
+	}
+	else {
+		if (output->bo->handle->width > bo->handle->width)
+			dst_x1 = (output->bo->handle->width -
+					bo->handle->width) / 2;
+		if (output->bo->handle->height > bo->handle->height)
+			dst_y1 = (output->bo->handle->height -
+					bo->handle->height) / 2;
+	}
+
+	gralloc_drm_blit(drm, output->bo, bo,
+			dst_x1, dst_y1, dst_x1 + dst_w, dst_y1 + dst_h,
+			0, 0, bo->handle->width, bo->handle->height);
+
+	drm_kms_stats_record(drm, &drm->stats.mirror_blit, start);
+}
+
+/*
+ * Submit the blits queued by the driver, before their results are shown.
+ */
+static void drm_kms_flush_blits(struct gralloc_drm_t *drm)
+{
+	pthread_mutex_lock(&drm->blit_mutex);
+	if (drm->drv->flush)
+		drm->drv->flush(drm->drv);
+	if (drm->render_drv && drm->render_drv->flush)
+		drm->render_drv->flush(drm->render_drv);
+	pthread_mutex_unlock(&drm->blit_mutex);
+}
+
+/*
+ * Return the readback bo of a capture, reusing the last one when it has the
+ * same size and format.  It is linear and cached, to be read by the CPU.
+ */
+static struct gralloc_drm_bo_t *drm_kms_get_capture_bo(
+		struct gralloc_drm_t *drm, int width, int height, int format)
+{
+	struct gralloc_drm_bo_t *bo = drm->capture_bo;
+
+	if (bo && bo->handle->width == width &&
+	    bo->handle->height == height && bo->handle->format == format)
+		return bo;
+
+	if (bo)
+		gralloc_drm_bo_decref(bo);
+	drm->capture_bo = gralloc_drm_bo_create(drm, width, height, format,
+			GRALLOC_USAGE_SW_READ_OFTEN | GRALLOC_USAGE_HW_RENDER);
+
+	return drm->capture_bo;
+}
+
+/*
+ * Copy the front of a display to the readback bo and hand it to the
+ * callback.  The front is referenced while it is read, so that a flip
+ * meanwhile does not free it; the fronts hold references of their own,
+ * swapped under event_mutex.  The CPU copies by itself, not to hold up the
+ * blits of the posts, unless the posts copy into the front.
+ */
+static void drm_kms_run_capture(struct gralloc_drm_t *drm, int display,
+		int width, int height, gralloc_drm_capture_t callback,
+		void *data)
+{
+	struct gralloc_drm_output *output;
+	struct gralloc_drm_bo_t *front = NULL, *bo = NULL;
+
+	pthread_mutex_lock(&drm->outputs_mutex);
+	output = drm_kms_get_display_output(drm, display);
+	if (output && output->active) {
+		pthread_mutex_lock(&drm->event_mutex);
+		front = (output == drm->primary) ?
+			drm->current_front : output->current_front;
+		if (front)
+			gralloc_drm_bo_incref(front);
+		pthread_mutex_unlock(&drm->event_mutex);
+	}
+	pthread_mutex_unlock(&drm->outputs_mutex);
+
+	if (front) {
+		/* only the driver scales, the CPU crops */
+		if (!width || !height || !drm->drv->scale_blit) {
+			width = front->handle->width;
+			height = front->handle->height;
+		}
+
+		bo = drm_kms_get_capture_bo(drm, width, height,
+				front->handle->format);
+		if (bo) {
+			if (drm->swap_mode == DRM_SWAP_COPY)
+				gralloc_drm_blit(drm, bo, front,
+						0, 0, width, height,
+						0, 0, front->handle->width,
+						front->handle->height);
+			else
+				gralloc_drm_blit_unshared(drm, bo, front,
+						0, 0, width, height,
+						0, 0, front->handle->width,
+						front->handle->height);
+			drm_kms_flush_blits(drm);
+		}
+		gralloc_drm_bo_decref(front);
+	}
+
+	if (!bo)
+		ALOGW("failed to capture display %d", display);
+
+	/* the lock of the handle waits for the blit */
+	callback(data, (bo) ? gralloc_drm_bo_get_handle(bo, NULL) : NULL,
+			width, height);
+}
+
+static void *drm_kms_capture_thread(void *arg)
+{
+	struct gralloc_drm_t *drm = (struct gralloc_drm_t *) arg;
+
+	pthread_mutex_lock(&drm->capture_mutex);
+	while (1) {
+		while (!drm->capture_pending && !drm->capture_exit)
+			pthread_cond_wait(&drm->capture_cond,
+					&drm->capture_mutex);
+		/* the pending capture is run before exiting */
+		if (!drm->capture_pending)
+			break;
+
+		pthread_mutex_unlock(&drm->capture_mutex);
+		drm_kms_run_capture(drm, drm->capture_display,
+				drm->capture_width, drm->capture_height,
+				drm->capture_callback, drm->capture_data);
+		pthread_mutex_lock(&drm->capture_mutex);
+
+		drm->capture_pending = 0;
+	}
+	pthread_mutex_unlock(&drm->capture_mutex);
+
+	return NULL;
+}
+
+/*
+ * Interface for HWC and screenshots, used to capture the front of the
+ * primary plane of a display without waiting for the capture.  The capture
+ * is scaled to width x height when the driver can scale, and has the size
+ * of the front otherwise or when they are 0.  The callback is called from
+ * the capture thread.  Return -EBUSY while a capture is pending.
+ */
+int gralloc_drm_capture(struct gralloc_drm_t *drm, int display,
+	int width, int height, gralloc_drm_capture_t callback, void *data)
+{
+	int ret = 0;
+
+	if (!callback || width < 0 || height < 0)
+		return -EINVAL;
+
+	pthread_mutex_lock(&drm->capture_mutex);
+
+	if (drm->capture_pending) {
+		ret = -EBUSY;
+		goto out;
+	}
+
+	if (!drm->capture_started) {
+		if (pthread_create(&drm->capture_thread, NULL,
+					drm_kms_capture_thread, drm)) {
+			ALOGE("failed to create capture thread");
+			ret = -ENOMEM;
+			goto out;
+		}
+		drm->capture_started = 1;
+	}
+
+	drm->capture_display = display;
+	drm->capture_width = width;
+	drm->capture_height = height;
+	drm->capture_callback = callback;
+	drm->capture_data = data;
+	drm->capture_pending = 1;
+	pthread_cond_signal(&drm->capture_cond);
+
+out:
+	pthread_mutex_unlock(&drm->capture_mutex);
+
+	return ret;
+}
+
+/*
+ * Stop the capture thread after the pending capture.
+ */
+static void drm_kms_fini_capture(struct gralloc_drm_t *drm)
+{
+	if (drm->capture_started) {
+		pthread_mutex_lock(&drm->capture_mutex);
+		drm->capture_exit = 1;
+		pthread_cond_signal(&drm->capture_cond);
+		pthread_mutex_unlock(&drm->capture_mutex);
+
+		pthread_join(drm->capture_thread, NULL);
+		drm->capture_started = 0;
+	}
+
+	if (drm->capture_bo) {
+		gralloc_drm_bo_decref(drm->capture_bo);
+		drm->capture_bo = NULL;
+	}
+
+	pthread_cond_destroy(&drm->capture_cond);
+	pthread_mutex_destroy(&drm->capture_mutex);
+}
+
+static int drm_kms_blit_to_mirror_connectors(struct gralloc_drm_t *drm, struct gralloc_drm_bo_t *bo)
+{
+	int ret = 0;
+	for (int i = 1; i < drm->output_capacity; i++) {
+		struct gralloc_drm_output *output = &drm->outputs[i];
+
+		if (output->active && output->output_mode == DRM_OUTPUT_CLONED && output->bo)
+			drm_kms_blit_to_output(drm, output, bo);
+	}
+
+	/* submit all the blits at once before flipping */
+	drm_kms_flush_blits(drm);
+
+	for (int i = 1; i < drm->output_capacity; i++) {
+		struct gralloc_drm_output *output = &drm->outputs[i];
+
+		if (output->active && output->output_mode == DRM_OUTPUT_CLONED && output->bo) {
+			ret = drmModePageFlip(drm->fd, output->crtc_id, output->bo->fb_id, 0, NULL);
+			if (ret && errno != EBUSY)
+				ALOGE("failed to perform page flip for output (%s) (crtc %d fb %d))",
+						strerror(errno), output->crtc_id, output->bo->fb_id);
+		}
+	}
+
+	return ret;
+}
+
+/*
+ * Add the primary plane of an output to an atomic request.
+ */
+static int drm_kms_atomic_set_output(struct gralloc_drm_t *drm,
+		drmModeAtomicReqPtr req, struct gralloc_drm_output *output,
+		struct gralloc_drm_bo_t *bo)
+{
+	struct gralloc_drm_plane_t *plane;
+
+	plane = drm_kms_get_primary_plane(drm, output);
+	if (!plane) {
+		ALOGE("no primary plane for crtc %d", output->crtc_id);
+		return -EINVAL;
+	}
+
+	return drm_kms_atomic_set_plane(req, plane,
+			output->crtc_id, bo->fb_id,
+			0, 0, output->mode.hdisplay, output->mode.vdisplay,
+			0, 0, output->mode.hdisplay, output->mode.vdisplay);
+}
+
+/*
+ * Add adaptive sync and the pending refresh switch of an output to an atomic
+ * request.  Return the mode blob added, to be passed to
+ * drm_kms_atomic_refresh_done.
+ */
+static uint32_t drm_kms_atomic_set_refresh(struct gralloc_drm_t *drm,
+		drmModeAtomicReqPtr req, struct gralloc_drm_output *output)
+{
+	uint32_t blob;
+
+	if (output->vrr_enabled_prop && !output->vrr_enabled)
+		drmModeAtomicAddProperty(req, output->crtc_id,
+				output->vrr_enabled_prop, 1);
+
+	pthread_mutex_lock(&drm->outputs_mutex);
+	blob = output->mode_blob;
+	pthread_mutex_unlock(&drm->outputs_mutex);
+
+	if (blob)
+		drmModeAtomicAddProperty(req, output->crtc_id,
+				output->mode_id_prop, blob);
+
+	return blob;
+}
+
+/*
+ * Update an output after a commit from drm_kms_atomic_set_refresh.  Adaptive
+ * sync or a refresh switch that failed is dropped, unless the crtc was busy.
+ */
+static void drm_kms_atomic_refresh_done(struct gralloc_drm_t *drm,
+		struct gralloc_drm_output *output, uint32_t blob, int ret)
+{
+	if (output->vrr_enabled_prop && !output->vrr_enabled) {
+		if (!ret) {
+			output->vrr_enabled = 1;
+			ALOGI("adaptive sync enabled on crtc %d",
+					output->crtc_id);
+		}
+		else if (ret != -EBUSY) {
+			/* not to fail every commit that follows */
+			output->vrr_enabled_prop = 0;
+			ALOGW("failed to enable adaptive sync on crtc %d: %d",
+					output->crtc_id, ret);
+		}
+	}
+
+	if (!blob || ret == -EBUSY)
+		return;
+
+	pthread_mutex_lock(&drm->outputs_mutex);
+	if (output->mode_blob == blob) {
+		if (!ret) {
+			output->mode = output->pending_mode;
+			ALOGI("crtc %d switched to %s@%d", output->crtc_id,
+					output->mode.name,
+					output->mode.vrefresh);
+		}
+		else {
+			ALOGW("failed to switch the refresh of crtc %d",
+					output->crtc_id);
+		}
+		drmModeDestroyPropertyBlob(drm->fd, blob);
+		output->mode_blob = 0;
+	}
+	pthread_mutex_unlock(&drm->outputs_mutex);
+}
+
+/*
+ * Add the primary plane of a cloned output to an atomic request, scanning
+ * out bo directly with the plane scaler.  Return an error when the output
+ * is to be blitted to instead.  A TEST_ONLY commit of the plane checks each
+ * new layout of the bo before it is used.
+ */
+static int drm_kms_atomic_scale_output(struct gralloc_drm_t *drm,
+		drmModeAtomicReqPtr req, struct gralloc_drm_output *output,
+		struct gralloc_drm_bo_t *bo)
+{
+	struct gralloc_drm_handle_t *handle = bo->handle;
+	struct gralloc_drm_plane_t *plane;
+	uint32_t x, y, w, h;
+
+	if (!drm->clone_scanout)
+		return -EINVAL;
+
+	plane = drm_kms_get_primary_plane(drm, output);
+	if (!plane)
+		return -EINVAL;
+
+	if (output->clone_width != handle->width ||
+	    output->clone_height != handle->height ||
+	    output->clone_format != handle->format ||
+	    output->clone_modifier != handle->modifier) {
+		output->clone_width = handle->width;
+		output->clone_height = handle->height;
+		output->clone_format = handle->format;
+		output->clone_modifier = handle->modifier;
+		output->scanout_clone = 0;
+	}
+
+	if (output->scanout_clone < 0)
+		return -EINVAL;
+
+	drm_kms_fit_to_output(output, handle->width, handle->height,
+			&x, &y, &w, &h);
+
+	if (!output->scanout_clone) {
+		drmModeAtomicReqPtr test = drmModeAtomicAlloc();
+		int ret = -ENOMEM;
+
+		if (test) {
+			ret = drm_kms_plane_has_modifier(plane,
+					drm_format_from_hal(handle->format),
+					handle->modifier) ? 0 : -EINVAL;
+			if (!ret)
+				ret = drm_kms_atomic_set_plane(test, plane,
+						output->crtc_id, bo->fb_id,
+						x, y, w, h,
+						0, 0, handle->width,
+						handle->height);
+			if (!ret && drmModeAtomicCommit(drm->fd, test,
+					DRM_MODE_ATOMIC_TEST_ONLY, NULL))
+				ret = -errno;
+			drmModeAtomicFree(test);
+		}
+
+		output->scanout_clone = (ret) ? -1 : 1;
+		ALOGI("crtc %d %s the %dx%d primary bo",
+				output->crtc_id,
+				(ret) ? "is blitted" : "scans out",
+				handle->width, handle->height);
+		if (ret)
+			return ret;
+	}
+
+	return drm_kms_atomic_set_plane(req, plane,
+			output->crtc_id, bo->fb_id,
+			x, y, w, h, 0, 0, handle->width, handle->height);
+}
+
+/*
+ * Schedule a flip of the primary, the cloned outputs and the overlays with
+ * a single atomic commit.
+ */
+static int drm_kms_atomic_flip(struct gralloc_drm_t *drm,
+		struct gralloc_drm_bo_t *bo)
+{
+	drmModeAtomicReqPtr req;
+	unsigned int pipes = 0;
+	uint32_t blob;
+	int scaled, ret;
+
+retry:
+	req = drmModeAtomicAlloc();
+	if (!req)
+		return -ENOMEM;
+
+	ret = drm_kms_atomic_set_output(drm, req, drm->primary, bo);
+	if (ret)
+		goto out;
+	pipes |= 1U << drm->primary->pipe;
+	blob = drm_kms_atomic_set_refresh(drm, req, drm->primary);
+
+	scaled = 0;
+	pthread_mutex_lock(&drm->outputs_mutex);
+	for (int i = 1; i < drm->output_capacity; i++) {
+		struct gralloc_drm_output *output = &drm->outputs[i];
+
+		if (!output->active || output->output_mode != DRM_OUTPUT_CLONED ||
+		    !output->bo)
+			continue;
+
+		if (!drm_kms_atomic_scale_output(drm, req, output, bo)) {
+			pipes |= 1U << output->pipe;
+			scaled = 1;
+			continue;
+		}
+
+		/* the blits read the bo */
+		drm_kms_wait_in_fence(drm);
+		drm_kms_blit_to_output(drm, output, bo);
+		if (!drm_kms_atomic_set_output(drm, req, output, output->bo))
+			pipes |= 1U << output->pipe;
+	}
+	pthread_mutex_unlock(&drm->outputs_mutex);
+
+	drm_kms_flush_blits(drm);
+
+	/* the overlays may be on other crtcs, each sending an event */
+	if (drm->planes)
+		pipes |= gralloc_drm_set_planes(drm, req, drm->primary);
+
+	/* have KMS wait for the acquire fence */
+	if (drm->in_fence >= 0) {
+		struct gralloc_drm_plane_t *plane = drm->primary->plane;
+
+		if (plane->props.in_fence_fd)
+			drmModeAtomicAddProperty(req, plane->drm_plane->plane_id,
+					plane->props.in_fence_fd, drm->in_fence);
+		else
+			drm_kms_wait_in_fence(drm);
+	}
+
+	/* signaled when the bo is on screen */
+	if (drm->out_fence && drm->primary->out_fence_ptr)
+		drmModeAtomicAddProperty(req, drm->primary->crtc_id,
+				drm->primary->out_fence_ptr,
+				(uint64_t) (uintptr_t) drm->out_fence);
+
+	drm_kms_arm_flip(drm, bo, pipes);
+	ret = drmModeAtomicCommit(drm->fd, req,
+			DRM_MODE_ATOMIC_NONBLOCK | DRM_MODE_PAGE_FLIP_EVENT,
+			(void *) drm->primary);
+	if (ret)
+		drm_kms_arm_flip(drm, NULL, 0);
+	if (ret && errno != EBUSY && scaled) {
+		/*
+		 * the scalers passed alone but not with the rest of the
+		 * commit; blit to the cloned outputs instead.  The pipes of
+		 * this try are kept, as its planes may have moved.
+		 */
+		ALOGW("failed to scan out the primary bo on cloned outputs");
+		pthread_mutex_lock(&drm->outputs_mutex);
+		for (int i = 1; i < drm->output_capacity; i++) {
+			if (drm->outputs[i].scanout_clone > 0)
+				drm->outputs[i].scanout_clone = -1;
+		}
+		pthread_mutex_unlock(&drm->outputs_mutex);
+		drmModeAtomicFree(req);
+		goto retry;
+	}
+	if (ret)
+		ret = -errno;
+	drm_kms_atomic_refresh_done(drm, drm->primary, blob, ret);
+	if (ret) {
+		ALOGE("failed to commit atomic flip (%s) (crtc %d fb %d)",
+			strerror(-ret), drm->primary->crtc_id, bo->fb_id);
+		drm_kms_stats_add(drm, (ret == -EBUSY) ?
+				&drm->stats.flip_ebusy :
+				&drm->stats.flip_errors, 1);
+		if (drm->out_fence)
+			*drm->out_fence = -1;
+	}
+	else {
+		/* KMS holds its own reference */
+		drm_kms_put_in_fence(drm);
+		drm->stats_flip_us = drm->stats_post_us;
+	}
+
+out:
+	drmModeAtomicFree(req);
+
+	return ret;
+}
+
+/*
+ * Handle the pending DRM events, or wait for the thread that is handling
+ * them.  The primary and the extended outputs may be posted to from
+ * different threads, and the events of one may be read by the other.
+ */
+static int drm_kms_handle_event(struct gralloc_drm_t *drm)
+{
+	int ret = 0;
+
+	pthread_mutex_lock(&drm->event_mutex);
+	if (drm->event_reader) {
+		while (drm->event_reader)
+			pthread_cond_wait(&drm->event_cond, &drm->event_mutex);
+	}
+	else {
+		drm->event_reader = 1;
+		pthread_mutex_unlock(&drm->event_mutex);
+
+		ret = drmHandleEvent(drm->fd, &drm->evctx);
+
+		pthread_mutex_lock(&drm->event_mutex);
+		drm->event_reader = 0;
+		pthread_cond_broadcast(&drm->event_cond);
+	}
+	pthread_mutex_unlock(&drm->event_mutex);
+
+	return ret;
+}
+
+/*
+ * Schedule a page flip.
+ */
+static int drm_kms_page_flip(struct gralloc_drm_t *drm,
+		struct gralloc_drm_bo_t *bo)
+{
+	struct gralloc_drm_bo_t *prev;
+	int ret;
+
+	/* there is another flip pending */
+	while (drm->next_front) {
+		uint64_t start = drm_kms_stats_now(drm);
+
+		drm->waiting_flip = 1;
+		ret = drm_kms_handle_event(drm);
+		drm->waiting_flip = 0;
+		drm_kms_stats_record(drm, &drm->stats.handle_event, start);
+		/* the events may be of the other crtcs */
+		if (!ret)
+			continue;
+		pthread_mutex_lock(&drm->event_mutex);
+		prev = NULL;
+		if (drm->next_front) {
+			/* record an error and break */
+			ALOGE("drmHandleEvent returned without flipping");
+			prev = drm_kms_set_front(drm, drm->next_front);
+			drm->next_front = NULL;
+			drm->flip_pipes = 0;
+			drm->flip_count++;
+		}
+		pthread_mutex_unlock(&drm->event_mutex);
+		if (prev)
+			gralloc_drm_bo_decref(prev);
+	}
+
+	if (!bo)
+		return 0;
+
+	/*
+	 * a failed commit fails only this frame; legacy KMS is picked at
+	 * init, when the atomic cap or props are missing
+	 */
+	if (drm->swap_mode == DRM_SWAP_ATOMIC)
+		return drm_kms_atomic_flip(drm, bo);
+
+	drm_kms_wait_in_fence(drm);
+
+	pthread_mutex_lock(&drm->outputs_mutex);
+	drm_kms_blit_to_mirror_connectors(drm, bo);
+	pthread_mutex_unlock(&drm->outputs_mutex);
+
+	/* set planes to be displayed */
+	gralloc_drm_set_planes(drm, NULL, drm->primary);
+
+	drm_kms_arm_flip(drm, bo, 1U << drm->primary->pipe);
+	ret = drmModePageFlip(drm->fd, drm->primary->crtc_id, bo->fb_id,
+			DRM_MODE_PAGE_FLIP_EVENT, (void *) drm->primary);
+	if (ret) {
+		drm_kms_arm_flip(drm, NULL, 0);
+		ALOGE("failed to perform page flip for primary (%s) (crtc %d fb %d))",
+			strerror(errno), drm->primary->crtc_id, bo->fb_id);
+		drm_kms_stats_add(drm, (errno == EBUSY) ?
+				&drm->stats.flip_ebusy :
+				&drm->stats.flip_errors, 1);
+		/* try to set mode for next frame */
+		if (errno != EBUSY)
+			drm->first_post = 1;
+	}
+	else {
+		drm->stats_flip_us = drm->stats_post_us;
+	}
+
+	return ret;
+}
+
+/*
+ * Return the refresh period of the primary in nanoseconds, or 0.
+ */
+static uint64_t drm_kms_vblank_period(const struct gralloc_drm_t *drm)
+{
+	const drmModeModeInfo *mode = &drm->primary->mode;
+
+	if (!mode->clock)
+		return 0;
+
+	return (uint64_t) mode->htotal * mode->vtotal * 1000000 / mode->clock;
+}
+
+/*
+ * Predict the time in us of a vblank of the primary from the phase of the
+ * last flip.  Return 0 when the phase is not known.
+ */
+static uint64_t drm_kms_vblank_time(const struct gralloc_drm_t *drm,
+		unsigned int sequence)
+{
+	int64_t period = (int64_t) drm_kms_vblank_period(drm);
+	int64_t delta = (int) (sequence - drm->vblank_seq);
+
+	/* adaptive sync has no vblank cadence */
+	if (!drm->vblank_us || !period || drm->primary->vrr_enabled)
+		return 0;
+
+	return (uint64_t) ((int64_t) drm->vblank_us + delta * period / 1000);
+}
+
+/*
+ * Predict the sequence of the last vblank of the primary at or before a
+ * time in us.  Return -EAGAIN when the phase of the vblanks is not known.
+ */
+static int drm_kms_predict_vblank(const struct gralloc_drm_t *drm,
+		uint64_t us, unsigned int *sequence)
+{
+	int64_t period = (int64_t) drm_kms_vblank_period(drm);
+	int64_t delta, count;
+
+	if (!drm->vblank_us || !period || drm->primary->vrr_enabled)
+		return -EAGAIN;
+
+	delta = ((int64_t) us - (int64_t) drm->vblank_us) * 1000;
+	count = (delta >= 0) ? delta / period : -((-delta + period - 1) / period);
+	*sequence = drm->vblank_seq + (unsigned int) count;
+
+	return 0;
+}
+
+static void drm_kms_sleep_until(uint64_t us)
+{
+	struct timespec ts;
+
+	ts.tv_sec = us / 1000000;
+	ts.tv_nsec = (us % 1000000) * 1000;
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+		;
+}
+
+/* presents are scheduled no more than this far ahead */
+#define DRM_PRESENT_MAX_WAIT_US 1000000
+
+/*
+ * Wait until a post can be flipped to be shown at its target.  As a flip is
+ * shown at the vblank after it is scheduled, this is some time after the
+ * vblank before the target.  The time is predicted from the phase of the
+ * vblanks when it is known, without a round trip, and waited for with
+ * drmWaitVBlank otherwise.
+ */
+static void drm_kms_wait_for_target(struct gralloc_drm_t *drm,
+		const struct gralloc_drm_post *post)
+{
+	uint64_t period = drm_kms_vblank_period(drm) / 1000;
+	uint64_t now = drm_kms_now(), wake;
+	unsigned int target;
+	drmVBlank vbl;
+
+	switch (post->target_type) {
+	case GRALLOC_DRM_PRESENT_VBLANK:
+		target = (unsigned int) post->target;
+		break;
+	case GRALLOC_DRM_PRESENT_TIME:
+		/* with adaptive sync, a flip is shown as soon as it is made */
+		if (drm->primary->vrr_enabled) {
+			if (post->target > now)
+				drm_kms_sleep_until(MIN(post->target,
+						now + DRM_PRESENT_MAX_WAIT_US));
+			return;
+		}
+
+		/* the vblank nearest the time */
+		if (!drm_kms_predict_vblank(drm, post->target + period / 2,
+					&target))
+			break;
+
+		/* no flip yet to tell the phase */
+		if (post->target > now + period)
+			drm_kms_sleep_until(MIN(post->target - period,
+					now + DRM_PRESENT_MAX_WAIT_US));
+		return;
+	default:
+		return;
+	}
+
+	wake = drm_kms_vblank_time(drm, target - 1);
+	if (wake) {
+		/* a little after the vblank, to not race with it */
+		wake += period / 8;
+		if (wake > now)
+			drm_kms_sleep_until(MIN(wake,
+					now + DRM_PRESENT_MAX_WAIT_US));
+		return;
+	}
+
+	memset(&vbl, 0, sizeof(vbl));
+	vbl.request.type = DRM_VBLANK_ABSOLUTE;
+	if (drm->vblank_secondary)
+		vbl.request.type |= DRM_VBLANK_SECONDARY;
+	vbl.request.sequence = target - 1;
+	if (drmWaitVBlank(drm->fd, &vbl))
+		ALOGW("failed to wait for vblank %u", target - 1);
+}
+
+/*
+ * Wait for the next post.
+ */
+static void drm_kms_wait_for_post(struct gralloc_drm_t *drm, int flip)
+{
+	uint64_t start = drm_kms_stats_now(drm);
+	unsigned int current, target, wanted;
+	drmVBlank vbl;
+	int ret;
+
+	if (drm->mode_quirk_vmwgfx)
+		return;
+
+	flip = !!flip;
+
+	/*
+	 * with adaptive sync, the vblanks follow the flips; the swap
+	 * interval is kept in time from the last flip
+	 */
+	if (flip && drm->primary->vrr_enabled) {
+		uint64_t period = drm_kms_vblank_period(drm) / 1000;
+
+		if (!drm->first_post && drm->vblank_us)
+			drm_kms_sleep_until(drm->vblank_us +
+					period * drm->swap_interval);
+		drm_kms_stats_record(drm, &drm->stats.wait_for_post, start);
+		return;
+	}
+
+	memset(&vbl, 0, sizeof(vbl));
+	vbl.request.type = DRM_VBLANK_RELATIVE;
+	if (drm->vblank_secondary)
+		vbl.request.type |= DRM_VBLANK_SECONDARY;
+	vbl.request.sequence = 0;
+
+	/* get the current vblank, predicted from the last flip when known */
+	if (flip && !drm->first_post &&
+	    !drm_kms_predict_vblank(drm, drm_kms_now(), &current)) {
+		vbl.reply.sequence = current;
+	}
+	else {
+		ret = drmWaitVBlank(drm->fd, &vbl);
+		if (ret) {
+			ALOGW("failed to get vblank");
+			goto out;
+		}
+	}
+
+	current = vbl.reply.sequence;
+	if (drm->first_post)
+		target = current;
+	else
+		target = drm->last_swap + drm->swap_interval - flip;
+	wanted = target;
+
+	/* wait for vblank; the counters wrap around */
+	if ((int32_t) (current - target) < 0 || !flip) {
+		memset(&vbl, 0, sizeof(vbl));
+		vbl.request.type = DRM_VBLANK_ABSOLUTE;
+		if (drm->vblank_secondary)
+			vbl.request.type |= DRM_VBLANK_SECONDARY;
+		if (!flip) {
+			vbl.request.type |= DRM_VBLANK_NEXTONMISS;
+			if ((int32_t) (target - current) < 0)
+				target = current;
+		}
+
+		vbl.request.sequence = target;
+
+		ret = drmWaitVBlank(drm->fd, &vbl);
+		if (ret) {
+			ALOGW("failed to wait vblank");
+			goto out;
+		}
+	}
+
+	/* the vblank that was wanted has passed already */
+	if (!drm->first_post && (int32_t) (vbl.reply.sequence - wanted) > 0)
+		drm_kms_stats_add(drm, &drm->stats.missed_vblanks,
+				vbl.reply.sequence - wanted);
+
+	drm->last_swap = vbl.reply.sequence + flip;
+
+out:
+	drm_kms_stats_record(drm, &drm->stats.wait_for_post, start);
+}
+
+/*
+ * Add a rect to the damage, merging it with the rects it touches.  The
+ * damage collapses to its bounding box when it runs out of rects.
+ */
+static void drm_kms_damage_add(struct gralloc_drm_damage *damage,
+		drmModeClip clip)
+{
+	int i = 0;
+
+	while (i < damage->count) {
+		drmModeClip *r = &damage->rects[i];
+
+		if (clip.x1 > r->x2 || r->x1 > clip.x2 ||
+		    clip.y1 > r->y2 || r->y1 > clip.y2) {
+			i++;
+			continue;
+		}
+
+		clip.x1 = MIN(clip.x1, r->x1);
+		clip.y1 = MIN(clip.y1, r->y1);
+		clip.x2 = MAX(clip.x2, r->x2);
+		clip.y2 = MAX(clip.y2, r->y2);
+
+		/* the grown rect may touch those checked already */
+		*r = damage->rects[--damage->count];
+		i = 0;
+	}
+
+	if (damage->count == DRM_DAMAGE_MAX) {
+		for (i = 0; i < damage->count; i++) {
+			drmModeClip *r = &damage->rects[i];
+
+			clip.x1 = MIN(clip.x1, r->x1);
+			clip.y1 = MIN(clip.y1, r->y1);
+			clip.x2 = MAX(clip.x2, r->x2);
+			clip.y2 = MAX(clip.y2, r->y2);
+		}
+		damage->count = 0;
+	}
+
+	damage->rects[damage->count++] = clip;
+}
+
+/*
+ * Set the damage of the next post, relative to the previous post.  The rects
+ * are clamped to the primary output, and no rects mean the whole surface.
+ */
+int gralloc_drm_set_damage(struct gralloc_drm_t *drm,
+		const struct gralloc_drm_rect *rects, int count)
+{
+	struct gralloc_drm_damage damage;
+	int width, height, i;
+
+	if (!drm->primary)
+		return -EINVAL;
+
+	width = drm->primary->mode.hdisplay;
+	height = drm->primary->mode.vdisplay;
+
+	damage.count = 0;
+	for (i = 0; rects && i < count; i++) {
+		drmModeClip clip;
+
+		clip.x1 = MAX(rects[i].left, 0);
+		clip.y1 = MAX(rects[i].top, 0);
+		clip.x2 = MIN(rects[i].right, width);
+		clip.y2 = MIN(rects[i].bottom, height);
+		if (clip.x1 >= clip.x2 || clip.y1 >= clip.y2)
+			continue;
+
+		drm_kms_damage_add(&damage, clip);
+	}
+
+	/* a damage covering the surface is the same as no damage */
+	if (damage.count == 1 &&
+	    damage.rects[0].x1 == 0 && damage.rects[0].y1 == 0 &&
+	    damage.rects[0].x2 == width && damage.rects[0].y2 == height)
+		damage.count = 0;
+
+	drm->damage = damage;
+
+	return 0;
+}
+
+/*
+ * Copy the damaged region of a bo to the front buffer that stays on screen.
+ */
+static int drm_kms_copy_damage(struct gralloc_drm_t *drm,
+		struct gralloc_drm_bo_t *bo,
+		const struct gralloc_drm_damage *damage)
+{
+	struct gralloc_drm_bo_t *dst = drm->current_front;
+	int width = MIN(bo->handle->width, dst->handle->width);
+	int height = MIN(bo->handle->height, dst->handle->height);
+	drmModeClip clips[DRM_DAMAGE_MAX];
+	int count = 0, i;
+
+	for (i = 0; i < damage->count; i++) {
+		drmModeClip clip = damage->rects[i];
+
+		clip.x2 = MIN(clip.x2, width);
+		clip.y2 = MIN(clip.y2, height);
+		if (clip.x1 >= clip.x2 || clip.y1 >= clip.y2)
+			continue;
+
+		gralloc_drm_blit(drm, dst, bo,
+				clip.x1, clip.y1, clip.x2, clip.y2,
+				clip.x1, clip.y1, clip.x2, clip.y2);
+		clips[count++] = clip;
+	}
+
+	if (!damage->count) {
+		gralloc_drm_blit(drm, dst, bo, 0, 0,
+				bo->handle->width,
+				bo->handle->height,
+				0, 0,
+				bo->handle->width,
+				bo->handle->height);
+	}
+
+	drm_kms_flush_blits(drm);
+
+	if (drm->mode_quirk_vmwgfx) {
+		if (damage->count) {
+			if (count)
+				drmModeDirtyFB(drm->fd, dst->fb_id,
+						clips, count);
+		}
+		else {
+			drmModeDirtyFB(drm->fd, dst->fb_id, &drm->clip, 1);
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Post a bo with the given damage.
+ */
+static int drm_kms_post(const struct gralloc_drm_post *post,
+		int *present_fence)
+{
+	struct gralloc_drm_bo_t *bo = post->bo;
+	const struct gralloc_drm_damage *damage = &post->damage;
+	struct gralloc_drm_t *drm = bo->drm;
+	struct gralloc_drm_bo_t *prev;
+	int ret;
+
+	drm->in_fence = post->acquire_fence;
+	drm->out_fence = present_fence;
+	if (present_fence)
+		*present_fence = -1;
+
+	if (!bo->fb_id && drm->swap_mode != DRM_SWAP_COPY) {
+		ALOGE("unable to post bo %p without fb", bo);
+		drm_kms_put_in_fence(drm);
+		drm->out_fence = NULL;
+		return -EINVAL;
+	}
+
+	drm->stats_post_us = drm_kms_stats_now(drm);
+	drm_kms_stats_add(drm, &drm->stats.posts, 1);
+
+	/* only an atomic flip can have KMS wait for the fence */
+	if (drm->first_post || drm->swap_mode != DRM_SWAP_ATOMIC)
+		drm_kms_wait_in_fence(drm);
+
+	if (drm->first_post) {
+		if (drm->swap_mode == DRM_SWAP_COPY) {
+			struct gralloc_drm_bo_t *dst;
+
+			dst = (drm->next_front) ?
+				drm->next_front :
+				drm->current_front;
+			gralloc_drm_blit(drm, dst, bo, 0, 0,
+					bo->handle->width,
+					bo->handle->height,
+					0, 0,
+					bo->handle->width,
+					bo->handle->height);
+			drm_kms_flush_blits(drm);
+			bo = dst;
+		}
+
+		ret = drm_kms_set_crtc(drm, drm->primary, bo->fb_id);
+		if (!ret) {
+			drm->first_post = 0;
+			pthread_mutex_lock(&drm->event_mutex);
+			prev = drm_kms_set_front(drm, bo);
+			if (drm->next_front == bo)
+				drm->next_front = NULL;
+			pthread_mutex_unlock(&drm->event_mutex);
+			if (prev)
+				gralloc_drm_bo_decref(prev);
+		}
+
+		pthread_mutex_lock(&drm->outputs_mutex);
+		for (int i = 1; i < drm->output_capacity; i++) {
+			struct gralloc_drm_output *output = &drm->outputs[i];
+			if (output->active && output->output_mode == DRM_OUTPUT_CLONED && output->bo)
+				drm_kms_set_crtc(drm, output, output->bo->fb_id);
+		}
+		pthread_mutex_unlock(&drm->outputs_mutex);
+
+		drm->out_fence = NULL;
+
+		return ret;
+	}
+
+	switch (drm->swap_mode) {
+	case DRM_SWAP_ATOMIC:
+	case DRM_SWAP_FLIP:
+		/* a target was waited for instead */
+		if (drm->swap_interval > 1 &&
+		    post->target_type == GRALLOC_DRM_PRESENT_ASAP)
+			drm_kms_wait_for_post(drm, 1);
+		ret = drm_kms_page_flip(drm, bo);
+		if (drm->next_front) {
+			/*
+			 * wait if the driver says so, unless the caller waits
+			 * for the present fence, or the current front will be
+			 * written by CPU
+			 */
+			if ((drm->mode_sync_flip &&
+			     !(present_fence && *present_fence >= 0)) ||
+				(drm->current_front->handle->usage &
+				 GRALLOC_USAGE_SW_WRITE_MASK))
+				drm_kms_page_flip(drm, NULL);
+		}
+		break;
+	case DRM_SWAP_COPY:
+		drm_kms_wait_for_post(drm, 0);
+		ret = drm_kms_copy_damage(drm, bo, damage);
+		break;
+	case DRM_SWAP_SETCRTC:
+		drm_kms_wait_for_post(drm, 0);
+		ret = drm_kms_set_crtc(drm, drm->primary, bo->fb_id);
+
+		pthread_mutex_lock(&drm->outputs_mutex);
+		for (int i = 1; i < drm->output_capacity; i++) {
+			struct gralloc_drm_output *output = &drm->outputs[i];
+			if (output->active && output->output_mode == DRM_OUTPUT_CLONED && output->bo)
+				drm_kms_set_crtc(drm, output, output->bo->fb_id);
+		}
+		pthread_mutex_unlock(&drm->outputs_mutex);
+
+		pthread_mutex_lock(&drm->event_mutex);
+		prev = drm_kms_set_front(drm, bo);
+		pthread_mutex_unlock(&drm->event_mutex);
+		if (prev)
+			gralloc_drm_bo_decref(prev);
+		break;
+	default:
+		/* no-op */
+		ret = 0;
+		break;
+	}
+
+	if ((unsigned int) drm->swap_mode < GRALLOC_DRM_STATS_SWAP_MODES)
+		drm_kms_stats_record(drm,
+				&drm->stats.swap_modes[drm->swap_mode],
+				drm->stats_post_us);
+
+	/* not shown, or waited for already */
+	drm_kms_put_in_fence(drm);
+	drm->out_fence = NULL;
+
+	/* the fbs of freed bos are off the screen after a flip */
+	drm_kms_fb_reap(drm, NULL);
+
+	return ret;
+}
+
+/*
+ * Post a bo with the damage set by gralloc_drm_set_damage.  This is not
+ * thread-safe.
+ */
+int gralloc_drm_bo_post(struct gralloc_drm_bo_t *bo)
+{
+	struct gralloc_drm_t *drm = bo->drm;
+	struct gralloc_drm_post post;
+
+	post.bo = bo;
+	post.damage = drm->damage;
+	post.acquire_fence = -1;
+	post.target_type = GRALLOC_DRM_PRESENT_ASAP;
+	post.target = 0;
+	drm->damage.count = 0;
+
+	return drm_kms_post(&post, NULL);
+}
+
+/*
+ * Release a bo that is no longer on screen.  Called from the post thread
+ * without post_mutex held.
+ */
+static void drm_kms_post_release(struct gralloc_drm_t *drm,
+		struct gralloc_drm_bo_t *bo)
+{
+	if (drm->post_release)
+		drm->post_release(drm->post_release_data,
+				gralloc_drm_bo_get_handle(bo, NULL));
+	gralloc_drm_bo_decref(bo);
+
+	pthread_mutex_lock(&drm->post_mutex);
+	drm->post_pending--;
+	pthread_cond_broadcast(&drm->post_cond);
+	pthread_mutex_unlock(&drm->post_mutex);
+}
+
+/*
+ * Thread that posts the queued bos, at their targets.  It is the only thread
+ * posting to the primary while the post queue is enabled.
+ */
+static void *drm_kms_post_thread(void *data)
+{
+	struct gralloc_drm_t *drm = (struct gralloc_drm_t *) data;
+	struct gralloc_drm_bo_t *shown[DRM_POST_QUEUE_MAX + 1];
+	int shown_count = 0, i, j;
+
+	while (1) {
+		struct gralloc_drm_post post;
+		struct gralloc_drm_bo_t *bo;
+
+		pthread_mutex_lock(&drm->post_mutex);
+		while (!drm->post_count && !drm->post_exit)
+			pthread_cond_wait(&drm->post_cond, &drm->post_mutex);
+		if (!drm->post_count) {
+			pthread_mutex_unlock(&drm->post_mutex);
+			break;
+		}
+
+		post = drm->post_queue[drm->post_head];
+		drm->post_head = (drm->post_head + 1) % DRM_POST_QUEUE_MAX;
+		drm->post_count--;
+		pthread_mutex_unlock(&drm->post_mutex);
+
+		bo = post.bo;
+		drm_kms_wait_for_target(drm, &post);
+		if (drm_kms_post(&post, NULL))
+			ALOGE("failed to post queued bo %p", bo);
+
+		/* release the bos that have left the screen */
+		shown[shown_count++] = bo;
+		for (i = 0, j = 0; i < shown_count; i++) {
+			if (shown[i] == drm->current_front ||
+			    shown[i] == drm->next_front)
+				shown[j++] = shown[i];
+			else
+				drm_kms_post_release(drm, shown[i]);
+		}
+		shown_count = j;
+	}
+
+	/* wait for the last flip before releasing */
+	if (drm->swap_mode == DRM_SWAP_FLIP ||
+	    drm->swap_mode == DRM_SWAP_ATOMIC)
+		drm_kms_page_flip(drm, NULL);
+
+	for (i = 0; i < shown_count; i++)
+		drm_kms_post_release(drm, shown[i]);
+
+	return NULL;
+}
 
-		/* if plane is available and can support this buffer */
-		if (!plane->active &&
-			drm_handle->plane_mask &
-			(1U << plane->drm_plane->plane_id)) {
-
-			plane->dst_x = dst_x;
-			plane->dst_y = dst_y;
-			plane->dst_w = dst_w;
-			plane->dst_h = dst_h;
-			plane->src_x = src_x;
-			plane->src_y = src_y;
-			plane->src_w = src_w;
-			plane->src_h = src_h;
-			plane->handle = handle;
-			plane->id = id;
-			plane->active = 1;
+/*
+ * Start the post queue if debug.drm.post_queue is set.  Its value is the
+ * number of bos that may be posted but not yet released, that is, queued,
+ * waiting for a flip, or on screen.  Values greater than 1 need as many
+ * framebuffers plus one for posting to not block.
+ */
+static void drm_kms_init_post_queue(struct gralloc_drm_t *drm)
+{
+	int size;
 
-			return 0;
-		}
+	size = property_get_int32("debug.drm.post_queue", 0);
+	if (size <= 0 || drm->swap_mode == DRM_SWAP_NOOP)
+		return;
+	if (size > DRM_POST_QUEUE_MAX - 1)
+		size = DRM_POST_QUEUE_MAX - 1;
+
+	pthread_mutex_init(&drm->post_mutex, NULL);
+	pthread_cond_init(&drm->post_cond, NULL);
+	drm->post_head = 0;
+	drm->post_count = 0;
+	drm->post_pending = 0;
+	drm->post_exit = 0;
+
+	if (pthread_create(&drm->post_thread, NULL, drm_kms_post_thread, drm)) {
+		ALOGE("failed to create post thread");
+		pthread_cond_destroy(&drm->post_cond);
+		pthread_mutex_destroy(&drm->post_mutex);
+		return;
 	}
 
-	/* no free planes available */
-	return -EBUSY;
+	drm->post_queue_size = size;
+	ALOGD("will queue up to %d bos for posting", size);
 }
 
 /*
- * Interface for HWC, used to disable all the overlays. Plane id
- * is also set to 0 as it should be mappable to a particular layer only
- * if it has been reserved with 'reserve_plane'.
+ * Stop the post thread after it has posted the queued bos.
  */
-void gralloc_drm_disable_planes(struct gralloc_drm_t *drm)
+static void drm_kms_fini_post_queue(struct gralloc_drm_t *drm)
 {
-	struct gralloc_drm_plane_t *plane = drm->planes;
-	unsigned int i;
+	if (!drm->post_queue_size)
+		return;
 
-	for (i = 0; i < drm->plane_resources->count_planes; i++, plane++) {
-		plane->active = 0;
-		plane->id = 0;
+	pthread_mutex_lock(&drm->post_mutex);
+	drm->post_exit = 1;
+	pthread_cond_broadcast(&drm->post_cond);
+	pthread_mutex_unlock(&drm->post_mutex);
+
+	pthread_join(drm->post_thread, NULL);
+
+	pthread_cond_destroy(&drm->post_cond);
+	pthread_mutex_destroy(&drm->post_mutex);
+	drm->post_queue_size = 0;
+}
+
+/*
+ * Queue a post, or post the bo directly when the post queue is disabled.
+ */
+static int drm_kms_queue_post(struct gralloc_drm_bo_t *bo,
+		int acquire_fence, int *present_fence,
+		int target_type, uint64_t target)
+{
+	struct gralloc_drm_t *drm = bo->drm;
+	struct gralloc_drm_post *post;
+
+	if (!drm->post_queue_size) {
+		struct gralloc_drm_post direct;
+
+		direct.bo = bo;
+		direct.damage = drm->damage;
+		direct.acquire_fence = acquire_fence;
+		direct.target_type = target_type;
+		direct.target = target;
+		drm->damage.count = 0;
+
+		drm_kms_wait_for_target(drm, &direct);
+
+		return drm_kms_post(&direct, present_fence);
+	}
+
+	if (present_fence)
+		*present_fence = -1;
+
+	if (!bo->fb_id && drm->swap_mode != DRM_SWAP_COPY) {
+		ALOGE("unable to post bo %p without fb", bo);
+		if (acquire_fence >= 0)
+			close(acquire_fence);
+		return -EINVAL;
 	}
+
+	gralloc_drm_bo_incref(bo);
+
+	pthread_mutex_lock(&drm->post_mutex);
+
+	post = &drm->post_queue[(drm->post_head + drm->post_count) %
+		DRM_POST_QUEUE_MAX];
+	post->bo = bo;
+	post->damage = drm->damage;
+	post->acquire_fence = acquire_fence;
+	post->target_type = target_type;
+	post->target = target;
+	drm->damage.count = 0;
+	drm->post_count++;
+	drm->post_pending++;
+	pthread_cond_broadcast(&drm->post_cond);
+
+	/* back-pressure */
+	while (drm->post_pending > drm->post_queue_size)
+		pthread_cond_wait(&drm->post_cond, &drm->post_mutex);
+
+	pthread_mutex_unlock(&drm->post_mutex);
+
+	return 0;
 }
 
 /*
- * Interface for HWC, used to change handle of a reserved plane.
+ * Queue a bo for posting.  It returns once the bo is queued and no more than
+ * post_queue_size bos are in flight, and posts the bo directly when the post
+ * queue is disabled.  The bo is referenced until it has left the screen, when
+ * the post release callback is called.
+ *
+ * The bo is shown after acquire_fence, which is owned by the post and may be
+ * -1, signals.  When present_fence is not NULL, it is set to a fence that
+ * signals once the bo is on screen, or to -1 when there is none, as is always
+ * the case for queued posts.
  */
-int gralloc_drm_set_plane_handle(struct gralloc_drm_t *drm,
-	uint32_t id, buffer_handle_t handle)
+int gralloc_drm_bo_queue_post(struct gralloc_drm_bo_t *bo,
+		int acquire_fence, int *present_fence)
 {
-	struct gralloc_drm_plane_t *plane = drm->planes;
-	unsigned i;
+	return drm_kms_queue_post(bo, acquire_fence, present_fence,
+			GRALLOC_DRM_PRESENT_ASAP, 0);
+}
 
-	for (i = 0; i < drm->plane_resources->count_planes; i++, plane++)
-		if (plane->active && plane->id == id) {
-			plane->handle = handle;
-			return 0;
-		}
+/*
+ * Queue a bo to be shown on the primary at a target vblank sequence or
+ * CLOCK_MONOTONIC time, as GRALLOC_DRM_PRESENT_* tells.  With the post queue
+ * enabled, the target and the vblanks are waited for by the post thread, and
+ * this blocks only when the queue is full.  Otherwise the bo is posted
+ * directly, once the target is near.  The present callback tells when the
+ * bo is shown.
+ */
+int gralloc_drm_bo_present(struct gralloc_drm_bo_t *bo, int acquire_fence,
+		int target_type, uint64_t target)
+{
+	if (target_type < GRALLOC_DRM_PRESENT_ASAP ||
+	    target_type > GRALLOC_DRM_PRESENT_TIME) {
+		if (acquire_fence >= 0)
+			close(acquire_fence);
+		return -EINVAL;
+	}
 
-	return -EINVAL;
+	return drm_kms_queue_post(bo, acquire_fence, NULL,
+			target_type, target);
 }
 
-static int drm_kms_blit_to_mirror_connectors(struct gralloc_drm_t *drm, struct gralloc_drm_bo_t *bo)
+/*
+ * Set the callback for bos flipped on the primary.
+ */
+void gralloc_drm_set_present_callback(struct gralloc_drm_t *drm,
+		gralloc_drm_present_t callback, void *data)
 {
-	int ret = 0;
-	for (int i = 1; i < drm->output_capacity; i++) {
-		struct gralloc_drm_output *output = &drm->outputs[i];
+	drm->present = callback;
+	drm->present_data = data;
+}
 
-		if (output->active && output->output_mode == DRM_OUTPUT_CLONED && output->bo) {
+/*
+ * Set the swap interval of the primary, up to swap_interval_max.
+ */
+int gralloc_drm_set_swap_interval(struct gralloc_drm_t *drm, int interval)
+{
+	if (interval < 0 || interval > drm->swap_interval_max)
+		return -EINVAL;
 
-			int dst_x1 = 0, dst_y1 = 0;
+	drm->swap_interval = interval;
 
-			if (output->bo->handle->width > bo->handle->width)
-				dst_x1 = (output->bo->handle->width - bo->handle->width) / 2;
-			if (output->bo->handle->height > bo->handle->height)
-				dst_y1 = (output->bo->handle->height - bo->handle->height) / 2;
+	return 0;
+}
 
-			drm->drv->blit(drm->drv, output->bo, bo,
-					dst_x1, dst_y1,
-					dst_x1 + bo->handle->width,
-					dst_y1 + bo->handle->height,
-					0, 0, bo->handle->width, bo->handle->height);
 
-			ret = drmModePageFlip(drm->fd, output->crtc_id, output->bo->fb_id, 0, NULL);
-			if (ret && errno != EBUSY)
-				ALOGE("failed to perform page flip for output (%s) (crtc %d fb %d))",
-						strerror(errno), output->crtc_id, output->bo->fb_id);
-		}
+/*
+ * Set the callback for bos released by the post queue.
+ */
+void gralloc_drm_set_post_release(struct gralloc_drm_t *drm,
+		gralloc_drm_post_release_t callback, void *data)
+{
+	drm->post_release = callback;
+	drm->post_release_data = data;
+}
+
+/*
+ * Return the drmWaitVBlank type bits of the crtc of a pipe.
+ */
+static unsigned int drm_kms_vblank_crtc(unsigned int pipe)
+{
+	if (pipe == 1)
+		return DRM_VBLANK_SECONDARY;
+
+	return (pipe << DRM_VBLANK_HIGH_CRTC_SHIFT) & DRM_VBLANK_HIGH_CRTC_MASK;
+}
+
+/*
+ * Wait for the pending flip of an extended output.
+ */
+static void drm_kms_wait_output_flip(struct gralloc_drm_t *drm,
+		struct gralloc_drm_output *output)
+{
+	pthread_mutex_lock(&drm->event_mutex);
+	while (output->next_front) {
+		struct gralloc_drm_bo_t *prev;
+		int ret;
+
+		pthread_mutex_unlock(&drm->event_mutex);
+		ret = drm_kms_handle_event(drm);
+		pthread_mutex_lock(&drm->event_mutex);
+
+		if (!ret || !output->next_front)
+			continue;
+
+		/* record an error and break */
+		ALOGE("drmHandleEvent returned without flipping crtc %d",
+				output->crtc_id);
+		prev = drm_kms_ack_output_flip(output, output->last_swap);
+		pthread_mutex_unlock(&drm->event_mutex);
+		if (prev)
+			gralloc_drm_bo_decref(prev);
+		pthread_mutex_lock(&drm->event_mutex);
 	}
+	pthread_mutex_unlock(&drm->event_mutex);
+}
 
-	return ret;
+/*
+ * Show a bo on an extended output right away.
+ */
+static int drm_kms_set_output_front(struct gralloc_drm_t *drm,
+		struct gralloc_drm_output *output, struct gralloc_drm_bo_t *bo)
+{
+	struct gralloc_drm_bo_t *prev;
+	int ret;
+
+	ret = drm_kms_set_crtc(drm, output, bo->fb_id);
+	if (ret)
+		return ret;
+
+	gralloc_drm_bo_incref(bo);
+
+	pthread_mutex_lock(&drm->event_mutex);
+	prev = output->current_front;
+	output->current_front = bo;
+	output->first_post = 0;
+	pthread_mutex_unlock(&drm->event_mutex);
+
+	if (prev)
+		gralloc_drm_bo_decref(prev);
+
+	return 0;
 }
 
 /*
- * Schedule a page flip.
+ * Schedule a flip of an extended output, with the planes of the output.
+ * event_mutex is held over the commit so that the event is not handled
+ * before next_front is set.
  */
-static int drm_kms_page_flip(struct gralloc_drm_t *drm,
-		struct gralloc_drm_bo_t *bo)
+static int drm_kms_flip_output(struct gralloc_drm_t *drm,
+		struct gralloc_drm_output *output, struct gralloc_drm_bo_t *bo,
+		int acquire_fence, int *present_fence)
 {
+	drmModeAtomicReqPtr req = NULL;
+	uint32_t blob = 0;
 	int ret;
 
-	/* there is another flip pending */
-	while (drm->next_front) {
-		drm->waiting_flip = 1;
-		drmHandleEvent(drm->fd, &drm->evctx);
-		drm->waiting_flip = 0;
-		if (drm->next_front) {
-			/* record an error and break */
-			ALOGE("drmHandleEvent returned without flipping");
-			drm->current_front = drm->next_front;
-			drm->next_front = NULL;
+	if (drm->swap_mode == DRM_SWAP_ATOMIC) {
+		struct gralloc_drm_plane_t *plane;
+
+		req = drmModeAtomicAlloc();
+		if (!req)
+			return -ENOMEM;
+
+		ret = drm_kms_atomic_set_output(drm, req, output, bo);
+		if (ret)
+			goto out;
+		gralloc_drm_set_planes(drm, req, output);
+		blob = drm_kms_atomic_set_refresh(drm, req, output);
+
+		plane = drm_kms_get_primary_plane(drm, output);
+		if (acquire_fence >= 0 && plane->props.in_fence_fd) {
+			drmModeAtomicAddProperty(req, plane->drm_plane->plane_id,
+					plane->props.in_fence_fd, acquire_fence);
+			acquire_fence = -1;
 		}
+		if (present_fence && output->out_fence_ptr)
+			drmModeAtomicAddProperty(req, output->crtc_id,
+					output->out_fence_ptr,
+					(uint64_t) (uintptr_t) present_fence);
+	}
+	else {
+		gralloc_drm_set_planes(drm, NULL, output);
 	}
 
-	if (!bo)
-		return 0;
+	if (acquire_fence >= 0 &&
+	    gralloc_drm_wait_fence(acquire_fence, DRM_FENCE_TIMEOUT))
+		ALOGW("failed to wait for acquire fence %d", acquire_fence);
 
-	pthread_mutex_lock(&drm->outputs_mutex);
-	drm_kms_blit_to_mirror_connectors(drm, bo);
-	pthread_mutex_unlock(&drm->outputs_mutex);
+	pthread_mutex_lock(&drm->event_mutex);
+	if (req)
+		ret = drmModeAtomicCommit(drm->fd, req,
+				DRM_MODE_ATOMIC_NONBLOCK |
+				DRM_MODE_PAGE_FLIP_EVENT, (void *) output);
+	else
+		ret = drmModePageFlip(drm->fd, output->crtc_id, bo->fb_id,
+				DRM_MODE_PAGE_FLIP_EVENT, (void *) output);
+	if (!ret) {
+		gralloc_drm_bo_incref(bo);
+		output->next_front = bo;
+	}
+	else {
+		ret = -errno;
+	}
+	pthread_mutex_unlock(&drm->event_mutex);
 
-	/* set planes to be displayed */
-	gralloc_drm_set_planes(drm);
+	if (req)
+		drm_kms_atomic_refresh_done(drm, output, blob, ret);
 
-	ret = drmModePageFlip(drm->fd, drm->primary->crtc_id, bo->fb_id,
-			DRM_MODE_PAGE_FLIP_EVENT, (void *) drm);
 	if (ret) {
-		ALOGE("failed to perform page flip for primary (%s) (crtc %d fb %d))",
-			strerror(errno), drm->primary->crtc_id, bo->fb_id);
+		ALOGE("failed to flip crtc %d (%s) (fb %d)",
+				output->crtc_id, strerror(-ret), bo->fb_id);
+		drm_kms_stats_add(drm, (ret == -EBUSY) ?
+				&drm->stats.flip_ebusy :
+				&drm->stats.flip_errors, 1);
+		if (present_fence)
+			*present_fence = -1;
 		/* try to set mode for next frame */
-		if (errno != EBUSY)
-			drm->first_post = 1;
+		if (ret != -EBUSY)
+			output->first_post = 1;
 	}
-	else
-		drm->next_front = bo;
+
+out:
+	if (req)
+		drmModeAtomicFree(req);
 
 	return ret;
 }
 
 /*
- * Wait for the next post.
+ * Post a bo to an extended output.  The output flips at its own refresh,
+ * and waits only for its own flips.  The bo is referenced until it has left
+ * the screen.
  */
-static void drm_kms_wait_for_post(struct gralloc_drm_t *drm, int flip)
+static int drm_kms_post_output(struct gralloc_drm_t *drm,
+		struct gralloc_drm_output *output, struct gralloc_drm_bo_t *bo,
+		int acquire_fence, int *present_fence)
 {
-	unsigned int current, target;
-	drmVBlank vbl;
 	int ret;
 
-	if (drm->mode_quirk_vmwgfx)
-		return;
+	/* one flip at a time */
+	drm_kms_wait_output_flip(drm, output);
+
+	if (output->first_post ||
+	    (drm->swap_mode != DRM_SWAP_FLIP &&
+	     drm->swap_mode != DRM_SWAP_ATOMIC)) {
+		if (acquire_fence >= 0) {
+			if (gralloc_drm_wait_fence(acquire_fence,
+						DRM_FENCE_TIMEOUT))
+				ALOGW("failed to wait for acquire fence %d",
+						acquire_fence);
+			close(acquire_fence);
+		}
 
-	flip = !!flip;
+		return drm_kms_set_output_front(drm, output, bo);
+	}
 
-	memset(&vbl, 0, sizeof(vbl));
-	vbl.request.type = DRM_VBLANK_RELATIVE;
-	if (drm->vblank_secondary)
-		vbl.request.type |= DRM_VBLANK_SECONDARY;
-	vbl.request.sequence = 0;
+	if (output->swap_interval > 1) {
+		drmVBlank vbl;
 
-	/* get the current vblank */
-	ret = drmWaitVBlank(drm->fd, &vbl);
-	if (ret) {
-		ALOGW("failed to get vblank");
-		return;
+		memset(&vbl, 0, sizeof(vbl));
+		vbl.request.type = DRM_VBLANK_ABSOLUTE |
+			drm_kms_vblank_crtc(output->pipe);
+		vbl.request.sequence = output->last_swap +
+			output->swap_interval - 1;
+		if (drmWaitVBlank(drm->fd, &vbl))
+			ALOGW("failed to wait for vblank of crtc %d",
+					output->crtc_id);
 	}
 
-	current = vbl.reply.sequence;
-	if (drm->first_post)
-		target = current;
+	ret = drm_kms_flip_output(drm, output, bo, acquire_fence,
+			present_fence);
+
+	/* KMS holds its own reference */
+	if (acquire_fence >= 0)
+		close(acquire_fence);
+
+	return ret;
+}
+
+/*
+ * Release the swapchain of an extended output.
+ */
+static void drm_kms_release_output(struct gralloc_drm_t *drm,
+		struct gralloc_drm_output *output)
+{
+	struct gralloc_drm_bo_t *fronts[2];
+
+	drm_kms_wait_output_flip(drm, output);
+
+	pthread_mutex_lock(&drm->event_mutex);
+	fronts[0] = output->current_front;
+	fronts[1] = output->next_front;
+	output->current_front = NULL;
+	output->next_front = NULL;
+	pthread_mutex_unlock(&drm->event_mutex);
+
+	if (fronts[0])
+		gralloc_drm_bo_decref(fronts[0]);
+	if (fronts[1])
+		gralloc_drm_bo_decref(fronts[1]);
+}
+
+/*
+ * Interface for HWC, used to make a display show the primary, or its own
+ * posts.  The primary display cannot be extended.
+ */
+int gralloc_drm_set_display_mode(struct gralloc_drm_t *drm,
+	int display, int extended)
+{
+	struct gralloc_drm_output *output;
+	enum drm_output_mode mode =
+		(extended) ? DRM_OUTPUT_EXTENDED : DRM_OUTPUT_CLONED;
+	int ret = 0;
+
+	if (!display)
+		return (extended) ? -EINVAL : 0;
+
+	pthread_mutex_lock(&drm->outputs_mutex);
+
+	output = drm_kms_get_display_output(drm, display);
+	if (!output || !output->active) {
+		ret = -EINVAL;
+		goto out;
+	}
+
+	if (output->output_mode == mode)
+		goto out;
+
+	output->output_mode = mode;
+	if (mode == DRM_OUTPUT_EXTENDED) {
+		/* the first post sets the crtc */
+		output->first_post = 1;
+	}
+	else {
+		/* show the private fb before the fronts are freed */
+		drm_kms_wait_output_flip(drm, output);
+		if (output->bo)
+			drm_kms_set_crtc(drm, output, output->bo->fb_id);
+		drm_kms_release_output(drm, output);
+	}
+
+	ALOGI("crtc %d is %s", output->crtc_id,
+			(extended) ? "extended" : "cloned");
+
+out:
+	pthread_mutex_unlock(&drm->outputs_mutex);
+
+	return ret;
+}
+
+/*
+ * Interface for HWC, used to set the swap interval of an extended display.
+ */
+int gralloc_drm_set_display_swap_interval(struct gralloc_drm_t *drm,
+	int display, int interval)
+{
+	struct gralloc_drm_output *output;
+	int ret = 0;
+
+	if (interval < 1)
+		interval = 1;
+
+	pthread_mutex_lock(&drm->outputs_mutex);
+
+	output = drm_kms_get_display_output(drm, display);
+	if (output && output->active && display)
+		output->swap_interval = interval;
 	else
-		target = drm->last_swap + drm->swap_interval - flip;
+		ret = -EINVAL;
 
-	/* wait for vblank */
-	if (current < target || !flip) {
-		memset(&vbl, 0, sizeof(vbl));
-		vbl.request.type = DRM_VBLANK_ABSOLUTE;
-		if (drm->vblank_secondary)
-			vbl.request.type |= DRM_VBLANK_SECONDARY;
-		if (!flip) {
-			vbl.request.type |= DRM_VBLANK_NEXTONMISS;
-			if (target < current)
-				target = current;
-		}
+	pthread_mutex_unlock(&drm->outputs_mutex);
 
-		vbl.request.sequence = target;
+	return ret;
+}
 
-		ret = drmWaitVBlank(drm->fd, &vbl);
-		if (ret) {
-			ALOGW("failed to wait vblank");
-			return;
+/*
+ * Return the mode of a connector to show content of a frame rate on an
+ * output: the lowest refresh that is a multiple of the rate, or the highest
+ * refresh when rate is 0.  Only the refresh differs from the current mode.
+ */
+static const drmModeModeInfo *drm_kms_find_refresh(
+		drmModeConnectorPtr connector,
+		const struct gralloc_drm_output *output, int rate)
+{
+	const drmModeModeInfo *best = NULL;
+	int i;
+
+	for (i = 0; i < connector->count_modes; i++) {
+		const drmModeModeInfo *mode = &connector->modes[i];
+
+		if (mode->hdisplay != output->mode.hdisplay ||
+		    mode->vdisplay != output->mode.vdisplay ||
+		    (mode->flags & DRM_MODE_FLAG_INTERLACE) !=
+		    (output->mode.flags & DRM_MODE_FLAG_INTERLACE) ||
+		    !mode->vrefresh)
+			continue;
+
+		if (rate) {
+			if (mode->vrefresh % rate)
+				continue;
+			if (!best || mode->vrefresh < best->vrefresh)
+				best = mode;
+		}
+		else if (!best || mode->vrefresh > best->vrefresh) {
+			best = mode;
 		}
 	}
 
-	drm->last_swap = vbl.reply.sequence + flip;
+	return best;
 }
 
 /*
- * Post a bo.  This is not thread-safe.
+ * Interface for HWC, used to match the refresh of a display to content of a
+ * frame rate in Hz, or to restore the highest refresh when rate is 0.  The
+ * switch is made with the next flip, and only when KMS can make it without a
+ * full modeset; -EINVAL is returned otherwise.
  */
-int gralloc_drm_bo_post(struct gralloc_drm_bo_t *bo)
+int gralloc_drm_set_display_refresh(struct gralloc_drm_t *drm,
+	int display, int rate)
 {
-	struct gralloc_drm_t *drm = bo->drm;
-	int ret;
+	struct gralloc_drm_output *output;
+	drmModeConnectorPtr connector = NULL;
+	const drmModeModeInfo *mode;
+	drmModeAtomicReqPtr req;
+	uint32_t blob = 0;
+	int ret = 0;
 
-	if (!bo->fb_id && drm->swap_mode != DRM_SWAP_COPY) {
-		ALOGE("unable to post bo %p without fb", bo);
+	if (rate < 0 || drm->swap_mode != DRM_SWAP_ATOMIC)
 		return -EINVAL;
+
+	pthread_mutex_lock(&drm->outputs_mutex);
+
+	output = drm_kms_get_display_output(drm, display);
+	if (!output || !output->active || !output->mode_id_prop) {
+		ret = -EINVAL;
+		goto out;
+	}
+
+	connector = drmModeGetConnectorCurrent(drm->fd, output->connector_id);
+	mode = (connector) ? drm_kms_find_refresh(connector, output, rate) :
+		NULL;
+	if (!mode) {
+		ret = -EINVAL;
+		goto out;
+	}
+
+	/* already there, or on the way */
+	if (!memcmp(mode, (output->mode_blob) ? &output->pending_mode :
+				&output->mode, sizeof(*mode)))
+		goto out;
+
+	if (drmModeCreatePropertyBlob(drm->fd, mode, sizeof(*mode), &blob)) {
+		ret = -errno;
+		goto out;
+	}
+
+	/* a switch that needs a modeset would blank the display */
+	req = drmModeAtomicAlloc();
+	if (!req) {
+		ret = -ENOMEM;
+		goto out;
+	}
+	drmModeAtomicAddProperty(req, output->crtc_id, output->mode_id_prop,
+			blob);
+	ret = drmModeAtomicCommit(drm->fd, req, DRM_MODE_ATOMIC_TEST_ONLY,
+			NULL);
+	drmModeAtomicFree(req);
+	if (ret) {
+		ALOGI("crtc %d cannot switch to %s@%d seamlessly",
+				output->crtc_id, mode->name, mode->vrefresh);
+		ret = -EINVAL;
+		goto out;
 	}
 
-	/* TODO spawn a thread to avoid waiting and race */
+	if (output->mode_blob)
+		drmModeDestroyPropertyBlob(drm->fd, output->mode_blob);
+	output->mode_blob = blob;
+	output->pending_mode = *mode;
+	blob = 0;
 
-	if (drm->first_post) {
-		if (drm->swap_mode == DRM_SWAP_COPY) {
-			struct gralloc_drm_bo_t *dst;
+out:
+	pthread_mutex_unlock(&drm->outputs_mutex);
 
-			dst = (drm->next_front) ?
-				drm->next_front :
-				drm->current_front;
-			drm->drv->blit(drm->drv, dst, bo, 0, 0,
-					bo->handle->width,
-					bo->handle->height,
-					0, 0,
-					bo->handle->width,
-					bo->handle->height);
-			bo = dst;
-		}
+	if (blob)
+		drmModeDestroyPropertyBlob(drm->fd, blob);
+	if (connector)
+		drmModeFreeConnector(connector);
 
-		ret = drm_kms_set_crtc(drm, drm->primary, bo->fb_id);
-		if (!ret) {
-			drm->first_post = 0;
-			drm->current_front = bo;
-			if (drm->next_front == bo)
-				drm->next_front = NULL;
-		}
+	return ret;
+}
 
-		pthread_mutex_lock(&drm->outputs_mutex);
-		for (int i = 1; i < drm->output_capacity; i++) {
-			struct gralloc_drm_output *output = &drm->outputs[i];
-			if (output->active && output->output_mode == DRM_OUTPUT_CLONED && output->bo)
-				drm_kms_set_crtc(drm, output, output->bo->fb_id);
-		}
-		pthread_mutex_unlock(&drm->outputs_mutex);
+/*
+ * Interface for HWC, used to post a handle to an extended display, or to
+ * the primary display when display is 0.  acquire_fence is owned by the
+ * post and may be -1.  present_fence, when not NULL, is set to a fence that
+ * signals once the handle is on screen, or to -1.
+ */
+int gralloc_drm_post_display(struct gralloc_drm_t *drm,
+	buffer_handle_t handle, int display,
+	int acquire_fence, int *present_fence)
+{
+	struct gralloc_drm_output *output;
+	struct gralloc_drm_bo_t *bo;
 
-		return ret;
+	if (present_fence)
+		*present_fence = -1;
+
+	bo = gralloc_drm_bo_from_handle(handle);
+	if (!bo || (!bo->fb_id && gralloc_drm_bo_add_fb(bo))) {
+		if (acquire_fence >= 0)
+			close(acquire_fence);
+		return -EINVAL;
 	}
 
-	switch (drm->swap_mode) {
-	case DRM_SWAP_FLIP:
-		if (drm->swap_interval > 1)
-			drm_kms_wait_for_post(drm, 1);
-		ret = drm_kms_page_flip(drm, bo);
-		if (drm->next_front) {
-			/*
-			 * wait if the driver says so or the current front
-			 * will be written by CPU
-			 */
-			if (drm->mode_sync_flip ||
-				(drm->current_front->handle->usage &
-				 GRALLOC_USAGE_SW_WRITE_MASK))
-				drm_kms_page_flip(drm, NULL);
-		}
-		break;
-	case DRM_SWAP_COPY:
-		drm_kms_wait_for_post(drm, 0);
-		drm->drv->blit(drm->drv, drm->current_front,
-				bo, 0, 0,
-				bo->handle->width,
-				bo->handle->height,
-				0, 0,
-				bo->handle->width,
-				bo->handle->height);
-		if (drm->mode_quirk_vmwgfx)
-			ret = drmModeDirtyFB(drm->fd, drm->current_front->fb_id, &drm->clip, 1);
-		ret = 0;
-		break;
-	case DRM_SWAP_SETCRTC:
-		drm_kms_wait_for_post(drm, 0);
-		ret = drm_kms_set_crtc(drm, drm->primary, bo->fb_id);
+	if (!display)
+		return gralloc_drm_bo_queue_post(bo, acquire_fence,
+				present_fence);
 
-		pthread_mutex_lock(&drm->outputs_mutex);
-		for (int i = 1; i < drm->output_capacity; i++) {
-			struct gralloc_drm_output *output = &drm->outputs[i];
-			if (output->active && output->output_mode == DRM_OUTPUT_CLONED && output->bo)
-				drm_kms_set_crtc(drm, output, output->bo->fb_id);
-		}
-		pthread_mutex_unlock(&drm->outputs_mutex);
+	/* not held while posting, to not block the primary */
+	pthread_mutex_lock(&drm->outputs_mutex);
+	output = drm_kms_get_display_output(drm, display);
+	if (!output || !output->active ||
+	    output->output_mode != DRM_OUTPUT_EXTENDED)
+		output = NULL;
+	pthread_mutex_unlock(&drm->outputs_mutex);
 
-		drm->current_front = bo;
-		break;
-	default:
-		/* no-op */
-		ret = 0;
-		break;
+	if (!output) {
+		if (acquire_fence >= 0)
+			close(acquire_fence);
+		return -EINVAL;
 	}
 
-	return ret;
+	return drm_kms_post_output(drm, output, bo, acquire_fence,
+			present_fence);
 }
 
 static struct gralloc_drm_t *drm_singleton;
@@ -680,7 +3519,8 @@ static void on_signal(int sig)
 	struct gralloc_drm_t *drm = drm_singleton;
 
 	/* wait the pending flip */
-	if (drm && drm->swap_mode == DRM_SWAP_FLIP && drm->next_front) {
+	if (drm && (drm->swap_mode == DRM_SWAP_FLIP ||
+		    drm->swap_mode == DRM_SWAP_ATOMIC) && drm->next_front) {
 		/* there is race, but this function is hacky enough to ignore that */
 		if (drm_singleton->waiting_flip)
 			usleep(100 * 1000); /* 100ms */
@@ -693,17 +3533,40 @@ static void on_signal(int sig)
 
 static void drm_kms_init_features(struct gralloc_drm_t *drm)
 {
+	char value[PROPERTY_VALUE_MAX];
 	const char *swap_mode;
 
 	/* call to the driver here, after KMS has been initialized */
 	drm->drv->init_kms_features(drm->drv, drm);
 
-	if (drm->swap_mode == DRM_SWAP_FLIP) {
+	/* to compare the swap modes; flip becomes atomic as usual */
+	if (property_get("debug.drm.swap_mode", value, NULL)) {
+		if (!strcmp(value, "flip"))
+			drm->swap_mode = DRM_SWAP_FLIP;
+		else if (!strcmp(value, "copy"))
+			drm->swap_mode = DRM_SWAP_COPY;
+		else if (!strcmp(value, "set-crtc"))
+			drm->swap_mode = DRM_SWAP_SETCRTC;
+		else
+			ALOGW("unknown swap mode %s", value);
+	}
+
+	/* an atomic commit is a page flip of all the planes */
+	if (drm->swap_mode == DRM_SWAP_FLIP && drm->atomic &&
+	    drm_kms_get_primary_plane(drm, drm->primary)) {
+		drm->swap_mode = DRM_SWAP_ATOMIC;
+		drm->primary->out_fence_ptr = drm_kms_get_prop(drm,
+				drm->primary->crtc_id, DRM_MODE_OBJECT_CRTC,
+				"OUT_FENCE_PTR", NULL);
+	}
+
+	if (drm->swap_mode == DRM_SWAP_FLIP ||
+	    drm->swap_mode == DRM_SWAP_ATOMIC) {
 		struct sigaction act;
 
 		memset(&drm->evctx, 0, sizeof(drm->evctx));
 		drm->evctx.version = DRM_EVENT_CONTEXT_VERSION;
-		drm->evctx.page_flip_handler = page_flip_handler;
+		drm->evctx.page_flip_handler2 = page_flip_handler;
 
 		/*
 		 * XXX GPU tends to freeze if the program is terminiated with a
@@ -750,6 +3613,9 @@ static void drm_kms_init_features(struct gralloc_drm_t *drm)
 	case DRM_SWAP_SETCRTC:
 		swap_mode = "set-crtc";
 		break;
+	case DRM_SWAP_ATOMIC:
+		swap_mode = "atomic";
+		break;
 	default:
 		swap_mode = "no-op";
 		break;
@@ -976,6 +3842,34 @@ static drmModeModeInfoPtr find_mode(drmModeConnectorPtr connector, int *bpp, drm
 
 static int used_crtcs = 0;
 
+/*
+ * Find the crtc properties for adaptive sync and refresh switches of an
+ * output.  They are committed with the atomic flips.
+ */
+static void drm_kms_init_output_refresh(struct gralloc_drm_t *drm,
+		struct gralloc_drm_output *output)
+{
+	uint64_t capable = 0;
+
+	output->vrr_enabled_prop = 0;
+	output->vrr_enabled = 0;
+	output->mode_id_prop = 0;
+	output->mode_blob = 0;
+
+	if (!drm->atomic)
+		return;
+
+	output->mode_id_prop = drm_kms_get_prop(drm, output->crtc_id,
+			DRM_MODE_OBJECT_CRTC, "MODE_ID", NULL);
+
+	if (drm->vrr && drm_kms_get_prop(drm, output->connector_id,
+				DRM_MODE_OBJECT_CONNECTOR, "vrr_capable",
+				&capable) && capable)
+		output->vrr_enabled_prop = drm_kms_get_prop(drm,
+				output->crtc_id, DRM_MODE_OBJECT_CRTC,
+				"VRR_ENABLED", NULL);
+}
+
 /*
  * Initialize KMS with a connector.
  */
@@ -1007,8 +3901,11 @@ static int drm_kms_init_with_connector(struct gralloc_drm_t *drm,
 		return -EINVAL;
 
 	output->bo = NULL;
+	output->plane = NULL;
+	output->scanout_clone = 0;
 	output->crtc_id = drm->resources->crtcs[i];
 	output->connector_id = connector->connector_id;
+	output->connection = connector->connection;
 	output->pipe = i;
 
 	/* print connector info */
@@ -1061,6 +3958,8 @@ static int drm_kms_init_with_connector(struct gralloc_drm_t *drm,
 	drm->clip.y2 = output->mode.vdisplay;
 #endif
 
+	drm_kms_init_output_refresh(drm, output);
+
 	return 0;
 }
 
@@ -1089,7 +3988,8 @@ drm_kms_init_with_new_connector(struct gralloc_drm_t *drm, drmModeConnectorPtr c
 
 
 /*
- * Fetch a connector of particular type
+ * Fetch a connector of particular type.  Only the connectors of the type
+ * are probed.
  */
 static drmModeConnectorPtr fetch_connector(struct gralloc_drm_t *drm,
 	uint32_t type)
@@ -1100,11 +4000,21 @@ static drmModeConnectorPtr fetch_connector(struct gralloc_drm_t *drm,
 		return NULL;
 
 	for (i = 0; i < drm->resources->count_connectors; i++) {
-		drmModeConnectorPtr connector = drmModeGetConnector(drm->fd,
-				drm->resources->connectors[i]);
+		uint32_t id = drm->resources->connectors[i];
+		drmModeConnectorPtr connector;
+
+		connector = drmModeGetConnectorCurrent(drm->fd, id);
+		if (!connector)
+			continue;
+		if (connector->connector_type != type) {
+			drmModeFreeConnector(connector);
+			continue;
+		}
+		drmModeFreeConnector(connector);
+
+		connector = drmModeGetConnector(drm->fd, id);
 		if (connector) {
-			if (connector->connector_type == type &&
-				connector->connection == DRM_MODE_CONNECTED)
+			if (connector->connection == DRM_MODE_CONNECTED)
 				return connector;
 			drmModeFreeConnector(connector);
 		}
@@ -1117,14 +4027,25 @@ static drmModeConnectorPtr fetch_connector(struct gralloc_drm_t *drm,
  * Initializes external output with a connector and allocates
  * a private framebuffer for it. This is called on startup if
  * external cable is connected and also on hotplug events.
+ * Only the crtc of the output is set, and the output is published
+ * under outputs_mutex once it can be committed.
  */
 static int init_external_output(struct gralloc_drm_t *drm,
 	drmModeConnectorPtr connector)
 {
-	struct gralloc_drm_output *output;
-	output = drm_kms_init_with_new_connector(drm, connector);
-	if (output == NULL || !output->active) {
-		ALOGW("connector 0x%x output is null or not active", connector->connector_id);
+	struct gralloc_drm_output *output = NULL;
+	int err;
+
+	/* outputs are only added by init and then the hotplug thread */
+	for (int i = 0; i < drm->output_capacity; i++) {
+		if (!drm->outputs[i].active) {
+			output = &drm->outputs[i];
+			break;
+		}
+	}
+
+	if (!output || drm_kms_init_with_connector(drm, output, connector)) {
+		ALOGW("connector 0x%x has no output", connector->connector_id);
 		return -EINVAL;
 	}
 
@@ -1134,56 +4055,167 @@ static int init_external_output(struct gralloc_drm_t *drm,
 	output->bo = gralloc_drm_bo_create(drm,
 		output->mode.hdisplay, output->mode.vdisplay,
 		output->fb_format,
-		GRALLOC_USAGE_HW_RENDER);
+		GRALLOC_USAGE_HW_FB | GRALLOC_USAGE_HW_RENDER);
+	if (!output->bo) {
+		err = -ENOMEM;
+		goto fail;
+	}
 
-	int err = gralloc_drm_bo_add_fb(output->bo);
+	err = gralloc_drm_bo_add_fb(output->bo);
 	if (err) {
 		ALOGE("%s: could not create drm fb, (%s)",
 			__func__, strerror(-err));
-		return err;
+		gralloc_drm_bo_decref(output->bo);
+		output->bo = NULL;
+		goto fail;
 	}
 
-	output->output_mode = DRM_OUTPUT_CLONED;
-	output->active = 1;
+	/* extended outputs are posted to by HWC */
+	output->output_mode = property_get_bool("debug.drm.extended", 0) ?
+		DRM_OUTPUT_EXTENDED : DRM_OUTPUT_CLONED;
+	output->first_post = 1;
+	output->swap_interval = 1;
 
 	/* This is a hack to workaround mirror mode render error */
 	drm_kms_set_crtc(drm, output, output->bo->fb_id);
 
+	pthread_mutex_lock(&drm->outputs_mutex);
+	output->active = 1;
+	drm->output_count++;
+	pthread_mutex_unlock(&drm->outputs_mutex);
+
 	return 0;
+
+fail:
+	used_crtcs &= ~(1 << output->pipe);
+	return err;
+}
+
+/*
+ * Stop using the output of a disconnected connector.  The post path
+ * drops the output under outputs_mutex, and its buffers are freed
+ * after.
+ */
+static void drm_kms_disconnect_output(struct gralloc_drm_t *drm,
+	struct gralloc_drm_output *output)
+{
+	struct gralloc_drm_bo_t *bo;
+
+	pthread_mutex_lock(&drm->outputs_mutex);
+	output->active = 0;
+	output->connection = DRM_MODE_DISCONNECTED;
+	drm->output_count--;
+	bo = output->bo;
+	output->bo = NULL;
+	pthread_mutex_unlock(&drm->outputs_mutex);
+
+	drm_kms_release_output(drm, output);
+	drm_kms_destroy_cursor(drm, output);
+	if (bo)
+		gralloc_drm_bo_decref(bo);
+	used_crtcs &= ~(1 << output->pipe);
 }
 
+/*
+ * Return the active output of a connector, or NULL.
+ */
+static struct gralloc_drm_output *drm_kms_get_connector_output(
+	struct gralloc_drm_t *drm, uint32_t connector_id)
+{
+	for (int i = 0; i < drm->output_capacity; i++) {
+		if (drm->outputs[i].active &&
+		    drm->outputs[i].connector_id == connector_id)
+			return &drm->outputs[i];
+	}
+
+	return NULL;
+}
 
-static int init_connectors(struct gralloc_drm_t *drm)
+/*
+ * Bring the outputs up to date with the connectors, or with the connector
+ * connector_id only when it is not 0.  Unless probe is set, the connectors
+ * are read without probing them, which the kernel did before sending the
+ * hotplug event, and only the newly connected ones are probed for their
+ * modes.  Only the crtcs of the changed connectors are set, and
+ * outputs_mutex is not held while probing.
+ */
+static void drm_kms_update_connectors(struct gralloc_drm_t *drm,
+	uint32_t connector_id, int probe)
 {
 	if (!drm->resources)
-		return -1;
+		return;
 
-	for (int i = 0; i<drm->resources->count_connectors; i++) {
-		drmModeConnectorPtr connector = drmModeGetConnector(drm->fd,
-				drm->resources->connectors[i]);
-		if (connector) {
+	for (int i = 0; i < drm->resources->count_connectors; i++) {
+		uint32_t id = drm->resources->connectors[i];
+		struct gralloc_drm_output *output;
+		drmModeConnectorPtr connector;
+
+		if (connector_id && id != connector_id)
+			continue;
+
+		connector = (probe) ? drmModeGetConnector(drm->fd, id) :
+			drmModeGetConnectorCurrent(drm->fd, id);
+		if (!connector)
+			continue;
+
+		output = drm_kms_get_connector_output(drm, id);
+		if (output == drm->primary) {
+			/* the primary was plugged again, set its crtc */
 			if (connector->connection == DRM_MODE_CONNECTED &&
-				connector->connector_id != drm->primary->connector_id) {
-				init_external_output(drm, connector);
-			} else if (connector->connection == DRM_MODE_DISCONNECTED) {
-				for (int j = 1; j < drm->output_capacity; j++) {
-					if (drm->outputs[j].connector_id == connector->connector_id && drm->outputs[j].active) {
-						drm->outputs[j].active = 0;
-						used_crtcs &= ~(1 << drm->outputs[j].pipe);
-						gralloc_drm_bo_decref(drm->outputs[j].bo);
-						drm->outputs[j].bo = NULL;
-						break;
-					}
-				}
+			    output->connection != DRM_MODE_CONNECTED) {
+				pthread_mutex_lock(&drm->outputs_mutex);
+				drm->first_post = 1;
+				pthread_mutex_unlock(&drm->outputs_mutex);
 			}
-			drmModeFreeConnector(connector);
+			output->connection = connector->connection;
+		}
+		else if (connector->connection == DRM_MODE_CONNECTED &&
+			 !output) {
+			/* the modes of a new monitor are not known yet */
+			if (!probe) {
+				drmModeFreeConnector(connector);
+				connector = drmModeGetConnector(drm->fd, id);
+			}
+			if (connector &&
+			    connector->connection == DRM_MODE_CONNECTED)
+				init_external_output(drm, connector);
+		}
+		else if (connector->connection == DRM_MODE_DISCONNECTED &&
+			 output) {
+			ALOGI("connector 0x%x is disconnected", id);
+			drm_kms_disconnect_output(drm, output);
 		}
-	}
 
-	return 0;
+		if (connector)
+			drmModeFreeConnector(connector);
+	}
 }
 
 
+/*
+ * Log the planes and their formats.
+ */
+static void drm_kms_dump_planes(struct gralloc_drm_t *drm)
+{
+	unsigned int i, j;
+
+	if (!drm->planes)
+		return;
+
+	ALOGD("supported drm planes and formats");
+	for (i = 0; i < drm->plane_resources->count_planes; i++) {
+		drmModePlanePtr plane = drm->planes[i].drm_plane;
+
+		ALOGD("plane id %d", plane->plane_id);
+		for (j = 0; j < plane->count_formats; j++)
+			ALOGD("    format %c%c%c%c",
+				plane->formats[j],
+				plane->formats[j] >> 8,
+				plane->formats[j] >> 16,
+				plane->formats[j] >> 24);
+	}
+}
+
 /*
  * Thread that listens to uevents and checks if hdmi state changes
  */
@@ -1195,6 +4227,10 @@ static void *extcon_observer(void *data)
 		(struct gralloc_drm_t *) data;
 	struct uevent event;
 
+	/* deferred by init so that the primary is ready first */
+	drm_kms_update_connectors(drm, 0, 1);
+	drm_kms_dump_planes(drm);
+
 	uevent_init();
 
 	memset(uevent_desc, 0, sizeof(uevent_desc));
@@ -1206,45 +4242,95 @@ static void *extcon_observer(void *data)
 		if (!len) continue;
 
 		parse_event(uevent_desc, &event);
-		ALOGD_IF(0, "event { '%s', '%s', '%s', %d, %d, %d, %d }\n",
+		ALOGD_IF(0, "event { '%s', '%s', '%s', %d, %d, %d, %d, %u }\n",
 				event.action, event.path, event.subsystem,
 				event.major, event.minor,
-				event.switchstate, event.hotplug);
+				event.switchstate, event.hotplug,
+				event.connector_id);
 
 		if (!strcmp(event.path, "devices/virtual/switch/hdmi")) {
-			if (event.switchstate != -1) {
-				pthread_mutex_lock(&drm->outputs_mutex);
+			if (event.switchstate != -1)
+				drm_kms_update_connectors(drm, 0, 0);
+		} else if (!strcmp(event.subsystem, "drm") &&
+				!strcmp(event.device_name, "dri/card0") && event.hotplug) {
+			/* newer kernels name the connector that changed */
+			drm_kms_update_connectors(drm, event.connector_id, 0);
+		}
+	}
 
-				init_connectors(drm);
+	pthread_exit(NULL);
+	return 0;
+}
 
-				/* will trigger modeset */
-				drm->first_post = 1;
 
-				pthread_mutex_unlock(&drm->outputs_mutex);
-			}
-		} else if (!strcmp(event.subsystem, "drm") &&
-				!strcmp(event.device_name, "dri/card0") && event.hotplug) {
-			pthread_mutex_lock(&drm->outputs_mutex);
+/*
+ * Fill the planes for hwcomposer.  The atomic props of the planes are found
+ * when drm->atomic is set, which is cleared when some are missing.
+ */
+static void drm_kms_init_planes(struct gralloc_drm_t *drm)
+{
+	unsigned int i;
+	int universal = drm->atomic;
 
-			init_connectors(drm);
+	drm->plane_resources = drmModeGetPlaneResources(drm->fd);
+	if (!drm->plane_resources) {
+		ALOGD("no planes found from drm resources");
+		return;
+	}
 
-			/* will trigger modeset */
-			drm->first_post = 1;
+	/* fill a helper structure for hwcomposer */
+	drm->planes = calloc(drm->plane_resources->count_planes,
+		sizeof(struct gralloc_drm_plane_t));
+
+	for (i = 0; i < drm->plane_resources->count_planes; i++) {
+		struct gralloc_drm_plane_t *plane = &drm->planes[i];
+		struct drm_kms_obj_props obj;
+
+		plane->drm_plane = drmModeGetPlane(drm->fd,
+			drm->plane_resources->planes[i]);
 
-			pthread_mutex_unlock(&drm->outputs_mutex);
+		if (drm_kms_get_obj_props(drm,
+					plane->drm_plane->plane_id,
+					DRM_MODE_OBJECT_PLANE, &obj)) {
+			drm->atomic = 0;
+			continue;
 		}
-	}
 
-	pthread_exit(NULL);
-	return 0;
+		if (universal &&
+		    drm_kms_init_plane_props(drm, plane, &obj))
+			drm->atomic = 0;
+		drm_kms_init_plane_formats(drm, plane, &obj);
+		drm_kms_free_obj_props(&obj);
+	}
 }
 
+static void drm_kms_fini_planes(struct gralloc_drm_t *drm)
+{
+	if (drm->planes) {
+		unsigned int i;
+		for (i = 0; i < drm->plane_resources->count_planes; i++) {
+			drmModeFreePlane(drm->planes[i].drm_plane);
+			if (drm->planes[i].in_formats)
+				drmModeFreePropertyBlob(drm->planes[i].in_formats);
+		}
+		free(drm->planes);
+		drm->planes = NULL;
+	}
+
+	if (drm->plane_resources) {
+		drmModeFreePlaneResources(drm->plane_resources);
+		drm->plane_resources = NULL;
+	}
+}
 
 /*
  * Initialize KMS.
  */
 int gralloc_drm_init_kms(struct gralloc_drm_t *drm)
 {
+	uint64_t cap;
+	int universal;
+
 	if (drm->resources)
 		return 0;
 
@@ -1254,35 +4340,46 @@ int gralloc_drm_init_kms(struct gralloc_drm_t *drm)
 		return -EINVAL;
 	}
 
-	drm->plane_resources = drmModeGetPlaneResources(drm->fd);
-	if (!drm->plane_resources) {
-		ALOGD("no planes found from drm resources");
-	} else {
-		unsigned int i, j;
-
-		ALOGD("supported drm planes and formats");
-		/* fill a helper structure for hwcomposer */
-		drm->planes = calloc(drm->plane_resources->count_planes,
-			sizeof(struct gralloc_drm_plane_t));
-
-		for (i = 0; i < drm->plane_resources->count_planes; i++) {
-			drm->planes[i].drm_plane = drmModeGetPlane(drm->fd,
-				drm->plane_resources->planes[i]);
-
-			ALOGD("plane id %d", drm->planes[i].drm_plane->plane_id);
-			for (j = 0; j < drm->planes[i].drm_plane->count_formats; j++)
-				ALOGD("    format %c%c%c%c",
-					(drm->planes[i].drm_plane->formats[j]),
-					(drm->planes[i].drm_plane->formats[j])>>8,
-					(drm->planes[i].drm_plane->formats[j])>>16,
-					(drm->planes[i].drm_plane->formats[j])>>24);
-		}
+	pthread_mutex_init(&drm->event_mutex, NULL);
+	pthread_cond_init(&drm->event_cond, NULL);
+	pthread_mutex_init(&drm->capture_mutex, NULL);
+	pthread_cond_init(&drm->capture_cond, NULL);
+
+	/* atomic also exposes the primary and cursor planes */
+	if (property_get_bool("debug.drm.atomic", 1) &&
+	    !drmSetClientCap(drm->fd, DRM_CLIENT_CAP_ATOMIC, 1))
+		drm->atomic = 1;
+	universal = drm->atomic;
+	drm->vrr = property_get_bool("debug.drm.vrr", 1);
+
+	/* fbs may be given the modifiers of the bos */
+	if (!drmGetCap(drm->fd, DRM_CAP_ADDFB2_MODIFIERS, &cap) && cap)
+		drm->fb_modifiers = 1;
+
+	/* the flip events tell their crtcs */
+	if (!drmGetCap(drm->fd, DRM_CAP_CRTC_IN_VBLANK_EVENT, &cap) && cap)
+		drm->crtc_in_event = 1;
+
+	drm->cursor_width = (!drmGetCap(drm->fd, DRM_CAP_CURSOR_WIDTH, &cap) &&
+			cap) ? cap : 64;
+	drm->cursor_height = (!drmGetCap(drm->fd, DRM_CAP_CURSOR_HEIGHT, &cap) &&
+			cap) ? cap : 64;
+
+	drm_kms_init_planes(drm);
+	if (universal && !drm->atomic) {
+		/* the legacy paths do not expect the primary and cursor planes */
+		ALOGW("falling back to legacy KMS without atomic plane props");
+		drmSetClientCap(drm->fd, DRM_CLIENT_CAP_ATOMIC, 0);
+		drm_kms_fini_planes(drm);
+		drm_kms_init_planes(drm);
 	}
 
 	drm->output_capacity = drm->resources->count_connectors;
 	drm->output_count = 0;
 
 	drm->outputs = calloc(sizeof(*drm->outputs), drm->output_capacity);
+	for (int i = 0; drm->outputs && i < drm->output_capacity; i++)
+		drm->outputs[i].drm = drm;
 
 	/* find the crtc/connector/mode to use */
 	uint32_t internal_connectors[] = {
@@ -1326,26 +4423,42 @@ int gralloc_drm_init_kms(struct gralloc_drm_t *drm)
 		}
 	}
 
-	/* Mirror mode need driver support for blitting. which is not implemented for
-		drivers other than intel. skip external detection for them to avoid crash
-	*/
-	if (drm->drv->blit) {
-		init_connectors(drm);
-
-		/* launch external display observer thread */
-		pthread_mutex_init(&drm->outputs_mutex, NULL);
-		pthread_create(&drm->hotplug_thread, NULL, extcon_observer, drm);
-	}
+	pthread_mutex_init(&drm->outputs_mutex, NULL);
 
 	drm_kms_init_features(drm);
 	drm->first_post = 1;
+	drm->swap_interval_max = (drm->swap_interval &&
+		(drm->swap_mode == DRM_SWAP_FLIP ||
+		 drm->swap_mode == DRM_SWAP_ATOMIC)) ?
+		DRM_SWAP_INTERVAL_MAX : drm->swap_interval;
+	drm->in_fence = -1;
+	drm->out_fence = NULL;
+
+	drm->stats_enabled = property_get_bool("debug.drm.stats", 0);
+	drm->clone_scanout = property_get_bool("debug.drm.clone_scanout", 1);
+
+	pthread_mutex_init(&drm->fb_mutex, NULL);
+
+	drm_kms_init_post_queue(drm);
+
+	/*
+	 * the other connectors are probed by the external display observer
+	 * thread, and their outputs are added as they are found
+	 */
+	pthread_create(&drm->hotplug_thread, NULL, extcon_observer, drm);
 
 	return 0;
 }
 
 void gralloc_drm_fini_kms(struct gralloc_drm_t *drm)
 {
+	struct gralloc_drm_bo_t *front;
+
+	drm_kms_fini_capture(drm);
+	drm_kms_fini_post_queue(drm);
+
 	switch (drm->swap_mode) {
+	case DRM_SWAP_ATOMIC:
 	case DRM_SWAP_FLIP:
 		drm_kms_page_flip(drm, NULL);
 		break;
@@ -1363,6 +4476,20 @@ void gralloc_drm_fini_kms(struct gralloc_drm_t *drm)
 		break;
 	}
 
+	/* wait for the flips of the extended outputs */
+	for (int i = 1; i < drm->output_capacity; i++)
+		drm_kms_release_output(drm, &drm->outputs[i]);
+
+	pthread_mutex_lock(&drm->event_mutex);
+	front = drm->front_ref;
+	drm->front_ref = NULL;
+	pthread_mutex_unlock(&drm->event_mutex);
+	if (front)
+		gralloc_drm_bo_decref(front);
+
+	for (int i = 0; i < drm->output_capacity; i++)
+		drm_kms_destroy_cursor(drm, &drm->outputs[i]);
+
 	/* restore crtc? */
 
 	if (drm->resources) {
@@ -1370,18 +4497,7 @@ void gralloc_drm_fini_kms(struct gralloc_drm_t *drm)
 		drm->resources = NULL;
 	}
 
-	if (drm->planes) {
-		unsigned int i;
-		for (i = 0; i < drm->plane_resources->count_planes; i++)
-			drmModeFreePlane(drm->planes[i].drm_plane);
-		free(drm->planes);
-		drm->planes = NULL;
-	}
-
-	if (drm->plane_resources) {
-		drmModeFreePlaneResources(drm->plane_resources);
-		drm->plane_resources = NULL;
-	}
+	drm_kms_fini_planes(drm);
 
 	/* destroy private buffer of external output */
 	for (int i = 1; i < drm->output_capacity; i++)
@@ -1390,6 +4506,11 @@ void gralloc_drm_fini_kms(struct gralloc_drm_t *drm)
 
 	free(drm->outputs);
 
+	drm_kms_fb_fini(drm);
+
+	pthread_cond_destroy(&drm->event_cond);
+	pthread_mutex_destroy(&drm->event_mutex);
+
 	drm_singleton = NULL;
 }
 
@@ -1414,7 +4535,11 @@ void gralloc_drm_get_kms_info(struct gralloc_drm_t *drm,
 	*((float *)    &fb->xdpi) = drm->primary->xdpi;
 	*((float *)    &fb->ydpi) = drm->primary->ydpi;
 	*((int *)      &fb->minSwapInterval) = drm->swap_interval;
-	*((int *)      &fb->maxSwapInterval) = drm->swap_interval;
+	*((int *)      &fb->maxSwapInterval) = drm->swap_interval_max;
+
+	/* one more than the bos that may be in the post queue */
+	if (drm->post_queue_size)
+		*((int *)      &fb->numFramebuffers) = drm->post_queue_size + 1;
 }
 
 /*
@@ -0,0 +1,167 @@
+/*
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * The layout policy.  The layout of a new bo is looked up from rules of the
+ * config file, which may be per driver:
+ *
+ *   # driver  usage-mask  layout
+ *   i915      0x00000100  tiled
+ *   *         0x00000003  linear
+ *
+ * The first rule whose usage bits are all in the usage of the bo wins.
+ * Without a rule, the layout is left to the driver.
+ */
+
+#define LOG_TAG "GRALLOC-LAYOUT"
+
+#include <cutils/log.h>
+#include <cutils/properties.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <xf86drm.h>
+
+#include "gralloc_drm.h"
+#include "gralloc_drm_priv.h"
+
+#define DRM_LAYOUT_CONFIG "/vendor/etc/gralloc_drm_layout.conf"
+#define DRM_LAYOUT_RULES_MAX 32
+
+struct gralloc_drm_layout_rule {
+	char driver[32];
+	int usage;
+	int layout;
+};
+
+struct gralloc_drm_layouts {
+	struct gralloc_drm_layout_rule rules[DRM_LAYOUT_RULES_MAX];
+	int rule_count;
+
+	/* the drivers of the display and the render devices */
+	char drivers[2][32];
+};
+
+static void layouts_get_driver(int fd, char *name, size_t size)
+{
+	drmVersionPtr version;
+
+	name[0] = '\0';
+	if (fd < 0)
+		return;
+
+	version = drmGetVersion(fd);
+	if (version) {
+		if (version->name)
+			snprintf(name, size, "%s", version->name);
+		drmFreeVersion(version);
+	}
+}
+
+static void layouts_load(struct gralloc_drm_layouts *layouts,
+		const char *path)
+{
+	char line[128], driver[32], layout[16];
+	FILE *fp;
+	int usage;
+
+	fp = fopen(path, "r");
+	if (!fp)
+		return;
+
+	while (fgets(line, sizeof(line), fp) &&
+	       layouts->rule_count < DRM_LAYOUT_RULES_MAX) {
+		struct gralloc_drm_layout_rule *rule =
+			&layouts->rules[layouts->rule_count];
+
+		if (line[0] == '#' ||
+		    sscanf(line, "%31s %i %15s", driver, &usage, layout) != 3)
+			continue;
+
+		if (!strcmp(layout, "linear"))
+			rule->layout = GRALLOC_DRM_LAYOUT_LINEAR;
+		else if (!strcmp(layout, "tiled"))
+			rule->layout = GRALLOC_DRM_LAYOUT_TILED;
+		else if (!strcmp(layout, "auto"))
+			rule->layout = GRALLOC_DRM_LAYOUT_AUTO;
+		else {
+			ALOGW("%s: unknown layout %s", path, layout);
+			continue;
+		}
+
+		snprintf(rule->driver, sizeof(rule->driver), "%s", driver);
+		rule->usage = usage;
+		layouts->rule_count++;
+	}
+
+	fclose(fp);
+
+	ALOGI("%d layout rules from %s", layouts->rule_count, path);
+}
+
+/*
+ * Create the layout policy of the display device fd and the render device
+ * render_fd, which is -1 when there is none.
+ */
+struct gralloc_drm_layouts *gralloc_drm_layouts_create(int fd, int render_fd)
+{
+	struct gralloc_drm_layouts *layouts;
+	char path[PROPERTY_VALUE_MAX];
+
+	layouts = calloc(1, sizeof(*layouts));
+	if (!layouts)
+		return NULL;
+
+	layouts_get_driver(fd, layouts->drivers[0],
+			sizeof(layouts->drivers[0]));
+	layouts_get_driver(render_fd, layouts->drivers[1],
+			sizeof(layouts->drivers[1]));
+
+	property_get("debug.drm.layout_config", path, DRM_LAYOUT_CONFIG);
+	layouts_load(layouts, path);
+
+	return layouts;
+}
+
+void gralloc_drm_layouts_destroy(struct gralloc_drm_layouts *layouts)
+{
+	free(layouts);
+}
+
+/*
+ * Return the GRALLOC_DRM_LAYOUT_* of a new bo of a handle, on the render
+ * device when render is set.
+ */
+int gralloc_drm_layout_choose(struct gralloc_drm_layouts *layouts,
+		const struct gralloc_drm_handle_t *handle, int render)
+{
+	const char *driver = layouts->drivers[!!render];
+	int i;
+
+	for (i = 0; i < layouts->rule_count; i++) {
+		const struct gralloc_drm_layout_rule *rule = &layouts->rules[i];
+
+		if ((rule->driver[0] == '*' || !strcmp(rule->driver, driver)) &&
+		    (handle->usage & rule->usage) == rule->usage)
+			return rule->layout;
+	}
+
+	return GRALLOC_DRM_LAYOUT_AUTO;
+}
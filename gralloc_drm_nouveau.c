@@ -78,7 +78,8 @@ struct nouveau_buffer {
 };
 
 static struct nouveau_bo *alloc_bo(struct nouveau_info *info,
-		int width, int height, int cpp, int usage, int *pitch)
+		int width, int height, int cpp, int usage, int layout,
+		int *pitch)
 {
 	struct nouveau_bo *bo = NULL;
 	union nouveau_bo_config cfg = {};
@@ -106,6 +107,17 @@ static struct nouveau_bo *alloc_bo(struct nouveau_info *info,
 		align = 64;
 	}
 
+	/* the layout policy overrides the usage */
+	if (layout == GRALLOC_DRM_LAYOUT_LINEAR) {
+		sw_indicator = 1;
+		if (info->arch < NV_TESLA && !scanout)
+			tiled = 0;
+	}
+	else if (layout == GRALLOC_DRM_LAYOUT_TILED) {
+		sw_indicator = 0;
+		tiled = 1;
+	}
+
 	*pitch = ALIGN(width * cpp, align);
 
 	if (tiled) {
@@ -220,10 +232,18 @@ static struct gralloc_drm_bo_t *nouveau_alloc(struct gralloc_drm_drv_t *drv,
 	if (!nb)
 		return NULL;
 
-	if (handle->name) {
-		if (nouveau_bo_name_ref(info->dev, handle->name, &nb->bo)) {
-			ALOGE("failed to create nouveau bo from name %u",
-					handle->name);
+	if (handle->prime_fd >= 0 || handle->name) {
+		int ret;
+
+		if (handle->prime_fd >= 0)
+			ret = nouveau_bo_prime_handle_ref(info->dev,
+					handle->prime_fd, &nb->bo);
+		else
+			ret = nouveau_bo_name_ref(info->dev,
+					handle->name, &nb->bo);
+		if (ret) {
+			ALOGE("failed to import nouveau bo (fd %d, name %u)",
+					handle->prime_fd, handle->name);
 			free(nb);
 			return NULL;
 		}
@@ -236,7 +256,7 @@ static struct gralloc_drm_bo_t *nouveau_alloc(struct gralloc_drm_drv_t *drv,
 		gralloc_drm_align_geometry(handle->format, &width, &height);
 
 		nb->bo = alloc_bo(info, width, height, cpp,
-				  handle->usage, &pitch);
+				  handle->usage, handle->layout, &pitch);
 		if (!nb->bo) {
 			ALOGE("failed to allocate nouveau bo %dx%dx%d",
 					handle->width, handle->height, cpp);
@@ -244,7 +264,8 @@ static struct gralloc_drm_bo_t *nouveau_alloc(struct gralloc_drm_drv_t *drv,
 			return NULL;
 		}
 
-		if (nouveau_bo_name_get(nb->bo,
+		if (!drv->render_node &&
+		    nouveau_bo_name_get(nb->bo,
 					(uint32_t *) &handle->name)) {
 			ALOGE("failed to flink nouveau bo");
 			nouveau_bo_ref(NULL, &nb->bo);
@@ -255,8 +276,7 @@ static struct gralloc_drm_bo_t *nouveau_alloc(struct gralloc_drm_drv_t *drv,
 		handle->stride = pitch;
 	}
 
-	if (handle->usage & GRALLOC_USAGE_HW_FB)
-		nb->base.fb_handle = nb->bo->handle;
+	nb->base.fb_handle = nb->bo->handle;
 
 	nb->base.handle = handle;
 
@@ -94,11 +94,13 @@ static enum pipe_format get_pipe_format(int format)
 	return fmt;
 }
 
-static unsigned get_pipe_bind(int usage)
+static unsigned get_pipe_bind(int usage, int layout)
 {
 	unsigned bind = PIPE_BIND_SHARED;
 
-	if (usage & (GRALLOC_USAGE_SW_READ_OFTEN | GRALLOC_USAGE_SW_WRITE_OFTEN))
+	if (layout == GRALLOC_DRM_LAYOUT_LINEAR ||
+	    (layout != GRALLOC_DRM_LAYOUT_TILED && (usage &
+	     (GRALLOC_USAGE_SW_READ_OFTEN | GRALLOC_USAGE_SW_WRITE_OFTEN))))
 		bind |= PIPE_BIND_LINEAR;
 	if (usage & GRALLOC_USAGE_HW_TEXTURE)
 		bind |= PIPE_BIND_SAMPLER_VIEW;
@@ -117,10 +119,11 @@ static struct pipe_buffer *get_pipe_buffer_locked(struct pipe_manager *pm,
 {
 	struct pipe_buffer *buf;
 	struct pipe_resource templ;
+	struct winsys_handle tmp;
 
 	memset(&templ, 0, sizeof(templ));
 	templ.format = get_pipe_format(handle->format);
-	templ.bind = get_pipe_bind(handle->usage);
+	templ.bind = get_pipe_bind(handle->usage, handle->layout);
 	templ.target = PIPE_TEXTURE_2D;
 
 	if (templ.format == PIPE_FORMAT_NONE ||
@@ -141,9 +144,15 @@ static struct pipe_buffer *get_pipe_buffer_locked(struct pipe_manager *pm,
 	templ.depth0 = 1;
 	templ.array_size = 1;
 
-	if (handle->name) {
-		buf->winsys.type = WINSYS_HANDLE_TYPE_SHARED;
-		buf->winsys.handle = handle->name;
+	if (handle->prime_fd >= 0 || handle->name) {
+		if (handle->prime_fd >= 0) {
+			buf->winsys.type = WINSYS_HANDLE_TYPE_FD;
+			buf->winsys.handle = handle->prime_fd;
+		}
+		else {
+			buf->winsys.type = WINSYS_HANDLE_TYPE_SHARED;
+			buf->winsys.handle = handle->name;
+		}
 		buf->winsys.stride = handle->stride;
 
 		buf->resource = pm->screen->resource_from_handle(pm->screen,
@@ -157,24 +166,22 @@ static struct pipe_buffer *get_pipe_buffer_locked(struct pipe_manager *pm,
 		if (!buf->resource)
 			goto fail;
 
-		buf->winsys.type = WINSYS_HANDLE_TYPE_SHARED;
+		/* render nodes cannot flink, the bo is shared by PRIME fd */
+		buf->winsys.type = (pm->base.render_node) ?
+			WINSYS_HANDLE_TYPE_KMS : WINSYS_HANDLE_TYPE_SHARED;
 		if (!pm->screen->resource_get_handle(pm->screen, pm->context,
 				buf->resource, &buf->winsys, PIPE_HANDLE_USAGE_FRAMEBUFFER_WRITE))
 			goto fail;
 	}
 
-	/* need the gem handle for fb */
-	if (handle->usage & GRALLOC_USAGE_HW_FB) {
-		struct winsys_handle tmp;
-
-		memset(&tmp, 0, sizeof(tmp));
-		tmp.type = WINSYS_HANDLE_TYPE_KMS;
-		if (!pm->screen->resource_get_handle(pm->screen, pm->context,
-				buf->resource, &tmp, PIPE_HANDLE_USAGE_FRAMEBUFFER_WRITE))
-			goto fail;
+	/* need the gem handle for fb and PRIME export */
+	memset(&tmp, 0, sizeof(tmp));
+	tmp.type = WINSYS_HANDLE_TYPE_KMS;
+	if (!pm->screen->resource_get_handle(pm->screen, pm->context,
+			buf->resource, &tmp, PIPE_HANDLE_USAGE_FRAMEBUFFER_WRITE))
+		goto fail;
 
-		buf->base.fb_handle = tmp.handle;
-	}
+	buf->base.fb_handle = tmp.handle;
 
 	return buf;
 
@@ -198,8 +205,14 @@ static struct gralloc_drm_bo_t *pipe_alloc(struct gralloc_drm_drv_t *drv,
 	pthread_mutex_unlock(&pm->mutex);
 
 	if (buf) {
-		handle->name = (int) buf->winsys.handle;
-		handle->stride = (int) buf->winsys.stride;
+		/* an imported handle has them already */
+		if (buf->winsys.type == WINSYS_HANDLE_TYPE_SHARED) {
+			handle->name = (int) buf->winsys.handle;
+			handle->stride = (int) buf->winsys.stride;
+		}
+		else if (buf->winsys.type == WINSYS_HANDLE_TYPE_KMS) {
+			handle->stride = (int) buf->winsys.stride;
+		}
 
 		buf->base.handle = handle;
 	}
@@ -252,15 +265,32 @@ static int pipe_map(struct gralloc_drm_drv_t *drv,
 		assert(!buf->transfer);
 
 		/*
-		 * ignore x, y, w and h so that returned addr points at the
-		 * start of the buffer
+		 * transfer only the locked box, which avoids staging copies of
+		 * the whole resource, and only the box is written back
 		 */
 		*addr = pipe_transfer_map(pm->context, buf->resource,
-					  0, 0, usage, 0, 0,
-					  buf->resource->width0, buf->resource->height0,
+					  0, 0, usage, x, y, w, h,
 					  &buf->transfer);
+
+		/* the box cannot be addressed with the stride of the handle */
+		if (*addr && buf->transfer->stride != bo->handle->stride &&
+		    (w != buf->resource->width0 || h != buf->resource->height0)) {
+			pipe_transfer_unmap(pm->context, buf->transfer);
+			buf->transfer = NULL;
+			x = 0;
+			y = 0;
+			*addr = pipe_transfer_map(pm->context, buf->resource,
+						  0, 0, usage, 0, 0,
+						  buf->resource->width0,
+						  buf->resource->height0,
+						  &buf->transfer);
+		}
+
 		if (*addr == NULL)
 			err = -ENOMEM;
+		else
+			*addr = (char *) *addr - y * bo->handle->stride -
+				x * gralloc_drm_get_bpp(bo->handle->format);
 	}
 
 	pthread_mutex_unlock(&pm->mutex);
@@ -286,6 +316,65 @@ static void pipe_unmap(struct gralloc_drm_drv_t *drv,
 	pthread_mutex_unlock(&pm->mutex);
 }
 
+/*
+ * Blit with the 3D pipe, which scales with a linear filter and converts
+ * between formats.
+ */
+static void pipe_scale_blit(struct gralloc_drm_drv_t *drv,
+		struct gralloc_drm_bo_t *dst_bo,
+		struct gralloc_drm_bo_t *src_bo,
+		uint16_t dst_x1, uint16_t dst_y1,
+		uint16_t dst_x2, uint16_t dst_y2,
+		uint16_t src_x1, uint16_t src_y1,
+		uint16_t src_x2, uint16_t src_y2)
+{
+	struct pipe_manager *pm = (struct pipe_manager *) drv;
+	struct pipe_buffer *dst = (struct pipe_buffer *) dst_bo;
+	struct pipe_buffer *src = (struct pipe_buffer *) src_bo;
+	struct pipe_blit_info info;
+
+	if (dst_x2 > dst_bo->handle->width)
+		dst_x2 = dst_bo->handle->width;
+	if (dst_y2 > dst_bo->handle->height)
+		dst_y2 = dst_bo->handle->height;
+	if (src_x2 > src_bo->handle->width)
+		src_x2 = src_bo->handle->width;
+	if (src_y2 > src_bo->handle->height)
+		src_y2 = src_bo->handle->height;
+
+	if (dst_x2 <= dst_x1 || dst_y2 <= dst_y1 ||
+	    src_x2 <= src_x1 || src_y2 <= src_y1)
+		return;
+
+	memset(&info, 0, sizeof(info));
+	info.dst.resource = dst->resource;
+	info.dst.format = dst->resource->format;
+	u_box_2d(dst_x1, dst_y1, dst_x2 - dst_x1, dst_y2 - dst_y1,
+			&info.dst.box);
+	info.src.resource = src->resource;
+	info.src.format = src->resource->format;
+	u_box_2d(src_x1, src_y1, src_x2 - src_x1, src_y2 - src_y1,
+			&info.src.box);
+	info.mask = PIPE_MASK_RGBA;
+	info.filter = PIPE_TEX_FILTER_LINEAR;
+
+	pthread_mutex_lock(&pm->mutex);
+
+	if (!pm->context) {
+		pm->context = pm->screen->context_create(pm->screen, NULL, 0);
+		if (!pm->context) {
+			ALOGE("failed to create pipe context");
+			pthread_mutex_unlock(&pm->mutex);
+			return;
+		}
+	}
+
+	pm->context->blit(pm->context, &info);
+	pm->context->flush(pm->context, NULL, 0);
+
+	pthread_mutex_unlock(&pm->mutex);
+}
+
 static void pipe_blit(struct gralloc_drm_drv_t *drv,
 		struct gralloc_drm_bo_t *dst_bo,
 		struct gralloc_drm_bo_t *src_bo,
@@ -303,7 +392,10 @@ static void pipe_blit(struct gralloc_drm_drv_t *drv,
 	    dst_bo->handle->height != src_bo->handle->height ||
 	    dst_bo->handle->stride != src_bo->handle->stride ||
 	    dst_bo->handle->format != src_bo->handle->format) {
-		ALOGE("copy between incompatible buffers");
+		/* resource_copy_region needs matching resources */
+		pipe_scale_blit(drv, dst_bo, src_bo,
+				dst_x1, dst_y1, dst_x2, dst_y2,
+				src_x1, src_y1, src_x2, src_y2);
 		return;
 	}
 
@@ -337,6 +429,41 @@ static void pipe_blit(struct gralloc_drm_drv_t *drv,
 	pthread_mutex_unlock(&pm->mutex);
 }
 
+static int pipe_clear(struct gralloc_drm_drv_t *drv,
+		struct gralloc_drm_bo_t *bo)
+{
+	struct pipe_manager *pm = (struct pipe_manager *) drv;
+	struct pipe_buffer *buf = (struct pipe_buffer *) bo;
+	static const uint8_t zero[16];
+	struct pipe_box box;
+	int err = 0;
+
+	pthread_mutex_lock(&pm->mutex);
+
+	if (!pm->context) {
+		pm->context = pm->screen->context_create(pm->screen, NULL, 0);
+		if (!pm->context) {
+			ALOGE("failed to create pipe context");
+			err = -ENOMEM;
+		}
+	}
+
+	if (!err && !pm->context->clear_texture)
+		err = -ENOSYS;
+
+	if (!err) {
+		u_box_2d(0, 0, buf->resource->width0,
+				buf->resource->height0, &box);
+		pm->context->clear_texture(pm->context,
+				buf->resource, 0, &box, zero);
+		pm->context->flush(pm->context, NULL, 0);
+	}
+
+	pthread_mutex_unlock(&pm->mutex);
+
+	return err;
+}
+
 static void pipe_init_kms_features(struct gralloc_drm_drv_t *drv, struct gralloc_drm_t *drm)
 {
 	struct pipe_manager *pm = (struct pipe_manager *) drv;
@@ -401,6 +528,8 @@ struct gralloc_drm_drv_t *gralloc_drm_drv_create_for_pipe(int fd, const char *na
 	pm->base.map = pipe_map;
 	pm->base.unmap = pipe_unmap;
 	pm->base.blit = pipe_blit;
+	pm->base.scale_blit = pipe_scale_blit;
+	pm->base.clear = pipe_clear;
 
 	return &pm->base;
 
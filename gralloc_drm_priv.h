@@ -25,6 +25,7 @@
 #define _GRALLOC_DRM_PRIV_H_
 
 #include <pthread.h>
+#include <sys/types.h>
 #include <xf86drm.h>
 #include <xf86drmMode.h>
 
@@ -34,12 +35,20 @@
 extern "C" {
 #endif
 
-/* how a bo is posted */
+/* how a bo is posted, also indexes gralloc_drm_post_stats.swap_modes */
 enum drm_swap_mode {
 	DRM_SWAP_NOOP,
 	DRM_SWAP_FLIP,
 	DRM_SWAP_COPY,
 	DRM_SWAP_SETCRTC,
+	DRM_SWAP_ATOMIC,
+};
+
+/* the layout of a new bo, from gralloc_drm_layout_choose */
+enum {
+	GRALLOC_DRM_LAYOUT_AUTO, /* the driver picks it */
+	GRALLOC_DRM_LAYOUT_LINEAR,
+	GRALLOC_DRM_LAYOUT_TILED,
 };
 
 enum drm_output_mode {
@@ -48,14 +57,43 @@ enum drm_output_mode {
 	DRM_OUTPUT_EXTENDED,
 };
 
+/* property ids of a plane, for atomic commits */
+struct gralloc_drm_plane_props {
+	uint32_t fb_id;
+	uint32_t crtc_id;
+	uint32_t src_x;
+	uint32_t src_y;
+	uint32_t src_w;
+	uint32_t src_h;
+	uint32_t crtc_x;
+	uint32_t crtc_y;
+	uint32_t crtc_w;
+	uint32_t crtc_h;
+	uint32_t in_fence_fd; /* 0 when not supported */
+	uint32_t zpos;        /* 0 when not supported */
+};
+
 struct gralloc_drm_plane_t {
 	drmModePlane *drm_plane;
 
+	/* DRM_PLANE_TYPE_*, overlay unless atomic is enabled */
+	uint32_t type;
+	struct gralloc_drm_plane_props props;
+
+	/* IN_FORMATS, NULL when the modifiers are not known */
+	drmModePropertyBlobPtr in_formats;
+
 	/* plane has been set to display a layer */
 	uint32_t active;
 
-	/* handle to display */
+	/* handle to display, and the output to display it on */
 	buffer_handle_t handle;
+	struct gralloc_drm_output *output;
+
+	/* stacking order, assigned on reservation when it is mutable */
+	uint64_t zpos;
+	uint64_t zpos_min, zpos_max;
+	int zpos_mutable;
 
 	/* identifier set by hwc */
 	uint32_t id;
@@ -70,12 +108,54 @@ struct gralloc_drm_plane_t {
 	uint32_t dst_w;
 	uint32_t dst_h;
 
-	/* previous buffer, for refcounting */
+	/* previous buffer, for refcounting, and the output it is shown on */
 	struct gralloc_drm_bo_t *prev;
+	struct gralloc_drm_output *prev_output;
+};
+
+/*
+ * A fb of an imported bo.  It is dropped with the bo, and is removed once
+ * it is off the screen.
+ */
+struct gralloc_drm_fb {
+	uint32_t fb_id;
+
+	struct gralloc_drm_bo_t *bo; /* NULL when the bo is freed */
+	unsigned int orphan_flip; /* flip_count when the bo was freed */
+
+	struct gralloc_drm_fb *next;
+};
+
+/* max number of bos in the post queue */
+#define DRM_POST_QUEUE_MAX 4
+
+/* max number of rects in the damage of a post */
+#define DRM_DAMAGE_MAX 8
+#define DRM_IMPORT_BUCKETS 64
+#define DRM_MODIFIERS_MAX 16
+
+/* the damaged region of a post, the whole surface when count is 0 */
+struct gralloc_drm_damage {
+	drmModeClip rects[DRM_DAMAGE_MAX];
+	int count;
+};
+
+/* max swap interval of the flip swap modes */
+#define DRM_SWAP_INTERVAL_MAX 4
+
+struct gralloc_drm_post {
+	struct gralloc_drm_bo_t *bo;
+	struct gralloc_drm_damage damage;
+	int acquire_fence; /* owned by the post, -1 when there is none */
+
+	/* GRALLOC_DRM_PRESENT_* and when to present */
+	int target_type;
+	uint64_t target;
 };
 
 struct gralloc_drm_output
 {
+	struct gralloc_drm_t *drm; /* the user data of its flip events */
 	uint32_t crtc_id;
 	uint32_t connector_id;
 	uint32_t pipe;
@@ -84,9 +164,55 @@ struct gralloc_drm_output
 	int fb_format;
 	int bpp;
 	uint32_t active;
+	drmModeConnection connection; /* as of the last hotplug */
 
 	enum drm_output_mode output_mode;
 
+	/* primary plane of the crtc, for atomic commits */
+	struct gralloc_drm_plane_t *plane;
+	uint32_t out_fence_ptr; /* crtc property, 0 when not supported */
+
+	/* adaptive sync; VRR_ENABLED is 0 unless the connector is capable */
+	uint32_t vrr_enabled_prop;
+	int vrr_enabled; /* as committed */
+
+	/*
+	 * a refresh switch to commit with the next flip, 0 when there is
+	 * none.  Protected by outputs_mutex.
+	 */
+	uint32_t mode_id_prop;
+	uint32_t mode_blob;
+	drmModeModeInfo pending_mode;
+
+	/*
+	 * a cloned output scans out the primary bo with the plane scaler
+	 * when 1, and is blitted to when -1; 0 until the layout of the bo
+	 * below is tested
+	 */
+	int scanout_clone;
+	int clone_width, clone_height, clone_format;
+	uint64_t clone_modifier;
+
+	/*
+	 * swapchain of an extended output, which flips on its own.  The bos
+	 * are referenced, and the fronts are protected by event_mutex.
+	 */
+	struct gralloc_drm_bo_t *current_front, *next_front;
+	int first_post;
+	int swap_interval;
+	unsigned int last_swap; /* vblank of the last flip */
+
+	/*
+	 * cursor, a dumb bo mapped for the CPU, 0 until it is first set.
+	 * Protected by outputs_mutex.
+	 */
+	uint32_t cursor_handle;
+	void *cursor_map;
+	uint64_t cursor_size;
+	uint32_t cursor_pitch;
+	int cursor_x, cursor_y; /* of the hotspot */
+	int cursor_hot_x, cursor_hot_y;
+
 	/* 'private fb' for this output */
 	struct gralloc_drm_bo_t *bo;
 };
@@ -95,6 +221,36 @@ struct gralloc_drm_t {
 	/* initialized by gralloc_drm_create */
 	int fd;
 	struct gralloc_drm_drv_t *drv;
+	/*
+	 * drv allocates on the render node of the card when render_node is
+	 * set, without flink; fd stays the card node, for KMS and the master
+	 */
+	int render_node;
+	int drv_fd; /* the fd of drv */
+
+	/*
+	 * render device, when it is not the display device above; -1 and
+	 * NULL otherwise.  Bos that are not scanned out are allocated on it.
+	 */
+	int render_fd;
+	struct gralloc_drm_drv_t *render_drv;
+
+	/* usage to layout policy of the bos */
+	struct gralloc_drm_layouts *layouts;
+
+	/* freed bos never shared, kept for reuse, most recently freed first */
+	pthread_mutex_t cache_mutex;
+	struct gralloc_drm_bo_t *cache_head, *cache_tail;
+	size_t cache_size, cache_budget;
+
+	/* bos imported by PRIME fd, hashed by dma-buf inode */
+	pthread_mutex_t import_mutex;
+	struct gralloc_drm_bo_t *import_table[DRM_IMPORT_BUCKETS];
+
+	/* blits with the CPU when drv->blit is not set */
+	struct gralloc_drm_blitter *blitter;
+	/* serializes the driver blits, clears and flushes of the threads */
+	pthread_mutex_t blit_mutex;
 
 	/* initialized by gralloc_drm_init_kms */
 	drmModeResPtr resources;
@@ -114,20 +270,84 @@ struct gralloc_drm_t {
 	/* initialized by drv->init_kms_features */
 	enum drm_swap_mode swap_mode;
 	int swap_interval;
+	int swap_interval_max; /* initialized by gralloc_drm_init_kms */
 	int mode_quirk_vmwgfx;
 	int mode_sync_flip; /* page flip should block */
 	int vblank_secondary;
+	int atomic; /* DRM_CLIENT_CAP_ATOMIC is enabled */
+	int vrr; /* adaptive sync is used on capable outputs */
 
 	drmEventContext evctx;
 
 	int first_post;
+	struct gralloc_drm_damage damage; /* of the next post */
 	struct gralloc_drm_bo_t *current_front, *next_front;
+	/* a reference of current_front, swapped under event_mutex */
+	struct gralloc_drm_bo_t *front_ref;
 	int waiting_flip;
+	int fb_modifiers; /* DRM_CAP_ADDFB2_MODIFIERS */
+	uint32_t cursor_width, cursor_height; /* DRM_CAP_CURSOR_* */
+	int clone_scanout; /* cloned outputs may scan out the primary bo */
+	unsigned int flip_count; /* flips completed */
+	unsigned int flip_pipes; /* pipes of the flip events next_front waits for */
+	int crtc_in_event; /* DRM_CAP_CRTC_IN_VBLANK_EVENT */
+
+	/* phase of the vblanks of the primary, from the last flip event */
+	uint64_t vblank_us; /* 0 until the first flip */
+	unsigned int vblank_seq;
+
+	/* flip events are read by one posting thread at a time */
+	pthread_mutex_t event_mutex;
+	pthread_cond_t event_cond;
+	int event_reader;
+
+	/* fences of the post in progress */
+	int in_fence; /* waited for and closed by the post */
+	int *out_fence; /* present fence to return, may be NULL */
 	unsigned int last_swap;
 
 	/* plane support */
 	drmModePlaneResPtr plane_resources;
 	struct gralloc_drm_plane_t *planes;
+
+	/* post queue, disabled when post_queue_size is 0 */
+	int post_queue_size; /* max bos posted but not yet released */
+	struct gralloc_drm_post post_queue[DRM_POST_QUEUE_MAX];
+	unsigned int post_head, post_count;
+	int post_pending; /* bos queued, flipping or on screen */
+	int post_exit;
+	pthread_t post_thread;
+	pthread_mutex_t post_mutex;
+	pthread_cond_t post_cond;
+
+	/*
+	 * a capture of a front, run on capture_thread, which is started by
+	 * the first capture.  The readback bo is kept for the next one.
+	 */
+	pthread_mutex_t capture_mutex;
+	pthread_cond_t capture_cond;
+	pthread_t capture_thread;
+	int capture_started, capture_pending, capture_exit;
+	int capture_display, capture_width, capture_height;
+	gralloc_drm_capture_t capture_callback;
+	void *capture_data;
+	struct gralloc_drm_bo_t *capture_bo;
+
+	/* fbs of imported bos, and of freed ones until off the screen */
+	pthread_mutex_t fb_mutex;
+	struct gralloc_drm_fb *fb_head;
+
+	gralloc_drm_post_release_t post_release;
+	void *post_release_data;
+
+	gralloc_drm_present_t present;
+	void *present_data;
+
+	/* post path statistics, updated only when stats_enabled is set */
+	int stats_enabled;
+	struct gralloc_drm_post_stats stats;
+	uint64_t stats_post_us; /* start of the current post */
+	uint64_t stats_flip_us; /* start of the post of next_front */
 };
 
 struct drm_module_t {
@@ -144,6 +364,36 @@ struct drm_module_t {
 
 	pthread_mutex_t mutex;
 	struct gralloc_drm_t *drm;
+
+	/* appended, to keep the layout of the members above */
+	int (*hwc_reserve_display_plane) (struct gralloc_drm_t *mod,
+		buffer_handle_t handle, uint32_t id, int display,
+		uint32_t dst_x, uint32_t dst_y, uint32_t dst_w, uint32_t dst_h,
+		uint32_t src_x, uint32_t src_y, uint32_t src_w, uint32_t src_h);
+
+	/* HWC API of the extended outputs */
+	int (*hwc_set_display_mode) (struct gralloc_drm_t *mod,
+		int display, int extended);
+	int (*hwc_set_display_swap_interval) (struct gralloc_drm_t *mod,
+		int display, int interval);
+	int (*hwc_set_display_refresh) (struct gralloc_drm_t *mod,
+		int display, int rate);
+	int (*hwc_post_display) (struct gralloc_drm_t *mod,
+		buffer_handle_t handle, int display,
+		int acquire_fence, int *present_fence);
+
+	/* HWC cursor API, updating the cursors without posts */
+	void (*hwc_get_cursor_size) (struct gralloc_drm_t *mod,
+		uint32_t *width, uint32_t *height);
+	int (*hwc_set_cursor) (struct gralloc_drm_t *mod, int display,
+		buffer_handle_t handle, int hot_x, int hot_y);
+	int (*hwc_move_cursor) (struct gralloc_drm_t *mod, int display,
+		int x, int y);
+
+	/* HWC capture of the front of a display, done on another thread */
+	int (*hwc_capture) (struct gralloc_drm_t *mod, int display,
+		int width, int height, gralloc_drm_capture_t callback,
+		void *data);
 };
 
 struct gralloc_drm_drv_t {
@@ -158,11 +408,23 @@ struct gralloc_drm_drv_t {
 	struct gralloc_drm_bo_t *(*alloc)(struct gralloc_drm_drv_t *drv,
 			                  struct gralloc_drm_handle_t *handle);
 
+	/*
+	 * allocate a bo with the best of the modifiers the consumers accept,
+	 * and set handle->modifier; optional
+	 */
+	struct gralloc_drm_bo_t *(*alloc_with_modifiers)(
+			struct gralloc_drm_drv_t *drv,
+			struct gralloc_drm_handle_t *handle,
+			const uint64_t *modifiers, int count);
+
 	/* free a bo */
 	void (*free)(struct gralloc_drm_drv_t *drv,
 		     struct gralloc_drm_bo_t *bo);
 
-	/* map a bo for CPU access */
+	/*
+	 * map a bo for CPU access.  Only the rect x, y, w, h needs to be
+	 * accessible, but addr always points at the start of the bo.
+	 */
 	int (*map)(struct gralloc_drm_drv_t *drv,
 		   struct gralloc_drm_bo_t *bo,
 		   int x, int y, int w, int h, int enable_write, void **addr);
@@ -171,7 +433,10 @@ struct gralloc_drm_drv_t {
 	void (*unmap)(struct gralloc_drm_drv_t *drv,
 		      struct gralloc_drm_bo_t *bo);
 
-	/* blit between two bo's, used for DRM_SWAP_COPY and general blitting */
+	/*
+	 * blit between two bo's, used for DRM_SWAP_COPY and general blitting.
+	 * The blit may be queued until flush is called.
+	 */
 	void (*blit)(struct gralloc_drm_drv_t *drv,
 		     struct gralloc_drm_bo_t *dst,
 		     struct gralloc_drm_bo_t *src,
@@ -180,10 +445,27 @@ struct gralloc_drm_drv_t {
 		     uint16_t src_x1, uint16_t src_y1,
 		     uint16_t src_x2, uint16_t src_y2);
 
-	/* query component offsets, strides and handles for a format */
-	void (*resolve_format)(struct gralloc_drm_drv_t *drv,
-		     struct gralloc_drm_bo_t *bo,
-		     uint32_t *pitches, uint32_t *offsets, uint32_t *handles);
+	/*
+	 * blit with scaling or format conversion, for the rects and formats
+	 * blit does not support; optional
+	 */
+	void (*scale_blit)(struct gralloc_drm_drv_t *drv,
+		     struct gralloc_drm_bo_t *dst,
+		     struct gralloc_drm_bo_t *src,
+		     uint16_t dst_x1, uint16_t dst_y1,
+		     uint16_t dst_x2, uint16_t dst_y2,
+		     uint16_t src_x1, uint16_t src_y1,
+		     uint16_t src_x2, uint16_t src_y2);
+
+	/* submit the queued blits, optional for drivers that blit immediately */
+	void (*flush)(struct gralloc_drm_drv_t *drv);
+
+	/* zero a bo on the GPU, optional */
+	int (*clear)(struct gralloc_drm_drv_t *drv,
+		     struct gralloc_drm_bo_t *bo);
+
+	/* set by gralloc_drm_create; bos have no flink names when true */
+	int render_node;
 };
 
 struct gralloc_drm_bo_t {
@@ -193,14 +475,81 @@ struct gralloc_drm_bo_t {
 	int imported;  /* the handle is from a remote proces when true */
 	int fb_handle; /* the GEM handle of the bo */
 	int fb_id;     /* the fb id */
+	struct gralloc_drm_fb *fb; /* fb cache entry of fb_id, if any */
 
+	/* protects lock_count, locked_for and CPU mappings */
+	pthread_mutex_t mutex;
 	int lock_count;
 	int locked_for;
 
-	unsigned int refcount;
+	int32_t refcount; /* updated atomically */
+
+	/* the bo has stale contents and is zeroed before use */
+	int need_clear;
+
+	/* bo cache */
+	size_t size;
+	int exported; /* the handle was given out, and the bo is not cached */
+	struct gralloc_drm_bo_t *cache_prev, *cache_next;
+
+	/* import cache; the bo owns a copy of the handle when linked */
+	int import_linked;
+	dev_t import_dev;
+	ino_t import_ino;
+	struct gralloc_drm_bo_t *import_next;
+
+	/* the bo is on the render device, and fb_handle is a handle of it */
+	int render;
+	/* GEM handle on the card node, of a bo off it, 0 until needed */
+	uint32_t kms_handle;
+	/* a display bo imported on the render device, for its blits */
+	struct gralloc_drm_bo_t *render_import;
 };
 
+/*
+ * Return the driver of the device a bo is on.
+ */
+static inline struct gralloc_drm_drv_t *gralloc_drm_bo_drv(
+		const struct gralloc_drm_bo_t *bo)
+{
+	return (bo->render) ? bo->drm->render_drv : bo->drm->drv;
+}
+
+struct gralloc_drm_handle_t *gralloc_drm_handle_create(int width,
+		int height, int format, int usage);
+size_t gralloc_drm_handle_size(const struct gralloc_drm_handle_t *handle);
+void gralloc_drm_handle_init_planes(struct gralloc_drm_handle_t *handle);
+uint32_t gralloc_drm_bo_get_kms_handle(struct gralloc_drm_bo_t *bo);
+void gralloc_drm_bo_get_planes(const struct gralloc_drm_bo_t *bo,
+		uint32_t *pitches, uint32_t *offsets, uint32_t *handles);
+int gralloc_drm_get_modifiers(struct gralloc_drm_t *drm, int format, int usage,
+		uint64_t *modifiers, int max);
+
+struct gralloc_drm_bo_t *gralloc_drm_bo_render_import(
+		struct gralloc_drm_bo_t *bo);
+
+struct gralloc_drm_layouts *gralloc_drm_layouts_create(int fd, int render_fd);
+void gralloc_drm_layouts_destroy(struct gralloc_drm_layouts *layouts);
+int gralloc_drm_layout_choose(struct gralloc_drm_layouts *layouts,
+		const struct gralloc_drm_handle_t *handle, int render);
+
+struct gralloc_drm_blitter *gralloc_drm_blitter_create(void);
+void gralloc_drm_blitter_destroy(struct gralloc_drm_blitter *blitter);
+void gralloc_drm_blit(struct gralloc_drm_t *drm,
+		struct gralloc_drm_bo_t *dst, struct gralloc_drm_bo_t *src,
+		uint16_t dst_x1, uint16_t dst_y1,
+		uint16_t dst_x2, uint16_t dst_y2,
+		uint16_t src_x1, uint16_t src_y1,
+		uint16_t src_x2, uint16_t src_y2);
+void gralloc_drm_blit_unshared(struct gralloc_drm_t *drm,
+		struct gralloc_drm_bo_t *dst, struct gralloc_drm_bo_t *src,
+		uint16_t dst_x1, uint16_t dst_y1,
+		uint16_t dst_x2, uint16_t dst_y2,
+		uint16_t src_x1, uint16_t src_y1,
+		uint16_t src_x2, uint16_t src_y2);
+
 struct gralloc_drm_drv_t *gralloc_drm_drv_create_for_pipe(int fd, const char *name);
+struct gralloc_drm_drv_t *gralloc_drm_drv_create_for_dumb(int fd);
 
 struct gralloc_drm_drv_t *gralloc_drm_drv_create_for_freedreno(int fd);
 struct gralloc_drm_drv_t *gralloc_drm_drv_create_for_intel(int fd);
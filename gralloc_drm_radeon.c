@@ -36,6 +36,8 @@
 #include <radeon_drm.h>
 #include <radeon_bo_gem.h>
 #include <radeon_bo.h>
+#include <radeon_cs_gem.h>
+#include <radeon_cs.h>
 
 #include "gralloc_drm.h"
 #include "gralloc_drm_priv.h"
@@ -45,6 +47,17 @@
 
 #define RADEON_GPU_PAGE_SIZE 4096
 
+#define RADEON_CP_PACKET3           (3 << 30)
+#define PKT3(op, count)             (RADEON_CP_PACKET3 | ((count) << 16) | ((op) << 8))
+#define PKT3_CP_DMA                 0x41
+#define PKT3_CP_DMA_CP_SYNC         (1 << 31)
+#define PKT3_CP_DMA_SRC_SEL_DATA    (2 << 29)
+#define CP_DMA_MAX_BYTE_COUNT       ((1 << 21) - 8)
+
+/* CP_DMA packet plus the reloc of the dst */
+#define CP_DMA_FILL_DWORDS          8
+#define CLEAR_CS_DWORDS             256
+
 struct radeon_info {
 	struct gralloc_drm_drv_t base;
 
@@ -67,6 +80,10 @@ struct radeon_info {
 
 	int vram_size;
 	int gart_size;
+
+	/* for clearing bos, created on the first clear */
+	struct radeon_cs_manager *csm;
+	struct radeon_cs *cs;
 };
 
 struct radeon_buffer {
@@ -171,7 +188,10 @@ static uint32_t radeon_get_tiling(struct radeon_info *info,
 {
 	int sw = (GRALLOC_USAGE_SW_WRITE_MASK | GRALLOC_USAGE_SW_READ_MASK);
 
-	if ((handle->usage & sw) && !info->allow_color_tiling)
+	if (handle->layout == GRALLOC_DRM_LAYOUT_LINEAR)
+		return 0;
+	if (handle->layout != GRALLOC_DRM_LAYOUT_TILED &&
+	    (handle->usage & sw) && !info->allow_color_tiling)
 		return 0;
 
 	if (info->chip_family >= CHIP_FAMILY_R600)
@@ -186,7 +206,7 @@ static struct radeon_bo *radeon_alloc(struct radeon_info *info,
 	struct radeon_bo *rbo;
 	int aligned_width, aligned_height;
 	int pitch, size, base_align;
-	uint32_t tiling, domain;
+	uint32_t tiling, domain, flags;
 	int cpp;
 
 	cpp = gralloc_drm_get_bpp(handle->format);
@@ -215,11 +235,21 @@ static struct radeon_bo *radeon_alloc(struct radeon_info *info,
 	    (handle->usage & GRALLOC_USAGE_SW_READ_OFTEN))
 		domain = RADEON_GEM_DOMAIN_GTT;
 
+	/*
+	 * GTT is mapped cached and snooped by default, which is what bos
+	 * mostly read by CPU want.  Others are better off write-combined.
+	 */
+	flags = 0;
+#ifdef RADEON_GEM_GTT_WC
+	if (!gralloc_drm_usage_cpu_cached(handle->usage))
+		flags |= RADEON_GEM_GTT_WC;
+#endif
+
 	pitch = aligned_width * cpp;
 	size = ALIGN(aligned_height * pitch, RADEON_GPU_PAGE_SIZE);
 	base_align = radeon_get_base_align(info, cpp, tiling);
 
-	rbo = radeon_bo_open(info->bufmgr, 0, size, base_align, domain, 0);
+	rbo = radeon_bo_open(info->bufmgr, 0, size, base_align, domain, flags);
 	if (!rbo) {
 		ALOGE("failed to allocate rbo %dx%dx%d",
 				handle->width, handle->height, cpp);
@@ -229,7 +259,8 @@ static struct radeon_bo *radeon_alloc(struct radeon_info *info,
 	if (tiling)
 		radeon_bo_set_tiling(rbo, tiling, pitch);
 
-	if (radeon_gem_get_kernel_name(rbo,
+	if (!info->base.render_node &&
+	    radeon_gem_get_kernel_name(rbo,
 				(uint32_t *) &handle->name)) {
 		ALOGE("failed to flink rbo");
 		radeon_bo_unref(rbo);
@@ -241,14 +272,87 @@ static struct radeon_bo *radeon_alloc(struct radeon_info *info,
 	return rbo;
 }
 
-static void radeon_zero(struct radeon_info *info,
-		struct radeon_bo *rbo)
+static int radeon_init_cs(struct radeon_info *info)
+{
+	info->csm = radeon_cs_manager_gem_ctor(info->fd);
+	if (!info->csm)
+		return -ENOMEM;
+
+	info->cs = radeon_cs_create(info->csm, CLEAR_CS_DWORDS);
+	if (!info->cs) {
+		radeon_cs_manager_gem_dtor(info->csm);
+		info->csm = NULL;
+		return -ENOMEM;
+	}
+
+	radeon_cs_set_limit(info->cs, RADEON_GEM_DOMAIN_VRAM, info->vram_size);
+	radeon_cs_set_limit(info->cs, RADEON_GEM_DOMAIN_GTT, info->gart_size);
+
+	return 0;
+}
+
+/*
+ * Fill a bo with zeros using CP DMA.  Only evergreen and northern islands are
+ * supported, as SI and later require a VM.
+ */
+static int drm_gem_radeon_clear(struct gralloc_drm_drv_t *drv,
+		struct gralloc_drm_bo_t *bo)
 {
-	/* should use HW clear... */
-	if (!radeon_bo_map(rbo, 1)) {
-		memset(rbo->ptr, 0, rbo->size);
-		radeon_bo_unmap(rbo);
+	struct radeon_info *info = (struct radeon_info *) drv;
+	struct radeon_buffer *rbuf = (struct radeon_buffer *) bo;
+	struct radeon_bo *rbo = rbuf->rbo;
+	uint32_t domains = RADEON_GEM_DOMAIN_VRAM | RADEON_GEM_DOMAIN_GTT;
+	uint32_t offset = 0;
+	int ret;
+
+	if (info->chip_family < CHIP_FAMILY_CEDAR ||
+	    info->chip_family >= CHIP_FAMILY_TAHITI)
+		return -ENOSYS;
+
+	if (!info->cs && radeon_init_cs(info))
+		return -ENOMEM;
+
+	while (offset < rbo->size) {
+		uint32_t count = rbo->size - offset;
+		uint32_t sync = 0;
+
+		if (count > CP_DMA_MAX_BYTE_COUNT)
+			count = CP_DMA_MAX_BYTE_COUNT;
+		/* wait for the fill to finish with the last packet */
+		if (offset + count == rbo->size)
+			sync = PKT3_CP_DMA_CP_SYNC;
+
+		if (info->cs->cdw + CP_DMA_FILL_DWORDS > CLEAR_CS_DWORDS) {
+			ret = radeon_cs_emit(info->cs);
+			radeon_cs_erase(info->cs);
+			if (ret)
+				return ret;
+		}
+
+		radeon_cs_begin(info->cs, CP_DMA_FILL_DWORDS,
+				__FILE__, __func__, __LINE__);
+		radeon_cs_write_dword(info->cs, PKT3(PKT3_CP_DMA, 4));
+		radeon_cs_write_dword(info->cs, 0); /* DATA */
+		radeon_cs_write_dword(info->cs, sync | PKT3_CP_DMA_SRC_SEL_DATA);
+		radeon_cs_write_dword(info->cs, offset); /* DST_ADDR_LO */
+		radeon_cs_write_dword(info->cs, 0); /* DST_ADDR_HI */
+		radeon_cs_write_dword(info->cs, count);
+		ret = radeon_cs_write_reloc(info->cs, rbo, 0, domains, 0);
+		radeon_cs_end(info->cs, __FILE__, __func__, __LINE__);
+		if (ret) {
+			radeon_cs_erase(info->cs);
+			return ret;
+		}
+
+		offset += count;
 	}
+
+	ret = radeon_cs_emit(info->cs);
+	radeon_cs_erase(info->cs);
+	if (ret)
+		ALOGE("failed to clear rbo with CP DMA");
+
+	return ret;
 }
 
 static struct gralloc_drm_bo_t *
@@ -261,12 +365,17 @@ drm_gem_radeon_alloc(struct gralloc_drm_drv_t *drv, struct gralloc_drm_handle_t
 	if (!rbuf)
 		return NULL;
 
-	if (handle->name) {
-		rbuf->rbo = radeon_bo_open(info->bufmgr,
-				handle->name, 0, 0, 0, 0);
+	if (handle->prime_fd >= 0 || handle->name) {
+		if (handle->prime_fd >= 0)
+			rbuf->rbo = radeon_gem_bo_open_prime(info->bufmgr,
+					handle->prime_fd,
+					gralloc_drm_handle_size(handle));
+		else
+			rbuf->rbo = radeon_bo_open(info->bufmgr,
+					handle->name, 0, 0, 0, 0);
 		if (!rbuf->rbo) {
-			ALOGE("failed to create rbo from name %u",
-					handle->name);
+			ALOGE("failed to import rbo (fd %d, name %u)",
+					handle->prime_fd, handle->name);
 			free(rbuf);
 			return NULL;
 		}
@@ -278,12 +387,14 @@ drm_gem_radeon_alloc(struct gralloc_drm_drv_t *drv, struct gralloc_drm_handle_t
 			return NULL;
 		}
 
-		/* Android expects the buffer to be zeroed */
-		radeon_zero(info, rbuf->rbo);
+		/*
+		 * Android expects the buffer to be zeroed, and VRAM is not
+		 * zeroed by the kernel
+		 */
+		rbuf->base.need_clear = 1;
 	}
 
-	if (handle->usage & GRALLOC_USAGE_HW_FB)
-		rbuf->base.fb_handle = rbuf->rbo->handle;
+	rbuf->base.fb_handle = rbuf->rbo->handle;
 
 	rbuf->base.handle = handle;
 
@@ -341,6 +452,10 @@ static void drm_gem_radeon_destroy(struct gralloc_drm_drv_t *drv)
 {
 	struct radeon_info *info = (struct radeon_info *) drv;
 
+	if (info->cs) {
+		radeon_cs_destroy(info->cs);
+		radeon_cs_manager_gem_dtor(info->csm);
+	}
 	radeon_bo_manager_gem_dtor(info->bufmgr);
 	free(info);
 }
@@ -547,6 +662,7 @@ struct gralloc_drm_drv_t *gralloc_drm_drv_create_for_radeon(int fd)
 	info->base.free = drm_gem_radeon_free;
 	info->base.map = drm_gem_radeon_map;
 	info->base.unmap = drm_gem_radeon_unmap;
+	info->base.clear = drm_gem_radeon_clear;
 
 	return &info->base;
 }